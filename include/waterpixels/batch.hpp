@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	/*
+	* Input images of a batch : the binary ppm (P6) files of a directory in alphabetical order, or the paths listed in a
+	* text file (one per line, empty lines ignored)
+	*/
+	std::vector<std::string> listBatchInputs(const std::string& input);
+
+	/*
+	* Waterpixels of a whole set of images in one process. Loading image N+1 and saving image N-1 overlap the
+	* computation of image N (at most one image waits on each side), and the grid and the voronoi graph are only rebuilt
+	* when the image size changes. Throughput is reported at the end.
+	@param input: directory or list file, see listBatchInputs()
+	@param outputDirectory: receives one <input name>.pgm delimitation per input image
+	@param sigma, k, cellScale: see waterpixel()
+	@param blurRadius: radius of the opening / closing prefilter, no prefiltering if lower than 1
+	@param options: see WaterpixelOptions, the debug images are never written
+	*/
+	void waterpixelBatch(const std::string& input, const std::string& outputDirectory, float sigma, float k,
+	                     float cellScale, int blurRadius, const WaterpixelOptions& options = {});
+}
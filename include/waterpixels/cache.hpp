@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+#include "waterpixels/utils.hpp"
+
+namespace WP
+{
+	/*
+	* Content-addressed cache of pipeline stages, kept in a directory and shared by successive runs :
+	* - voronoi graphs, keyed by the image size and the cell centers (so by sigma and the grid type), stored in a raw
+	*   binary layout that is read back (and checked to be a partition of the pixels) instead of rebuilt
+	* - stage images (prefiltered image, gradient...), keyed by the caller (see hashFile() and combineHash()) and
+	*   stored as binary pgm files
+	* Entries are written to a temporary file then renamed, so that several processes can share a directory.
+	*/
+	class StageCache
+	{
+	public:
+		explicit StageCache(const std::string& directory);
+
+		// 64 bits hash of the content of a file
+		[[nodiscard]] static uint64_t hashFile(const std::string& path);
+		// Order-dependent combination of a hash and a value
+		[[nodiscard]] static uint64_t combineHash(uint64_t hash, uint64_t value);
+
+		// Voronoi graph of centers on a width x height image, built and stored on a miss
+		[[nodiscard]] VoronoiGraph voronoi(size_t width, size_t height, const std::vector<glm::ivec2>& centers) const;
+
+		// Return false on a miss
+		[[nodiscard]] bool loadImage(const std::string& stage, uint64_t key, LibTIM::Image<LibTIM::U8>& image) const;
+		void storeImage(const std::string& stage, uint64_t key, LibTIM::Image<LibTIM::U8>& image) const;
+
+		// Image of stage under key, computed by make and stored on a miss
+		template <typename Lambda_T>
+		[[nodiscard]] LibTIM::Image<LibTIM::U8> image(const std::string& stage, uint64_t key, Lambda_T make) const
+		{
+			LibTIM::Image<LibTIM::U8> result;
+			if (loadImage(stage, key, result))
+				return result;
+			result = make();
+			storeImage(stage, key, result);
+			return result;
+		}
+
+	private:
+		[[nodiscard]] std::filesystem::path entryPath(const std::string& stage, uint64_t key,
+		                                              const std::string& extension) const;
+
+		std::filesystem::path directory;
+	};
+}
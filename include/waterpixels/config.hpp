@@ -3,6 +3,8 @@
 // Enable profiler recording and logging
 #define ENABLE_PROFILER true
 
+// Defaults of WP::WaterpixelOptions (see waterpixels.hpp), each can be changed at runtime
+
 // Prompt intermediate images during generation
 #define OUTPUT_DEBUG true
 
@@ -14,3 +16,9 @@
 
 // Choose the Linf distance instead of L2 for spatial regularization
 #define USE_LINF_REG_DISTANCE false
+
+// Run the final watershed on a grid of tiles flooded in parallel (deterministic, but seams may differ from the serial flooding)
+#define USE_TILED_WATERSHED false
+
+// Flood the raw gradient with priorities computed from the distance to the seed of each label (compact watershed)
+#define USE_COMPACT_WATERSHED false
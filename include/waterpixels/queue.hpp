@@ -0,0 +1,61 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace WP
+{
+	// Blocking FIFO between two pipeline stages, push waits while it holds capacity items
+	template <typename T>
+	class BoundedQueue
+	{
+	public:
+		BoundedQueue(size_t _capacity) : capacity(_capacity)
+		{
+		}
+
+		// Return false if the queue was closed (the item is dropped)
+		bool push(T item)
+		{
+			std::unique_lock lock(mutex);
+			notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+			if (closed)
+				return false;
+			items.emplace_back(std::move(item));
+			notEmpty.notify_one();
+			return true;
+		}
+
+		// Empty once the queue is closed and drained
+		std::optional<T> pop()
+		{
+			std::unique_lock lock(mutex);
+			notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+			if (items.empty())
+				return std::nullopt;
+			std::optional<T> item(std::move(items.front()));
+			items.pop_front();
+			notFull.notify_one();
+			return item;
+		}
+
+		// No more pushes : pending items can still be popped
+		void close()
+		{
+			std::lock_guard lock(mutex);
+			closed = true;
+			notFull.notify_all();
+			notEmpty.notify_all();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable notFull;
+		std::condition_variable notEmpty;
+		std::deque<T> items;
+		size_t capacity;
+		bool closed = false;
+	};
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include <libtim/Common/Types.h>
+
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	// Call kernel with the distance as a compile-time constant (std::integral_constant)
+	template <typename Lambda_T>
+	auto withDistance(RegularizationDistance distance, Lambda_T kernel)
+	{
+		if (distance == RegularizationDistance::LInf)
+			return kernel(std::integral_constant<RegularizationDistance, RegularizationDistance::LInf>());
+		return kernel(std::integral_constant<RegularizationDistance, RegularizationDistance::L2>());
+	}
+
+	// Regularization term k * 2d / sigma for every offset (|dx|, |dy|) <= radius to a cell center
+	template <RegularizationDistance Distance>
+	class RegularizationTable
+	{
+	public:
+		RegularizationTable(float _sigma, float _k) : sigma(_sigma), k(_k),
+		                                              radius(2 * static_cast<int64_t>(std::ceil(_sigma)) + 1),
+		                                              values((radius + 1) * (radius + 1))
+		{
+			for (int64_t dy = 0; dy <= radius; ++dy)
+				for (int64_t dx = 0; dx <= radius; ++dx)
+					values[dx + dy * (radius + 1)] = term(static_cast<int>(dx), static_cast<int>(dy));
+		}
+
+		[[nodiscard]] float term(int dx, int dy) const
+		{
+			float d;
+			if constexpr (Distance == RegularizationDistance::LInf)
+				d = std::max(std::abs(dx), std::abs(dy));
+			else
+				d = std::sqrt(dx * dx + dy * dy);
+			return k * (2.f * d / sigma);
+		}
+
+		// term() of any offset, from the table when it holds it
+		[[nodiscard]] float at(int64_t dx, int64_t dy) const
+		{
+			dx = std::abs(dx);
+			dy = std::abs(dy);
+			if (dx <= radius && dy <= radius)
+				return values[dx + dy * (radius + 1)];
+			return term(static_cast<int>(dx), static_cast<int>(dy));
+		}
+
+		// Regularized value of a gradient value, saturated to 255
+		[[nodiscard]] static LibTIM::U8 regularize(LibTIM::U8 value, float offset)
+		{
+			return static_cast<LibTIM::U8>(std::min(static_cast<int>(value + offset), 255));
+		}
+
+		// Regularize row y of the gradient. Pixels are handled by runs belonging to the same cell.
+		void apply(const LibTIM::U8* gradientRow, LibTIM::U8* resultRow, const uint32_t* cellRow,
+		           const glm::ivec2* centers, int64_t width, int64_t y) const
+		{
+			for (int64_t x = 0; x < width;)
+			{
+				const auto cell = cellRow[x];
+				int64_t end = x + 1;
+				while (end < width && cellRow[end] == cell)
+					++end;
+
+				const auto& center = centers[cell];
+				const int64_t dy = std::abs(y - center.y);
+				if (dy <= radius && std::abs(x - center.x) <= radius && std::abs(end - 1 - center.x) <= radius)
+				{
+					const float* tableRow = values.data() + dy * (radius + 1);
+					for (; x < end; ++x)
+						resultRow[x] = regularize(gradientRow[x], tableRow[std::abs(x - center.x)]);
+				}
+				else
+				{
+					for (; x < end; ++x)
+						resultRow[x] = regularize(gradientRow[x], term(static_cast<int>(x - center.x),
+						                                               static_cast<int>(y - center.y)));
+				}
+			}
+		}
+
+	private:
+		float sigma;
+		float k;
+		int64_t radius;
+		std::vector<float> values;
+	};
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+namespace WP
+{
+	// Consecutive pixels of a row with the same label
+	struct LabelRun
+	{
+		uint32_t label;
+		uint32_t length;
+	};
+
+	/*
+	* Run-length encoded labels : a partition only changes label a few times per row, its runs are a small fraction of
+	* the label image
+	*/
+	struct LabelRuns
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		// The runs of row y are runs[rowOffsets[y]] .. runs[rowOffsets[y + 1] - 1], from left to right
+		std::vector<uint64_t> rowOffsets;
+		std::vector<LabelRun> runs;
+	};
+
+	// Runs of each row, rows encoded in parallel (labels must fit in 32 bits)
+	[[nodiscard]] LabelRuns encodeLabelRuns(const LibTIM::Image<LibTIM::TLabel>& labels);
+	[[nodiscard]] LibTIM::Image<LibTIM::TLabel> decodeLabelRuns(const LabelRuns& runs);
+
+	/*
+	* Binary dump of runs, in the byte order of the host : a header (magic "WPLRUNS", version, width, height, run
+	* count, as 64 bits integers), then the row offsets and the runs, as laid out in LabelRuns
+	*/
+	bool saveLabelRuns(const LabelRuns& runs, const std::string& path);
+	// Return false if path is not a valid dump
+	bool loadLabelRuns(const std::string& path, LabelRuns& runs);
+}
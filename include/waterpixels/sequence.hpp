@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	/*
+	* Frames of a sequence : the files named by a printf-like pattern with one integer, %d or %0<width>d
+	* ("frames/%04d.ppm"), numbered from 0 or 1 up to the first missing one, or the inputs of a batch (see
+	* listBatchInputs()). Throw std::invalid_argument if input holds any other % sequence.
+	*/
+	std::vector<std::string> listSequenceFrames(const std::string& input);
+
+	/*
+	* Waterpixels of the successive frames of a video or a time-lapse. All frames share the grid and the voronoi graph
+	* of the first one, and each frame starts from the result of the previous one :
+	*  - the cells where the gradient moved by more than changeThreshold are the changed cells
+	*  - only the markers of the changed cells are recomputed (see updateWatershedMarkers())
+	*  - only the pixels of the changed cells and of the waterpixels of their previous markers are flooded again, from
+	*    the labels around them. Without any changed cell, the previous labels are kept.
+	* With changeThreshold = 0 the markers are the ones of waterpixel() on each frame, the labels only differ where the
+	* global flooding would have moved boundaries outside of the flooded region. The loading of the next frame and the
+	* saving of the previous one overlap the computation. The latency of each frame is reported.
+	@param input: see listSequenceFrames(), every frame must have the size of the first one
+	@param outputDirectory: receives one <frame name>.pgm delimitation per frame
+	@param sigma, k, cellScale: see waterpixel()
+	@param blurRadius: radius of the opening / closing prefilter, no prefiltering if lower than 1
+	@param changeThreshold: largest gradient variation of a cell considered unchanged
+	@param options: see WaterpixelOptions, the debug images are never written
+	*/
+	void waterpixelSequence(const std::string& input, const std::string& outputDirectory, float sigma, float k,
+	                        float cellScale, int blurRadius, int changeThreshold = 0,
+	                        const WaterpixelOptions& options = {});
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+#include "waterpixels/utils.hpp"
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	/*
+	* One image and the outputs of every stage of the waterpixel pipeline, for parameter sweeps.
+	* Changing a parameter only invalidates the stages depending on it (and the stages depending on those), the next
+	* call to labels() recomputes them and reuses the others :
+	*  blurRadius : prefiltered image, gradient and everything after them
+	*  sigma : voronoi cells, regularized gradient, markers and labels
+	*  k, regularization distance : regularized gradient and labels (the compact engine never computes the
+	*  regularized gradient)
+	*  flooding engine : labels
+	*  cellScale, marker selection and epsilon : markers and labels
+	* The intensity of the input image is computed once, by the constructor.
+	* Results are the ones of main on the same image and parameters.
+	*/
+	class Session
+	{
+	public:
+		enum Stage : uint32_t
+		{
+			Prefiltered = 1 << 0,
+			Gradient = 1 << 1,
+			Voronoi = 1 << 2,
+			Regularized = 1 << 3,
+			Markers = 1 << 4,
+			Labels = 1 << 5
+		};
+
+		Session(const LibTIM::Image<LibTIM::RGB>& image, float sigma, float k, float cellScale, int blurRadius,
+		        const WaterpixelOptions& options = {});
+
+		void setSigma(float sigma);
+		void setK(float k);
+		void setCellScale(float cellScale);
+		void setBlurRadius(int blurRadius);
+		void setOptions(const WaterpixelOptions& options);
+
+		// Label of each pixel for the current parameters, recomputing the invalidated stages
+		[[nodiscard]] const LibTIM::Image<LibTIM::TLabel>& labels();
+		// Binary delimitation of labels() (the output of main)
+		[[nodiscard]] LibTIM::Image<LibTIM::U8> delimitation();
+
+		// Stages recomputed by the last call to labels() (a combination of Stage)
+		[[nodiscard]] uint32_t lastRecomputed() const { return recomputed; }
+
+	private:
+		// Mark stages and every stage depending on them as out of date
+		void invalidate(uint32_t stages);
+
+		float sigma;
+		float k;
+		float cellScale;
+		int blurRadius;
+		WaterpixelOptions options;
+
+		uint32_t valid = 0;
+		uint32_t recomputed = 0;
+
+		LibTIM::Image<LibTIM::U8> intensity;
+		LibTIM::Image<LibTIM::U8> prefiltered;
+		LibTIM::Image<LibTIM::U8> gradient;
+		VoronoiGraph voronoi;
+		LibTIM::Image<LibTIM::U8> regularized;
+		LibTIM::Image<LibTIM::TLabel> markers;
+		LibTIM::Image<LibTIM::TLabel> labelImage;
+	};
+
+	/*
+	* Waterpixels of one image for every combination of the sigmas, ks and cellScales, through a Session ordered so that
+	* the most expensive invalidations happen the least often (sigma outermost, k innermost).
+	@param input: binary ppm (P6) input image path
+	@param outputDirectory: receives one <input name>_s<sigma>_k<k>_c<cellScale>.pgm delimitation per combination
+	@param blurRadius, options: see Session
+	*/
+	void waterpixelSweep(const std::string& input, const std::string& outputDirectory, const std::vector<float>& sigmas,
+	                     const std::vector<float>& ks, const std::vector<float>& cellScales, int blurRadius,
+	                     const WaterpixelOptions& options = {});
+}
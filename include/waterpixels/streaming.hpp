@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	/*
+	* Out-of-core waterpixels : the input ppm is read by bands of rows (the rows of tiles of watershedMeyerTiled), each
+	* band is pushed through the whole pipeline with the rows of context the prefilter, the gradient and the grid cells
+	* need, and the delimitation is appended to the output pgm as soon as its rows are final.
+	* The watershed is always flooded with FloodingEngine::Tiled, whatever options.flooding : the output is the one of
+	* waterpixel() with FloodingEngine::Tiled, in every case. The serial Meyer flooding of the other engines is global
+	* and cannot be run by bands.
+	* Peak memory only depends on the image width and the band height, not on the image height, except for the bands
+	* without any watershed source, which are held until the next band with a source.
+	@param input: binary ppm (P6) input image path
+	@param output: pgm output image path
+	@param sigma, k, cellScale: see waterpixel()
+	@param blurRadius: radius of the opening / closing prefilter, no prefiltering if lower than 1
+	@param options: see WaterpixelOptions, the debug images are never written
+	*/
+	void waterpixelStream(const std::string& input, const std::string& output, float sigma, float k, float cellScale,
+	                      int blurRadius, const WaterpixelOptions& options = {});
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+#include "waterpixels/view.hpp"
+
+namespace WP
+{
+	// Statistics of one superpixel (a label of a waterpixel partition), stored as is in the binary dump
+	struct Superpixel
+	{
+		uint32_t area = 0;
+		// Bounding box, maximum included (empty superpixels keep 0)
+		uint32_t xMin = 0;
+		uint32_t yMin = 0;
+		uint32_t xMax = 0;
+		uint32_t yMax = 0;
+		float centroidX = 0;
+		float centroidY = 0;
+		// Mean CIELAB colour (see rgbToCIELAB), 0 when no colour image was given
+		float l = 0;
+		float a = 0;
+		float b = 0;
+	};
+
+	/*
+	* Superpixel table and region adjacency graph of a partition, so that consumers do not scan the label image again.
+	* Superpixel i holds the pixels labelled i + 1. Two superpixels are adjacent when one of their pixels are N4
+	* neighbours, the boundary between them being made of these pixel pairs.
+	*/
+	struct SuperpixelGraph
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<Superpixel> superpixels;
+		// CSR layout : the neighbours of superpixel i are neighbours[offsets[i]] .. neighbours[offsets[i + 1] - 1], by
+		// increasing index (every edge appears on both sides)
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> neighbours;
+		// Per neighbour entry : pixel pairs on the boundary, and mean gradient of the pixels of these pairs
+		std::vector<uint32_t> boundaryLengths;
+		std::vector<float> boundaryGradients;
+	};
+
+	/*
+	* Statistics and adjacency graph of labels, in one parallel pass over the rows (partial sums of each thread merged
+	* at the end)
+	@param labels: a partition, pixels labelled 0 or above labelCount are ignored
+	@param labelCount: number of superpixels (the cell count of the voronoi graph for waterpixel())
+	@param gradient: image averaged along the boundaries (the gradient of WaterpixelStages for instance)
+	@param image: if not null, the colour image averaged over each superpixel
+	*/
+	[[nodiscard]] SuperpixelGraph superpixelGraph(const LibTIM::Image<LibTIM::TLabel>& labels, size_t labelCount,
+	                                              const LibTIM::Image<LibTIM::U8>& gradient,
+	                                              const PixelView* image = nullptr);
+
+	/*
+	* Binary dump of a graph, in the byte order of the host : a header (magic "WPSUPERP", version, width, height,
+	* superpixel count, neighbour entry count, as 64 bits integers), then the superpixels, the offsets, the neighbours,
+	* the boundary lengths and the boundary gradients, as laid out in SuperpixelGraph
+	*/
+	bool saveSuperpixelGraph(const SuperpixelGraph& graph, const std::string& path);
+	// Return false if path is not a valid dump
+	bool loadSuperpixelGraph(const std::string& path, SuperpixelGraph& graph);
+}
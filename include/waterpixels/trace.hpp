@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace WP
+{
+	/*
+	* Begin / end events of the profiled scopes (see MEASURE_DURATION and MEASURE_ADD_CUMULATOR in utils.hpp).
+	* Every thread appends to its own ring buffer of events and adds to its own totals per scope, without any lock nor
+	* shared write. They are only read to build the summary or the trace file, once the measured work is over.
+	* The summary comes from the totals, which never wrap. The ring buffers only feed the timeline of the trace file :
+	* when a thread records more than bufferCapacity events, its oldest events are overwritten and counted as dropped.
+	*/
+	class TraceRecorder
+	{
+	public:
+		static constexpr uint64_t bufferCapacity = 1 << 16;
+
+		// name must outlive the recorder (a string literal)
+		static void begin(const char* name);
+		static void end(const char* name);
+
+		// Nanoseconds since the start of the program
+		[[nodiscard]] static uint64_t now();
+
+		// Events overwritten in the ring buffers of every thread
+		[[nodiscard]] static uint64_t droppedEvents();
+
+		// Calls, total and wall time, threads and their utilisation (busy time / (wall time * threads)) of each scope
+		static void printSummary(std::ostream& stream);
+
+		// Chrome trace_event JSON (chrome://tracing, Perfetto), one track per thread, with the count of dropped events in
+		// otherData. Return false if it can't be written
+		static bool writeChromeTrace(const std::string& path);
+	};
+}
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <mutex>
+#include <string>
 #include <libtim/Common/Types.h>
 #include <libtim/Common/Image.h>
 #include <glm/glm.hpp>
 #include "config.hpp"
+#include "trace.hpp"
 
 #ifndef ENABLE_PROFILER
 #define ENABLE_PROFILER true
@@ -38,6 +41,10 @@ namespace WP
 	/******** IMAGE UTILITIES ********/
 
 	glm::vec3 rgbToCIELAB(const LibTIM::RGB& pixelRGB);
+	// Lightness of rgbToCIELAB scaled to [0, 255] (L / 100 * 255), read from a table indexed by the integer Y value
+	LibTIM::U8 rgbToLightness(const LibTIM::RGB& pixelRGB);
+	// rgbToLightness on a row of interleaved pixels (AVX2 kernel when the CPU supports it)
+	void rgbRowToLightness(const LibTIM::RGB* pixels, LibTIM::U8* lightness, size_t count);
 
 	// if image(x) > 0 then label(x) == 1
 	LibTIM::Image<LibTIM::U8> labelToImage(const LibTIM::Image<LibTIM::TLabel>& image);
@@ -45,6 +52,12 @@ namespace WP
 	LibTIM::Image<LibTIM::U8> labelToBinaryImage(const LibTIM::Image<LibTIM::TLabel>& image);
 	// image(x) == label(x)
 	LibTIM::Image<LibTIM::TLabel> imageToBinaryLabel(const LibTIM::Image<LibTIM::U8>& image);
+	/*
+	* Delimitation of a partition in one pass over the rows : 255 where the N4 neighbours of a pixel do not all have the
+	* same label, else 0. Same result as labelToBinaryImage(morphologicalGradient(labels, N4)), the N4 element not
+	* holding its center : a lone pixel inside another label is not marked, its neighbours are.
+	*/
+	LibTIM::Image<LibTIM::U8> labelBoundaries(const LibTIM::Image<LibTIM::TLabel>& labels);
 
 	/******** MORPHOLOGICAL OPERATIONS ********/
 
@@ -56,36 +69,74 @@ namespace WP
 	class VoronoiGraph
 	{
 	public:
+		// View on one voronoi cell : its center and its pixels as offsets (x + y * width) in raster order
+		struct Cell
+		{
+			glm::ivec2 center;
+			const uint32_t* pixelsBegin;
+			const uint32_t* pixelsEnd;
+
+			[[nodiscard]] const uint32_t* begin() const { return pixelsBegin; }
+			[[nodiscard]] const uint32_t* end() const { return pixelsEnd; }
+			[[nodiscard]] size_t size() const { return pixelsEnd - pixelsBegin; }
+			[[nodiscard]] bool empty() const { return pixelsBegin == pixelsEnd; }
+		};
+
 		VoronoiGraph();
+		// Centers laid out in columns (like makeRectGrid2D and makeHexGrid2D output) use a closed-form nearest center lookup
 		VoronoiGraph(size_t width, size_t height, const std::vector<glm::ivec2>& centers);
+		// Graph from its raw layout (see cellMap(), pixelOffsets() and pixelIndex()), as stored by a StageCache
+		VoronoiGraph(size_t width, size_t height, std::vector<glm::ivec2> centers, std::vector<uint32_t> cellIds,
+		             std::vector<uint32_t> cellOffsets, std::vector<uint32_t> cellPixels);
+
+		[[nodiscard]] size_t cellCount() const { return cellCenters.size(); }
 
-		// Get each voronoi cell of the graph. For each cell, first = cell center / second = list of cell points
-		[[nodiscard]] const std::vector<std::pair<glm::ivec2, std::vector<glm::ivec2>>>& cells() const
+		[[nodiscard]] Cell cell(size_t index) const
 		{
-			return voronoiCells;
+			return {
+				cellCenters[index], cellPixels.data() + cellOffsets[index], cellPixels.data() + cellOffsets[index + 1]
+			};
 		}
 
+		// Index of the cell containing each pixel (offset x + y * width)
+		[[nodiscard]] const std::vector<uint32_t>& cellMap() const { return cellIds; }
+		[[nodiscard]] uint32_t cellAt(size_t x, size_t y) const { return cellIds[x + y * width]; }
+		// CSR layout : pixels of cell i are pixelIndex()[pixelOffsets()[i]] .. pixelIndex()[pixelOffsets()[i + 1] - 1]
+		[[nodiscard]] const std::vector<uint32_t>& pixelOffsets() const { return cellOffsets; }
+		[[nodiscard]] const std::vector<uint32_t>& pixelIndex() const { return cellPixels; }
+
+		[[nodiscard]] const std::vector<glm::ivec2>& centers() const { return cellCenters; }
+		[[nodiscard]] size_t getWidth() const { return width; }
+		[[nodiscard]] size_t getHeight() const { return height; }
+
 		// Red channel = centers, Green channel = cell delimitation
 		[[nodiscard]] LibTIM::Image<LibTIM::RGB> debugVisualization() const;
 	private:
-		std::vector<std::pair<glm::ivec2, std::vector<glm::ivec2>>> voronoiCells;
+		std::vector<glm::ivec2> cellCenters;
+		// Dense cell index per pixel
+		std::vector<uint32_t> cellIds;
+		// CSR layout : pixels of cell i are cellPixels[cellOffsets[i]] .. cellPixels[cellOffsets[i + 1] - 1]
+		std::vector<uint32_t> cellOffsets;
+		std::vector<uint32_t> cellPixels;
 		size_t width;
 		size_t height;
 	};
 
 	/******** PROFILING TOOLS ********/
 
+	// Scopes are recorded by the TraceRecorder (see trace.hpp), descriptions must be string literals
+
+	// Add the duration of each Instance scope, from any thread, then print the total or the average
 	class ProfilerCumulator
 	{
 	public:
-		ProfilerCumulator(std::string name, bool average);
+		ProfilerCumulator(const char* description, bool average);
 		~ProfilerCumulator();
 
-		void append(double time)
+		void append(uint64_t nanoseconds)
 		{
-			std::lock_guard l(m);
-			total += time;
-			calls++;
+			total.fetch_add(nanoseconds, std::memory_order_relaxed);
+			calls.fetch_add(1, std::memory_order_relaxed);
 		}
 
 		class Instance
@@ -96,29 +147,29 @@ namespace WP
 			~Instance();
 
 		private:
-			const std::chrono::steady_clock::time_point start;
+			const uint64_t start;
 			ProfilerCumulator& parent;
 		};
 
 	private:
-		const std::string description;
-		double total = 0;
-		int calls = 0;
+		const char* const description;
+		std::atomic<uint64_t> total = 0;
+		std::atomic<uint64_t> calls = 0;
 		bool average;
-		std::mutex m;
 	};
 
+	// Print the duration of its scope, indented by the number of enclosing scopes of the same thread
 	class Profiler
 	{
 	public:
-		Profiler(std::string name);
+		Profiler(const char* description);
 		~Profiler();
 		double getDuration();
 		static void printDuration(const std::string& description, double duration);
 		static std::string makeIndent();
 	private:
 		bool print = true;
-		const std::chrono::steady_clock::time_point start;
-		const std::string description;
+		const uint64_t start;
+		const char* const description;
 	};
 }
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+#include "waterpixels/waterpixels.hpp"
+
+namespace WP
+{
+	struct SuperpixelGraph;
+
+	// Order of the channels of an interleaved pixel, as found in the buffers of decoders and capture devices
+	enum class PixelLayout
+	{
+		Gray,
+		RGB,
+		BGR,
+		RGBA,
+		BGRA
+	};
+
+	// Bytes per pixel of a layout
+	[[nodiscard]] constexpr int pixelSize(PixelLayout layout)
+	{
+		return layout == PixelLayout::Gray ? 1 : layout == PixelLayout::RGB || layout == PixelLayout::BGR ? 3 : 4;
+	}
+
+	/*
+	* Non-owning view on an image held by the caller : height rows of width interleaved pixels, each row starting
+	* rowStride bytes after the previous one (rows may be padded, rowStride >= width * pixelSize(layout))
+	*/
+	struct PixelView
+	{
+		const uint8_t* data = nullptr;
+		int width = 0;
+		int height = 0;
+		size_t rowStride = 0;
+		PixelLayout layout = PixelLayout::RGB;
+	};
+
+	// Non-owning view on a label buffer held by the caller, rowStride in bytes (a multiple of sizeof(TLabel))
+	struct LabelView
+	{
+		LibTIM::TLabel* data = nullptr;
+		int width = 0;
+		int height = 0;
+		size_t rowStride = 0;
+	};
+
+	// Row y of image as RGB pixels : the row of the view itself for the RGB layout, else reordered into buffer
+	[[nodiscard]] const LibTIM::RGB* pixelRow(const PixelView& image, int64_t y, std::vector<LibTIM::RGB>& buffer);
+	// View on the pixels of an image
+	[[nodiscard]] PixelView pixelView(const LibTIM::Image<LibTIM::RGB>& image);
+
+	// CIELAB lightness of each pixel scaled to [0, 255] (see rgbImageIntensity), read through the view
+	[[nodiscard]] LibTIM::Image<LibTIM::U8> imageIntensity(const PixelView& image);
+
+	/*
+	* Waterpixels of an image held by the caller, written into a label buffer held by the caller (label of a pixel =
+	* index of its grid cell + 1). This is the pipeline of main : intensity, opening / closing prefilter, then
+	* waterpixel() on a rectangular grid of spacing sigma.
+	* The input is only read through the view, by the intensity conversion. When output.rowStride is
+	* width * sizeof(TLabel), the markers are generated and flooded directly in the output buffer, otherwise the labels
+	* are copied to it row by row at the end.
+	* Throws std::invalid_argument when the views are empty, their sizes differ or their strides are too small.
+	@param input, output: views of the same size
+	@param sigma, k, cellScale: see waterpixel()
+	@param blurRadius: radius of the opening / closing prefilter, no prefiltering if lower than 1
+	@param options: see WaterpixelOptions, the debug images are never written
+	@param superpixels: if not null, receives the statistics and the adjacency graph of the labels (see
+	superpixelGraph(), the colours are the ones of input)
+	*/
+	void waterpixel(const PixelView& input, const LabelView& output, float sigma, float k, float cellScale,
+	                int blurRadius, const WaterpixelOptions& options = {}, SuperpixelGraph* superpixels = nullptr);
+	/*
+	* Same with the voronoi graph of the grid already built (it only depends on the image size and sigma) : a host
+	* processing frames of the same size builds it once
+	*/
+	void waterpixel(const PixelView& input, const LabelView& output, const VoronoiGraph& voronoi, float sigma, float k,
+	                float cellScale, int blurRadius, const WaterpixelOptions& options = {},
+	                SuperpixelGraph* superpixels = nullptr);
+}
@@ -2,6 +2,7 @@
 #include <libtim/Common/Image.h>
 #include <libtim/Common/Types.h>
 #include "config.hpp"
+#include "utils.hpp"
 
 #include "glm/vec2.hpp"
 
@@ -18,11 +19,93 @@
 #define USE_LINF_REG_DISTANCE false
 #endif // USE_LINF_REG_DISTANCE
 
+#ifndef USE_TILED_WATERSHED
+#define USE_TILED_WATERSHED false
+#endif // USE_TILED_WATERSHED
+
+#ifndef USE_COMPACT_WATERSHED
+#define USE_COMPACT_WATERSHED false
+#endif // USE_COMPACT_WATERSHED
+
+#ifndef OUTPUT_DEBUG
+#define OUTPUT_DEBUG false
+#endif // OUTPUT_DEBUG
+
 namespace WP
 {
-	class VoronoiGraph;
+	// Distance to the cell center used by the spatial regularization
+	enum class RegularizationDistance
+	{
+		L2,
+		LInf
+	};
+
+	// Connected component of minimums kept as the watershed source of a cell
+	enum class MarkerSelection
+	{
+		ClosestToCenter,
+		Largest
+	};
+
+	// How the spatial regularization drives the flooding of the markers
+	enum class FloodingEngine
+	{
+		// Flood the regularized gradient image (see regularizedGradient()), clamped to 255, with LibTIM::watershedMeyer
+		Regularized,
+		// Same priority, flooded by tiles in parallel with watershedMeyerTiled (seams may differ from Regularized)
+		Tiled,
+		// Flood the gradient, each pixel being regularized by its distance to the seed of the label reaching it (see
+		// floodCompactWatershed())
+		Compact
+	};
+
+	/*
+	* Algorithm variants, selected at runtime. The functions taking them dispatch once to a kernel compiled for each
+	* variant, so that the per-pixel loops do not test them. Defaults come from config.hpp.
+	*/
+	struct WaterpixelOptions
+	{
+		RegularizationDistance distance = USE_LINF_REG_DISTANCE ? RegularizationDistance::LInf : RegularizationDistance::L2;
+		MarkerSelection markerSelection = PREFER_CELL_CENTER ? MarkerSelection::ClosestToCenter : MarkerSelection::Largest;
+		// Only used by waterpixel() and Session, the sequence pipeline always floods with Regularized and the streaming
+		// one with Tiled
+		FloodingEngine flooding = USE_COMPACT_WATERSHED ? FloodingEngine::Compact
+		                          : USE_TILED_WATERSHED ? FloodingEngine::Tiled : FloodingEngine::Regularized;
+		// Pixels of a cell within markerEpsilon of its minimum value are minimums
+		float markerEpsilon = static_cast<float>(WP_MARKER_EPSILON);
+		// Save the intermediate images of main in images/
+		bool outputDebug = OUTPUT_DEBUG;
+	};
+
+	/*
+	* Intermediate results of waterpixel(), handed back to the caller instead of being recomputed for inspection
+	* (debug images for instance). Only filled when asked for, it then costs a copy of the markers.
+	*/
+	struct WaterpixelStages
+	{
+		// Only filled by the overload taking the cell centers, the caller of the other one already holds it
+		VoronoiGraph voronoi;
+		// N4 morphological gradient of the grayscale image
+		LibTIM::Image<LibTIM::U8> gradient;
+		// Gradient with the spatial regularization, the priority of the flooding (not computed by the compact flooding)
+		LibTIM::Image<LibTIM::U8> regularizedGradient;
+		// Watershed sources, before the flooding
+		LibTIM::Image<LibTIM::TLabel> markers;
+	};
+
+	// CIELAB lightness of each pixel scaled to [0, 255]
 	LibTIM::Image<LibTIM::U8> rgbImageIntensity(const LibTIM::Image<LibTIM::RGB>& image);
-	LibTIM::Image<LibTIM::TLabel> makeWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells, float sigma, float cellScale);
+	// Same on height rows of width interleaved pixels (a LibTIM::MappedImage for instance)
+	LibTIM::Image<LibTIM::U8> rgbImageIntensity(const LibTIM::RGB* pixels, LibTIM::TSize width, LibTIM::TSize height);
+	// Full CIELAB conversion, one image per channel
+	void rgbImageCIELAB(const LibTIM::Image<LibTIM::RGB>& image, LibTIM::Image<float>& l, LibTIM::Image<float>& a, LibTIM::Image<float>& b);
+	LibTIM::Image<LibTIM::TLabel> makeWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells, float sigma, float cellScale, const WaterpixelOptions& options = {});
+	/*
+	* Recompute the markers of the cells flagged in changedCells (one flag per cell of voronoiCells) and keep the others.
+	* A cell marker only depends on the source pixels of its cell : the result is the one of makeWatershedMarkers() as
+	* long as the source did not change in the cells that are not flagged.
+	*/
+	void updateWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells, float cellScale, const std::vector<uint8_t>& changedCells, LibTIM::Image<LibTIM::TLabel>& markers, const WaterpixelOptions& options = {});
 	
 	/*
 	* Spatial regularization according to a grid with cells of length sigma
@@ -30,6 +113,44 @@ namespace WP
 	@param sigma: the size of a cell in the grid
 	@param k: the regularization parameter (if equals 0 then no regularization)
 	*/
-	[[nodiscard]] LibTIM::Image<LibTIM::U8> spatialRegularization(const LibTIM::Image<LibTIM::U8>& image, const VoronoiGraph& voronoiCells, float sigma, float k);
-	[[nodiscard]] LibTIM::Image<LibTIM::TLabel> waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage, const std::vector<glm::ivec2> cellCenters, float sigma, float k, float cellScale);
+	[[nodiscard]] LibTIM::Image<LibTIM::U8> spatialRegularization(const LibTIM::Image<LibTIM::U8>& image, const VoronoiGraph& voronoiCells, float sigma, float k, const WaterpixelOptions& options = {});
+
+	/*
+	* Morphological gradient (N4) and its spatial regularization, computed row by row in a single pass
+	* Same result as spatialRegularization(morphologicalGradient(image, N4), voronoiCells, sigma, k)
+	@param gradient: if not null, receives the plain gradient
+	*/
+	[[nodiscard]] LibTIM::Image<LibTIM::U8> regularizedGradient(const LibTIM::Image<LibTIM::U8>& image, const VoronoiGraph& voronoiCells, float sigma, float k, LibTIM::Image<LibTIM::U8>* gradient = nullptr, const WaterpixelOptions& options = {});
+
+	// Tile size and seam margin of the tiled watershed for a grid of spacing sigma (see watershedMeyerTiled)
+	[[nodiscard]] int watershedTileSize(float sigma);
+	[[nodiscard]] int watershedSeamMargin(float sigma);
+	// Flood markers in place by increasing priority, with watershedMeyerTiled for the Tiled engine, else with
+	// LibTIM::watershedMeyer
+	void floodWatershed(const LibTIM::Image<LibTIM::U8>& priority, LibTIM::Image<LibTIM::TLabel>& markers, float sigma,
+	                    FloodingEngine flooding);
+	/*
+	* Compact watershed : flood markers in place (N4) on the gradient itself. Each label reaching an unlabelled pixel
+	* queues it with its own priority gradient + k * 2d / sigma, d being the distance to the center of cell l - 1 (the
+	* seed of label l) : the pixel goes to the label whose entry is popped first, the later entries are skipped.
+	* Priorities are kept in fixed point (1/64 of a gray level) up to 1024 : no regularized image is built,
+	* and the regularization neither saturates at 255 nor is rounded to a gray level.
+	@param gradient: N4 morphological gradient of the image
+	@param markers: the watershed sources of waterpixel() (label = cell index + 1), overwritten by the labels
+	*/
+	void floodCompactWatershed(const LibTIM::Image<LibTIM::U8>& gradient, const VoronoiGraph& voronoiCells, float sigma,
+	                           float k, LibTIM::Image<LibTIM::TLabel>& markers, const WaterpixelOptions& options = {});
+
+	[[nodiscard]] LibTIM::Image<LibTIM::TLabel> waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage, const std::vector<glm::ivec2> cellCenters, float sigma, float k, float cellScale, const WaterpixelOptions& options = {}, WaterpixelStages* stages = nullptr);
+	/*
+	* Same with the voronoi graph of the cell centers already built (it only depends on the image size and the centers)
+	@param precomputedGradient: if not null, the N4 morphological gradient of grayScaleImage (a cached one for instance)
+	@param stages: if not null, receives the intermediate results
+	*/
+	[[nodiscard]] LibTIM::Image<LibTIM::TLabel> waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage, const VoronoiGraph& voronoi, float sigma, float k, float cellScale, const LibTIM::Image<LibTIM::U8>* precomputedGradient = nullptr, const WaterpixelOptions& options = {}, WaterpixelStages* stages = nullptr);
+	/*
+	* Same, the labels being written in place into labels (resized if its size differs from grayScaleImage). The markers
+	* are generated and flooded in its buffer : a borrowed image (LibTIM::Image::borrow) receives them without any copy.
+	*/
+	void waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage, const VoronoiGraph& voronoi, float sigma, float k, float cellScale, LibTIM::Image<LibTIM::TLabel>& labels, const LibTIM::Image<LibTIM::U8>* precomputedGradient = nullptr, const WaterpixelOptions& options = {}, WaterpixelStages* stages = nullptr);
 }
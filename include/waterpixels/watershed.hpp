@@ -0,0 +1,41 @@
+#pragma once
+#include <libtim/Common/Image.h>
+#include <libtim/Common/Types.h>
+
+namespace WP
+{
+	/*
+	* Parallel Meyer watershed (N4 connectivity) on a grid of tiles.
+	* Each tile is flooded concurrently from its own markers, then a band of seamMargin pixels on each side of every
+	* tile seam is re-flooded from the labels around it (vertical seams inside each row of tiles first, then horizontal
+	* seams across the whole width).
+	* Tiles without any marker are flooded from the rest of their row of tiles before the horizontal seams, rows of tiles
+	* without any marker from the rows around them after (see watershedMeyerFloodUnlabeled).
+	* Tiles only depend on the image size and the tile size, so the result does not depend on the thread count.
+	* A label only depends on its own row of tiles and the two around it, which lets the pipeline be run by bands.
+	@param image: the flooding priority (usually the regularized gradient)
+	@param markers: the watershed sources, overwritten by the resulting labels (same contract as LibTIM::watershedMeyer)
+	@param tileWidth, tileHeight: tile size in pixels, should be a multiple of the waterpixel grid spacing
+	@param seamMargin: half width of the band re-flooded around each seam (clamped to half a tile)
+	*/
+	void watershedMeyerTiled(const LibTIM::Image<LibTIM::U8>& image, LibTIM::Image<LibTIM::TLabel>& markers,
+	                         int tileWidth, int tileHeight, int seamMargin);
+
+	/*
+	* Reset rows [y0, y1[ of labels to the sources, then flood them again from the labels of rows y0 - 1 and y1
+	* (the horizontal seam reconciliation of watershedMeyerTiled)
+	@param image: the flooding priority
+	@param sources: the watershed sources
+	@param labels: a watershed result of the sources
+	*/
+	void watershedMeyerRefloodRows(const LibTIM::Image<LibTIM::U8>& image, const LibTIM::Image<LibTIM::TLabel>& sources,
+	                               LibTIM::Image<LibTIM::TLabel>& labels, int y0, int y1);
+
+	/*
+	* Meyer flooding of the unlabeled pixels from the labeled ones, queued in raster order (the last step of
+	* watershedMeyerTiled). Each connected set of unlabeled pixels is flooded independently of the others.
+	@param image: the flooding priority
+	@param labels: partial labels, completed in place
+	*/
+	void watershedMeyerFloodUnlabeled(const LibTIM::Image<LibTIM::U8>& image, LibTIM::Image<LibTIM::TLabel>& labels);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "waterpixels/queue.hpp"
+
+#include <libtim/Common/Image.h>
+
+namespace WP
+{
+	/*
+	* Writes files on a background thread, in submission order, so that the caller goes on with its work.
+	* The destructor waits for every submitted write. A failed write is reported on std::cerr and does not stop the
+	* following ones.
+	* At most capacity jobs wait : submit blocks while they are all pending, so that the images held by the jobs stay
+	* bounded when the disk is slower than the caller.
+	*/
+	class AsyncWriter
+	{
+	public:
+		// The debug images of a single waterpixel run all fit
+		static constexpr size_t defaultCapacity = 4;
+
+		AsyncWriter(size_t capacity = defaultCapacity);
+		~AsyncWriter();
+
+		AsyncWriter(const AsyncWriter&) = delete;
+		AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+		// job runs on the writer thread : it must only use what it owns (captured by value). Blocks while the queue is full
+		void submit(std::function<void()> job);
+
+		// Save image to path once the previous jobs are done (the image is moved or copied into the job)
+		template <typename T>
+		void save(LibTIM::Image<T> image, std::string path)
+		{
+			submit([image = std::move(image), path = std::move(path)]() mutable
+			{
+				if (!image.save(path.c_str()))
+					std::cerr << "Asynchronous write of '" << path << "' failed" << std::endl;
+			});
+		}
+
+	private:
+		void run();
+
+		BoundedQueue<std::function<void()>> jobs;
+		std::thread thread;
+	};
+}
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Algorithms/Watershed.hxx>
+#include <libtim/Common/FlatSE.h>
+#include <libtim/Common/ImageMemory.h>
+#include <waterpixels/hierarchy.hpp>
+#include <waterpixels/runs.hpp>
+#include <waterpixels/utils.hpp>
+#include <waterpixels/view.hpp>
+#include <waterpixels/waterpixels.hpp>
+
+#ifndef WP_SOURCE_DIR
+#define WP_SOURCE_DIR "."
+#endif
+
+namespace
+{
+	struct BenchInput
+	{
+		std::string name;
+		LibTIM::Image<LibTIM::RGB> image;
+	};
+
+	struct StageResult
+	{
+		std::string input;
+		int width;
+		int height;
+		std::string stage;
+		float sigma; // 0 for the stages that do not depend on it
+		int threads;
+		std::vector<double> milliseconds;
+	};
+
+	std::vector<float> parseList(const std::string& list)
+	{
+		std::vector<float> values;
+		std::stringstream stream(list);
+		std::string value;
+		while (std::getline(stream, value, ','))
+			if (!value.empty())
+				values.emplace_back(static_cast<float>(atof(value.c_str())));
+		return values;
+	}
+
+	// Smooth blobs with some noise, so that every stage has actual work to do
+	LibTIM::Image<LibTIM::RGB> syntheticImage(float megapixels)
+	{
+		const auto width = static_cast<int>(std::round(std::sqrt(megapixels * 1e6 * 4 / 3)));
+		const auto height = static_cast<int>(std::round(megapixels * 1e6 / width));
+		LibTIM::Image<LibTIM::RGB> image(width, height);
+#pragma omp parallel for
+		for (int64_t y = 0; y < height; ++y)
+			for (int64_t x = 0; x < width; ++x)
+			{
+				uint32_t noise = static_cast<uint32_t>(x * 73856093 ^ y * 19349663);
+				noise = (noise ^ (noise >> 13)) * 0x5bd1e995;
+				const double base = 128 + 70 * std::sin(x / 37.0) * std::cos(y / 23.0) + 20 * std::sin((x + y) / 97.0);
+				const auto value = [&](int shift)
+				{
+					return static_cast<LibTIM::U8>(std::clamp(base + static_cast<int>((noise >> shift) & 31) - 16, 0.0,
+					                                          255.0));
+				};
+				auto& pixel = image(x + y * width);
+				pixel[0] = value(0);
+				pixel[1] = value(8);
+				pixel[2] = value(16);
+			}
+		return image;
+	}
+
+	double percentile(std::vector<double> values, double p)
+	{
+		std::sort(values.begin(), values.end());
+		const auto rank = static_cast<size_t>(std::ceil(p * values.size()));
+		return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+	}
+
+	// Time repeats runs of stage, prepare is run (untimed) before each of them
+	std::vector<double> measure(int repeats, const std::function<void()>& stage,
+	                            const std::function<void()>& prepare = {})
+	{
+		std::vector<double> milliseconds;
+		for (int i = 0; i < repeats; ++i)
+		{
+			if (prepare)
+				prepare();
+			const auto start = std::chrono::steady_clock::now();
+			stage();
+			milliseconds.emplace_back(
+				std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		return milliseconds;
+	}
+
+	void writeJson(const std::string& path, const std::vector<StageResult>& results, int repeats)
+	{
+		std::ofstream file(path, std::ios_base::trunc);
+		if (!file)
+			throw std::runtime_error("failed to open '" + path + "'");
+		file << "{\n\t\"repeats\": " << repeats << ",\n\t\"results\": [";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const auto& result = results[i];
+			const double megapixels = static_cast<double>(result.width) * result.height / 1e6;
+			const double median = percentile(result.milliseconds, 0.5);
+			file << (i ? "," : "") << "\n\t\t{\"input\": \"" << result.input << "\", \"width\": " << result.width
+				<< ", \"height\": " << result.height << ", \"megapixels\": " << megapixels << ", \"stage\": \""
+				<< result.stage << "\", \"sigma\": ";
+			if (result.sigma > 0)
+				file << result.sigma;
+			else
+				file << "null";
+			file << ", \"threads\": " << result.threads << ", \"median_ms\": " << median << ", \"min_ms\": "
+				<< percentile(result.milliseconds, 0) << ", \"p95_ms\": " << percentile(result.milliseconds, 0.95)
+				<< ", \"mpix_per_s\": " << megapixels / (median / 1000) << "}";
+		}
+		file << "\n\t]\n}\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string output = "wp_bench.json";
+	std::vector<float> sizes = {1, 10, 50, 200};
+	std::vector<float> sigmas = {25, 50, 100};
+#ifdef _OPENMP
+	std::vector<float> threadCounts = {1, static_cast<float>(omp_get_max_threads())};
+#else
+	std::vector<float> threadCounts = {1};
+#endif
+	int repeats = 5;
+	bool bundled = true;
+	const float k = 5;
+	const float cellScale = 2 / 3.f;
+	const int blurRadius = 5;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--no-bundled")
+			bundled = false;
+		else if (arg == "--output" && hasValue)
+			output = argv[++i];
+		else if (arg == "--sizes" && hasValue)
+			sizes = parseList(argv[++i]);
+		else if (arg == "--sigmas" && hasValue)
+			sigmas = parseList(argv[++i]);
+		else if (arg == "--threads" && hasValue)
+			threadCounts = parseList(argv[++i]);
+		else if (arg == "--repeats" && hasValue)
+			repeats = std::max(1, atoi(argv[++i]));
+		else
+		{
+			std::cerr <<
+				"Usage : wp_bench [--output <json>] [--sizes <MP,...>] [--sigmas <sigma,...>] [--threads <n,...>] [--repeats <n>] [--no-bundled]\n\toutput : default = wp_bench.json\n\tsizes : synthetic image sizes in megapixels, default = 1,10,50,200\n\tsigmas : default = 25,50,100\n\tthreads : default = 1 and all the available threads\n\trepeats : runs of each stage, default = 5\n\tno-bundled : skip images/landscape.ppm and images/Peyto_Lake_Panorama.ppm"
+				<< std::endl;
+			return arg == "--help" ? 0 : -1;
+		}
+	}
+
+	std::vector<BenchInput> inputs;
+	for (const auto size : sizes)
+	{
+		std::stringstream name;
+		name << "synthetic_" << size << "MP";
+		inputs.push_back({name.str(), syntheticImage(size)});
+	}
+	if (bundled)
+		for (const auto* file : {"images/landscape.ppm", "images/Peyto_Lake_Panorama.ppm"})
+		{
+			const auto path = std::filesystem::path(WP_SOURCE_DIR) / file;
+			BenchInput input{path.filename().string(), {}};
+			if (std::filesystem::exists(path) && LibTIM::Image<LibTIM::RGB>::load(path.string().c_str(), input.image))
+				inputs.emplace_back(std::move(input));
+			else
+				std::cerr << "Skipping missing input '" << path.string() << "'" << std::endl;
+		}
+
+	// Same-sized intermediates of successive runs recycle their buffers, as in main
+	LibTIM::ImageBufferPool imagePool;
+
+	LibTIM::FlatSE ball;
+	ball.make2DEuclidianBall(blurRadius);
+	LibTIM::FlatSE connectivity;
+	connectivity.make2DN4();
+
+	std::vector<StageResult> results;
+	for (const auto& input : inputs)
+	{
+		const int width = input.image.getSizeX();
+		const int height = input.image.getSizeY();
+		for (const auto threadCountValue : threadCounts)
+		{
+			const int threads = std::max(1, static_cast<int>(threadCountValue));
+#ifdef _OPENMP
+			omp_set_num_threads(threads);
+#endif
+			std::cout << "Benchmarking " << input.name << " (" << width << "x" << height << ") on " << threads <<
+				" threads" << std::endl;
+			const auto add = [&](const std::string& stage, float sigma, std::vector<double> milliseconds)
+			{
+				results.push_back({input.name, width, height, stage, sigma, threads, std::move(milliseconds)});
+			};
+
+			// Stages independent of sigma
+			LibTIM::Image<LibTIM::U8> intensity;
+			add("rgbImageIntensity", 0, measure(repeats, [&] { intensity = WP::rgbImageIntensity(input.image); }));
+			{
+				// Same image held by a host in a padded BGRA buffer, read through a view
+				const size_t rowStride = (width * 4 + 63) / 64 * 64;
+				std::vector<uint8_t> host(rowStride * height);
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+						for (int c = 0; c < 3; ++c)
+							host[y * rowStride + x * 4 + c] = input.image(x, y)[2 - c];
+				const WP::PixelView view{host.data(), width, height, rowStride, WP::PixelLayout::BGRA};
+				add("imageIntensityView", 0, measure(repeats, [&] { intensity = WP::imageIntensity(view); }));
+			}
+
+			LibTIM::Image<LibTIM::U8> opened;
+			add("opening", 0, measure(repeats, [&] { opened = openingNoBorder(intensity, ball); }));
+			LibTIM::Image<LibTIM::U8> prefiltered;
+			add("closing", 0, measure(repeats, [&] { prefiltered = closingNoBorder(opened, ball); }));
+
+			// Bandwidth reference of the memory-bound stages : a row by row copy of a gray image
+			LibTIM::Image<LibTIM::U8> copied(width, height);
+			add("rowCopy", 0, measure(repeats, [&]
+			{
+				LibTIM::forEachRow(height, [&](LibTIM::TCoord y)
+				{
+					std::copy(prefiltered.row(y), prefiltered.row(y) + width, copied.row(y));
+				});
+			}));
+
+			LibTIM::Image<LibTIM::U8> gradient;
+			add("gradient", 0, measure(repeats, [&] { gradient = morphologicalGradient(prefiltered, connectivity); }));
+
+			for (const auto sigma : sigmas)
+			{
+				std::vector<glm::ivec2> centers;
+				add("makeRectGrid2D", sigma, measure(repeats, [&] { centers = WP::makeRectGrid2D(width, height, sigma); }));
+
+				WP::VoronoiGraph voronoi;
+				add("VoronoiGraph", sigma, measure(repeats, [&] { voronoi = WP::VoronoiGraph(width, height, centers); }));
+
+				LibTIM::Image<LibTIM::U8> regularized;
+				add("spatialRegularization", sigma, measure(repeats, [&]
+				{
+					regularized = WP::spatialRegularization(gradient, voronoi, sigma, k);
+				}));
+
+				LibTIM::Image<LibTIM::TLabel> markers;
+				add("makeWatershedMarkers", sigma, measure(repeats, [&]
+				{
+					markers = WP::makeWatershedMarkers(gradient, voronoi, sigma, cellScale);
+				}));
+
+				// The flooding overwrites the markers : each run starts from a fresh copy
+				LibTIM::Image<LibTIM::TLabel> labels;
+				add("watershedMeyer", sigma, measure(repeats, [&]
+				{
+					LibTIM::watershedMeyer<LibTIM::U8>(regularized, labels, connectivity);
+				}, [&] { labels = markers; }));
+				// Same priority flooded by tiles in parallel (the Tiled engine), the stage to run with several threads
+				add("watershedMeyerTiled", sigma, measure(repeats, [&]
+				{
+					WP::floodWatershed(regularized, labels, sigma, WP::FloodingEngine::Tiled);
+				}, [&] { labels = markers; }));
+				// Against spatialRegularization + watershedMeyer : the compact flooding regularizes on the fly
+				LibTIM::Image<LibTIM::TLabel> compactLabels;
+				add("floodCompactWatershed", sigma, measure(repeats, [&]
+				{
+					WP::floodCompactWatershed(gradient, voronoi, sigma, k, compactLabels);
+				}, [&] { compactLabels = markers; }));
+
+				// Whole waterpixel() runs (gradient included) with each flooding engine
+				const std::pair<WP::FloodingEngine, const char*> engines[] = {
+					{WP::FloodingEngine::Regularized, "waterpixelRegularized"},
+					{WP::FloodingEngine::Tiled, "waterpixelTiled"},
+					{WP::FloodingEngine::Compact, "waterpixelCompact"}
+				};
+				for (const auto& [flooding, stage] : engines)
+				{
+					WP::WaterpixelOptions options;
+					options.flooding = flooding;
+					add(stage, sigma, measure(repeats, [&]
+					{
+						(void)WP::waterpixel(prefiltered, voronoi, sigma, k, cellScale, nullptr, options);
+					}));
+				}
+
+				// Output of the labels : delimitation through the gradient or the dedicated pass, run-length encoding
+				LibTIM::Image<LibTIM::U8> delimitation;
+				add("gradientDelimitation", sigma, measure(repeats, [&]
+				{
+					delimitation = WP::labelToBinaryImage(morphologicalGradient(labels, connectivity));
+				}));
+				add("labelBoundaries", sigma, measure(repeats, [&] { delimitation = WP::labelBoundaries(labels); }));
+				WP::LabelRuns runs;
+				add("encodeLabelRuns", sigma, measure(repeats, [&] { runs = WP::encodeLabelRuns(labels); }));
+			}
+
+			// Every sigma level : one full waterpixel run per level, against one hierarchy and an extraction per level
+			add("independentLevels", 0, measure(repeats, [&]
+			{
+				for (const auto sigma : sigmas)
+					(void)WP::waterpixel(prefiltered, WP::makeRectGrid2D(width, height, sigma), sigma, k, cellScale);
+			}));
+			std::optional<WP::WaterpixelHierarchy> hierarchy;
+			add("WaterpixelHierarchy", 0, measure(repeats, [&] { hierarchy.emplace(gradient); }));
+			add("hierarchyLevels", 0, measure(repeats, [&]
+			{
+				for (const auto sigma : sigmas)
+					(void)hierarchy->extract(sigma, k, cellScale);
+			}));
+			std::cout << "\t" << sigmas.size() << " levels, " << hierarchy->regionCount() << " basins, " << hierarchy->
+				edgeCount() << " edges" << std::endl;
+			// The levels approximate waterpixel() : share of the pixels labeled the same way
+			for (const auto sigma : sigmas)
+			{
+				const auto exact = WP::waterpixel(prefiltered, WP::makeRectGrid2D(width, height, sigma), sigma, k,
+				                                  cellScale);
+				const auto level = hierarchy->extract(sigma, k, cellScale);
+				int64_t same = 0;
+				for (int64_t i = 0; i < exact.getBufSize(); ++i)
+					same += exact(i) == level(i);
+				std::cout << "\tsigma " << sigma << " : " << 100. * static_cast<double>(same) / exact.getBufSize() <<
+					"% of the pixels labeled as waterpixel()" << std::endl;
+			}
+		}
+	}
+
+	writeJson(output, results, repeats);
+	std::cout << "Wrote " << results.size() << " results to " << output << std::endl;
+	return 0;
+}
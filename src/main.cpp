@@ -1,62 +1,236 @@
 #include <iostream>
 #include <filesystem>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include <libtim/Algorithms/Morphology.h>
 #include <libtim/Common/FlatSE.h>
+#include <libtim/Common/ImageMemory.h>
+#include <waterpixels/batch.hpp>
+#include <waterpixels/cache.hpp>
+#include <waterpixels/runs.hpp>
+#include <waterpixels/sequence.hpp>
+#include <waterpixels/session.hpp>
+#include <waterpixels/streaming.hpp>
+#include <waterpixels/superpixels.hpp>
+#include <waterpixels/trace.hpp>
 #include <waterpixels/utils.hpp>
 #include <waterpixels/waterpixels.hpp>
+#include <waterpixels/writer.hpp>
 #include <waterpixels/config.hpp>
 
-#ifndef OUTPUT_DEBUG
-#define OUTPUT_DEBUG false
-#endif
-
-#if OUTPUT_DEBUG
-#include <Algorithms/ConnectedComponents.h>
-#endif
 
+namespace
+{
+	// Comma separated values, a single value gives a single element list
+	std::vector<float> parseList(const std::string& list)
+	{
+		std::vector<float> values;
+		std::stringstream stream(list);
+		std::string value;
+		while (std::getline(stream, value, ','))
+			if (!value.empty())
+				values.emplace_back(static_cast<float>(atof(value.c_str())));
+		return values;
+	}
+}
 
 int main(int argc, char** argv)
 {
-	// Read parameters
-	if (argc < 5)
+	// Read parameters : the options may appear anywhere, the other arguments are positional
+	WP::WaterpixelOptions options;
+	std::vector<const char*> args;
+	bool validOptions = true;
+	bool sequence = false;
+	bool debugRequested = false;
+	int changeThreshold = 0;
+	std::string superpixelsPath;
+	std::string labelRunsPath;
+	for (int i = 0; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--l2")
+			options.distance = WP::RegularizationDistance::L2;
+		else if (arg == "--linf")
+			options.distance = WP::RegularizationDistance::LInf;
+		else if (arg == "--central-marker")
+			options.markerSelection = WP::MarkerSelection::ClosestToCenter;
+		else if (arg == "--largest-marker")
+			options.markerSelection = WP::MarkerSelection::Largest;
+		else if (arg == "--marker-epsilon" && i + 1 < argc)
+			options.markerEpsilon = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--compact")
+			options.flooding = WP::FloodingEngine::Compact;
+		else if (arg == "--regularized")
+			options.flooding = WP::FloodingEngine::Regularized;
+		else if (arg == "--tiled")
+			options.flooding = WP::FloodingEngine::Tiled;
+		else if (arg == "--debug")
+			options.outputDebug = debugRequested = true;
+		else if (arg == "--no-debug")
+			options.outputDebug = false;
+		else if (arg == "--sequence")
+			sequence = true;
+		else if (arg == "--change-threshold" && i + 1 < argc)
+			changeThreshold = atoi(argv[++i]);
+		else if (arg == "--superpixels" && i + 1 < argc)
+			superpixelsPath = argv[++i];
+		else if (arg == "--label-runs" && i + 1 < argc)
+			labelRunsPath = argv[++i];
+		else if (i > 0 && arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+			validOptions = false;
+		else
+			args.emplace_back(argv[i]);
+	}
+	if (!validOptions || args.size() < 5)
 	{
 		std::cerr <<
-			"Wrong usage : waterpixels <input> <output> <sigma> <k>\n\timage : pgm P6 input image path\n\toutput : ppm output image path\n\tsigma : default = 50\n\tk : default = 5"
+			"Wrong usage : waterpixels [options] <input> <output> <sigma> <k> [cellScale] [blurRadius] [stream] [cache]\n\timage : pgm P6 input image path, or a directory / .txt list of them for batch processing\n\toutput : ppm output image path, or output directory in batch mode\n\tsigma : default = 50\n\tk : default = 5\n\tsigma, k and cellScale can be comma separated lists : one output per combination is written in the output directory\n\tstream : 1 to process the image by bands of rows (bounded memory), not with a batch, a sequence or lists, default = 0\n\tcache : directory where the voronoi cells, the prefiltered image and its gradient are kept for the next runs, not with a batch, a sequence, lists or stream, default = none\nOptions :\n\t--l2 / --linf : distance to the cell center of the spatial regularization, default = "
+			<< (options.distance == WP::RegularizationDistance::LInf ? "linf" : "l2") <<
+			"\n\t--central-marker / --largest-marker : minimum component kept as the source of each cell, default = " <<
+			(options.markerSelection == WP::MarkerSelection::Largest ? "largest" : "central") <<
+			"\n\t--marker-epsilon <e> : tolerance of the minimum value search, default = " << options.markerEpsilon <<
+			"\n\t--regularized / --tiled / --compact : flood the regularized gradient image serially or by tiles in parallel, or flood the gradient with priorities computed on the fly (--sequence always uses regularized, stream always tiled), default = " <<
+			(options.flooding == WP::FloodingEngine::Compact ? "compact" :
+			 options.flooding == WP::FloodingEngine::Tiled ? "tiled" : "regularized") <<
+			"\n\t--debug / --no-debug : save the intermediate images in images/, only for a single input image, not streamed, with single sigma, k and cellScale values, default = " <<
+			(options.outputDebug ? "debug" : "no-debug") <<
+			"\n\t--sequence : the input is a sequence of frames (a directory, a .txt list or a printf pattern like frames/%04d.ppm), each frame starts from the result of the previous one"
+			"\n\t--change-threshold <t> : in a sequence, largest gradient variation of a cell reusing its previous result, default = 0"
+			"\n\t--superpixels <file> : also write the statistics and the adjacency graph of the waterpixels (binary dump, see superpixels.hpp), same restrictions as --debug"
+			"\n\t--label-runs <file> : also write the labels, run-length encoded (binary dump, see runs.hpp), same restrictions as --debug"
 			<< std::endl;
 		return -1;
 	}
-	const auto sigma = static_cast<float>(atof(argv[3]));
-	const auto k = static_cast<float>(atof(argv[4]));
-	const float cellScale = argc > 5 ? static_cast<float>(atof(argv[5])) : 2 / 3.f;
-	const int blurRadius = argc > 6 ? static_cast<float>(atof(argv[6])) : 5;
+	const auto sigma = static_cast<float>(atof(args[3]));
+	const auto k = static_cast<float>(atof(args[4]));
+	const float cellScale = args.size() > 5 ? static_cast<float>(atof(args[5])) : 2 / 3.f;
+	const int blurRadius = args.size() > 6 ? static_cast<float>(atof(args[6])) : 5;
+	const bool stream = args.size() > 7 && atoi(args[7]) != 0;
+	const std::string cacheDirectory = args.size() > 8 ? args[8] : "";
+
+	// The sweep, batch, sequence and stream modes each run on their own, only the single image path uses the cache and
+	// writes the debug images, the superpixel graph and the label runs
+	const auto sigmas = parseList(args[3]);
+	const auto ks = parseList(args[4]);
+	const auto cellScales = args.size() > 5 ? parseList(args[5]) : std::vector<float>{cellScale};
+	const bool sweep = sigmas.size() > 1 || ks.size() > 1 || cellScales.size() > 1;
+	const bool batch = !sequence &&
+		(std::filesystem::is_directory(args[1]) || std::filesystem::path(args[1]).extension() == ".txt");
+	const char* conflict = nullptr;
+	if (sweep && (sequence || batch))
+		conflict = "sigma, k and cellScale lists need a single input image";
+	else if (stream && (sweep || sequence || batch))
+		conflict = "stream needs a single input image and single sigma, k and cellScale values";
+	else if (!cacheDirectory.empty() && (sweep || sequence || batch || stream))
+		conflict = "cache is only used for a single input image, not streamed, with single sigma, k and cellScale values";
+	else if ((debugRequested || !superpixelsPath.empty() || !labelRunsPath.empty()) &&
+	         (sweep || sequence || batch || stream))
+		conflict = "--debug, --superpixels and --label-runs are only written for a single input image, not streamed, "
+			"with single sigma, k and cellScale values";
+	if (conflict)
+	{
+		std::cerr << "Wrong usage : " << conflict << std::endl;
+		return -1;
+	}
+
+#if ENABLE_PROFILER
+	// Once everything is done : summary of the traced scopes, and the whole trace if WP_TRACE names an output file
+	struct TraceReport
+	{
+		~TraceReport()
+		{
+			WP::TraceRecorder::printSummary(std::cout);
+			if (const char* path = std::getenv("WP_TRACE"))
+				if (!WP::TraceRecorder::writeChromeTrace(path))
+					std::cerr << "Failed to write trace file '" << path << "'" << std::endl;
+		}
+	} traceReport;
+#endif
 
 	/****** 1) Load the image ******/
-	if (!std::filesystem::exists(argv[1]))
+	// The frames of a sequence may be given by a pattern
+	if (!sequence && !std::filesystem::exists(args[1]))
 	{
-		std::cerr << "Failed to find input file '" << argv[1] << "'." << std::endl;
+		std::cerr << "Failed to find input file '" << args[1] << "'." << std::endl;
 		return -1;
 	}
+
+	if (sequence || sweep || batch || stream)
+	{
+		// The modes throw when an input can't be read or an output can't be written
+		try
+		{
+			if (sequence)
+				WP::waterpixelSequence(args[1], args[2], sigma, k, cellScale, blurRadius, changeThreshold, options);
+			else
+			{
+				// Intermediate images of the same size recycle their buffers instead of reallocating them
+				LibTIM::ImageBufferPool imagePool;
+				if (sweep)
+					WP::waterpixelSweep(args[1], args[2], sigmas, ks, cellScales, blurRadius, options);
+				else if (batch)
+					WP::waterpixelBatch(args[1], args[2], sigma, k, cellScale, blurRadius, options);
+				else
+				{
+					if (options.flooding != WP::FloodingEngine::Tiled)
+						std::cout << "Streamed by bands : the watershed is flooded by tiles (--tiled)" << std::endl;
+					WP::waterpixelStream(args[1], args[2], sigma, k, cellScale, blurRadius, options);
+				}
+			}
+		}
+		catch (const std::invalid_argument& error)
+		{
+			std::cerr << "Wrong usage : " << error.what() << std::endl;
+			return -1;
+		}
+		catch (const std::exception& error)
+		{
+			std::cerr << "Error : " << error.what() << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	// Intermediate images of the same size recycle their buffers instead of reallocating them
+	LibTIM::ImageBufferPool imagePool;
+
+	// Stages that only depend on the input content and blurRadius are keyed by inputKey
+	std::optional<WP::StageCache> cache;
+	uint64_t inputKey = 0;
+	if (!cacheDirectory.empty())
+	{
+		MEASURE_DURATION(hashing, "Hash input image");
+		cache.emplace(cacheDirectory);
+		inputKey = WP::StageCache::combineHash(WP::StageCache::hashFile(args[1]), blurRadius);
+	}
+
+	// Not loaded when the prefiltered image is cached
 	auto image = LibTIM::Image<LibTIM::RGB>();
+	bool imageLoaded = false;
+	const auto loadImage = [&]
 	{
 		MEASURE_DURATION(loading, "Load image");
-		LibTIM::Image<LibTIM::RGB>::load(argv[1], image);
-	}
+		LibTIM::Image<LibTIM::RGB>::load(args[1], image);
+		imageLoaded = true;
+	};
 
 
 	/****** 2) Pre filter image to remove details ******/
 	LibTIM::FlatSE filter;
 	filter.make2DEuclidianBall(blurRadius);
-	LibTIM::Image<LibTIM::U8> preFilteredImage;
+	const auto preFilter = [&]
 	{
+		loadImage();
 		MEASURE_DURATION(prefiltering, "Image pre-filtering");
 		if (blurRadius >= 1)
-		{
-			preFilteredImage = closingNoBorder(openingNoBorder(WP::rgbImageIntensity(image), filter), filter);
-		}
-		else
-			preFilteredImage = WP::rgbImageIntensity(image);
-	}
+			return closingNoBorder(openingNoBorder(WP::rgbImageIntensity(image), filter), filter);
+		return WP::rgbImageIntensity(image);
+	};
+	const LibTIM::Image<LibTIM::U8> preFilteredImage = cache ? cache->image("prefiltered", inputKey, preFilter) : preFilter();
 	
 	/****** 3) Choose cell centers ******/
 	std::vector<glm::ivec2> cellCenters;
@@ -66,52 +240,90 @@ int main(int argc, char** argv)
 	}
 
 	/****** 4) Execute waterpixel algorithm ******/
+	// The debug images are written in the background, from the intermediate results of the algorithm
+	std::optional<WP::AsyncWriter> debugWriter;
+	WP::WaterpixelStages stages;
+	WP::WaterpixelStages* const keptStages = options.outputDebug || !superpixelsPath.empty() ? &stages : nullptr;
 	LibTIM::Image<LibTIM::TLabel> markers;
 	{
 		MEASURE_DURATION(watershed, "Waterpixel algorithm");
-		markers = WP::waterpixel(preFilteredImage, cellCenters, sigma, k, cellScale);
+		if (cache)
+		{
+			stages.voronoi = cache->voronoi(preFilteredImage.getSizeX(), preFilteredImage.getSizeY(), cellCenters);
+			const auto gradient = cache->image("gradient", inputKey, [&]
+			{
+				LibTIM::FlatSE connectivity;
+				connectivity.make2DN4();
+				return morphologicalGradient(preFilteredImage, connectivity);
+			});
+			markers = WP::waterpixel(preFilteredImage, stages.voronoi, sigma, k, cellScale, &gradient, options,
+			                         keptStages);
+		}
+		else
+			markers = WP::waterpixel(preFilteredImage, cellCenters, sigma, k, cellScale, options, keptStages);
 	}
 
-	filter.make2DN4();
-	const auto markerDelimitation = morphologicalGradient(markers, filter);
-	
-	// Save image
-	WP::labelToBinaryImage(markerDelimitation).save(argv[2]);
-
-#if OUTPUT_DEBUG
-
-	const WP::VoronoiGraph voronoi(preFilteredImage.getSizeX(), preFilteredImage.getSizeY(), cellCenters);
-
-	// Move to the derivative space
-	filter.make2DN4();
-	auto gradient = morphologicalGradient(preFilteredImage, filter);
-	gradient.save("images/imageGradient.ppm");
+	if (!superpixelsPath.empty())
+	{
+		if (!imageLoaded)
+			loadImage();
+		const auto view = WP::pixelView(image);
+		WP::saveSuperpixelGraph(WP::superpixelGraph(markers, cellCenters.size(), stages.gradient, &view), superpixelsPath);
+	}
 
-	// This will serve as guide to the watershed algorithm
-	auto regularizedSobelImg = spatialRegularization(gradient, voronoi, sigma, k);
-	regularizedSobelImg.save("images/spatialRegularizationGradient.ppm");
+	if (options.outputDebug)
+	{
+		debugWriter.emplace();
+		debugWriter->save(std::move(stages.gradient), "images/imageGradient.ppm");
+		if (options.flooding != WP::FloodingEngine::Compact)
+			debugWriter->save(std::move(stages.regularizedGradient), "images/spatialRegularizationGradient.ppm");
+		debugWriter->submit([voronoi = std::move(stages.voronoi), sources = std::move(stages.markers)]
+		{
+			auto gridDebugImage = voronoi.debugVisualization();
+			LibTIM::forEachRow(gridDebugImage.getSizeY(), [&](LibTIM::TCoord y)
+			{
+				LibTIM::RGB* pixels = gridDebugImage.row(y);
+				const LibTIM::TLabel* labels = sources.row(y);
+				for (LibTIM::TCoord x = 0; x < gridDebugImage.getSizeX(); ++x)
+					if (labels[x])
+						pixels[x][2] = 255;
+			});
+			gridDebugImage.save("images/watershedSources.pgm");
+		});
+	}
 
-	// Generate watershed origins
-	const auto watershedSources = makeWatershedMarkers(gradient, voronoi, sigma, cellScale);
+	if (!labelRunsPath.empty())
+		WP::saveLabelRuns(WP::encodeLabelRuns(markers), labelRunsPath);
 
-	auto gridDebugImage = voronoi.debugVisualization();
+	auto markerDelimitation = WP::labelBoundaries(markers);
 
-	for (size_t x = 0; x < gridDebugImage.getSizeX(); ++x)
-		for (size_t y = 0; y < gridDebugImage.getSizeY(); ++y)
-			if (watershedSources(x, y))
-				gridDebugImage(x, y)[2] = 255;
-	gridDebugImage.save("images/watershedSources.pgm");
+	if (options.outputDebug)
+	{
+		// Return the delimitation instead of just connected components
+		if (!imageLoaded)
+			loadImage();
+		debugWriter->submit([image = std::move(image), markerDelimitation]() mutable
+		{
+			LibTIM::forEachRow(image.getSizeY(), [&](LibTIM::TCoord y)
+			{
+				LibTIM::RGB* pixels = image.row(y);
+				const LibTIM::U8* delimitation = markerDelimitation.row(y);
+				for (LibTIM::TCoord x = 0; x < image.getSizeX(); ++x)
+					if (delimitation[x])
+						pixels[x][0] = pixels[x][1] = pixels[x][2] = 255;
+			});
+			image.save("images/combined.pgm");
+		});
+	}
 
-	// Return the delimitation instead of just connected components
+	// Save image
+	markerDelimitation.save(args[2]);
 
-	auto result = LibTIM::Image<LibTIM::RGB>(image.getSizeX(), image.getSizeY());
-	for (size_t x = 0; x < result.getSizeX(); ++x)
-		for (size_t y = 0; y < result.getSizeY(); ++y)
-		{
-			result(x, y) = image(x, y);
-			if (markerDelimitation(x, y))
-				result(x, y) = LibTIM::RGB({255, 255, 255});
-		}
-	result.save("images/combined.pgm");
+#if ENABLE_PROFILER
+	const auto memory = LibTIM::ImageMemory::stats();
+	std::cout << "Image buffers : " << memory.allocations << " allocations (" << memory.allocatedBytes / 1024 <<
+		" KiB, " << memory.largeAllocations << " >= 1MiB), " << memory.reuses << " reused (" << memory.reusedBytes /
+		1024 << " KiB), " << memory.evictions << " evicted from the pool (" << memory.evictedBytes / 1024 << " KiB)" <<
+		std::endl;
 #endif
 }
@@ -0,0 +1,171 @@
+#include "waterpixels/batch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <thread>
+
+#include "waterpixels/queue.hpp"
+#include "waterpixels/utils.hpp"
+#include "waterpixels/waterpixels.hpp"
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Common/FlatSE.h>
+
+namespace WP
+{
+	namespace
+	{
+		struct LoadedImage
+		{
+			std::string name;
+			LibTIM::Image<LibTIM::RGB> image;
+		};
+
+		struct ComputedImage
+		{
+			std::filesystem::path path;
+			LibTIM::Image<LibTIM::U8> delimitation;
+		};
+	}
+
+	std::vector<std::string> listBatchInputs(const std::string& input)
+	{
+		std::vector<std::string> inputs;
+		if (std::filesystem::is_directory(input))
+		{
+			for (const auto& entry : std::filesystem::directory_iterator(input))
+				if (entry.is_regular_file() && entry.path().extension() == ".ppm")
+					inputs.emplace_back(entry.path().string());
+			std::sort(inputs.begin(), inputs.end());
+			return inputs;
+		}
+
+		std::ifstream list(input);
+		if (!list)
+			throw std::runtime_error("failed to open '" + input + "'");
+		std::string line;
+		while (std::getline(list, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				inputs.emplace_back(line);
+		}
+		return inputs;
+	}
+
+	void waterpixelBatch(const std::string& input, const std::string& outputDirectory, float sigma, float k,
+	                     float cellScale, int blurRadius, const WaterpixelOptions& options)
+	{
+		const auto inputs = listBatchInputs(input);
+		std::filesystem::create_directories(outputDirectory);
+
+		MEASURE_CUMULATIVE_DURATION(loading, "Load batch images");
+		MEASURE_CUMULATIVE_DURATION(computing, "Compute batch waterpixels");
+		MEASURE_CUMULATIVE_DURATION(saving, "Save batch results");
+
+		const auto start = std::chrono::steady_clock::now();
+		BoundedQueue<LoadedImage> loaded(1);
+		BoundedQueue<ComputedImage> computed(1);
+
+		std::thread loader([&]
+		{
+			for (const auto& path : inputs)
+			{
+				LoadedImage item{std::filesystem::path(path).stem().string(), {}};
+				try
+				{
+					MEASURE_ADD_CUMULATOR(loading);
+					if (!LibTIM::Image<LibTIM::RGB>::load(path.c_str(), item.image))
+						throw std::runtime_error("not a binary ppm image");
+				}
+				catch (const std::exception& error)
+				{
+					std::cerr << "Skipping '" << path << "' : " << error.what() << std::endl;
+					continue;
+				}
+				if (!loaded.push(std::move(item)))
+					break;
+			}
+			loaded.close();
+		});
+
+		std::thread saver([&]
+		{
+			while (auto item = computed.pop())
+			{
+				try
+				{
+					MEASURE_ADD_CUMULATOR(saving);
+					if (!item->delimitation.save(item->path.string().c_str()))
+						std::cerr << "Failed to save '" << item->path.string() << "'" << std::endl;
+				}
+				catch (const std::exception& error)
+				{
+					std::cerr << "Failed to save '" << item->path.string() << "' : " << error.what() << std::endl;
+				}
+			}
+		});
+
+		size_t imageCount = 0;
+		uint64_t pixelCount = 0;
+		try
+		{
+			LibTIM::FlatSE filter;
+			filter.make2DEuclidianBall(blurRadius);
+
+			// Grid and voronoi graph of the last image size
+			int voronoiWidth = -1;
+			int voronoiHeight = -1;
+			VoronoiGraph voronoi;
+
+			while (auto item = loaded.pop())
+			{
+				MEASURE_ADD_CUMULATOR(computing);
+				const int width = item->image.getSizeX();
+				const int height = item->image.getSizeY();
+
+				auto intensity = rgbImageIntensity(item->image);
+				item->image = LibTIM::Image<LibTIM::RGB>();
+				if (blurRadius >= 1)
+					intensity = closingNoBorder(openingNoBorder(std::move(intensity), filter), filter);
+
+				if (width != voronoiWidth || height != voronoiHeight)
+				{
+					voronoi = VoronoiGraph(width, height, makeRectGrid2D(width, height, sigma));
+					voronoiWidth = width;
+					voronoiHeight = height;
+				}
+
+				auto markers = waterpixel(intensity, voronoi, sigma, k, cellScale, nullptr, options);
+				ComputedImage result{
+					std::filesystem::path(outputDirectory) / (item->name + ".pgm"),
+					labelBoundaries(markers)
+				};
+				computed.push(std::move(result));
+
+				imageCount++;
+				pixelCount += static_cast<uint64_t>(width) * height;
+			}
+		}
+		catch (...)
+		{
+			loaded.close();
+			computed.close();
+			loader.join();
+			saver.join();
+			throw;
+		}
+		computed.close();
+		loader.join();
+		saver.join();
+
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Batch : " << imageCount << " images (" << pixelCount / 1e6 << " MP) in " << seconds << "s, "
+			<< imageCount / seconds << " images/s, " << pixelCount / 1e6 / seconds << " MP/s" << std::endl;
+	}
+}
@@ -0,0 +1,226 @@
+#include "waterpixels/cache.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <libtim/Common/ImageMapping.h>
+
+namespace WP
+{
+	namespace
+	{
+		// Bump when the layout of a cache entry changes
+		constexpr uint64_t CACHE_VERSION = 1;
+
+		uint64_t mix64(uint64_t value)
+		{
+			value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+			value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+			return value ^ (value >> 31);
+		}
+
+		// Raw voronoi graph layout : this header, then the centers, the cell map, the CSR offsets and the CSR pixels
+		struct VoronoiFileHeader
+		{
+			char magic[8];
+			uint64_t version;
+			uint64_t width;
+			uint64_t height;
+			uint64_t cellCount;
+		};
+
+		constexpr char VORONOI_MAGIC[8] = {'W', 'P', 'V', 'O', 'R', 'O', 'N', 'I'};
+
+		// Whether a raw voronoi layout read from disk is a partition of the pixels that VoronoiGraph can index : cell
+		// ids below cellCount, monotone offsets ending at pixelCount, each cell listing its own pixels in raster order
+		bool isValidVoronoiLayout(const std::vector<uint32_t>& cellIds, const std::vector<uint32_t>& cellOffsets,
+		                          const std::vector<uint32_t>& cellPixels)
+		{
+			const auto cellCount = static_cast<int64_t>(cellOffsets.size()) - 1;
+			const auto pixelCount = static_cast<int64_t>(cellIds.size());
+			if (cellCount < 0 || cellOffsets.front() != 0 || cellOffsets.back() != pixelCount ||
+				static_cast<int64_t>(cellPixels.size()) != pixelCount)
+				return false;
+			for (int64_t cell = 0; cell < cellCount; ++cell)
+				if (cellOffsets[cell] > cellOffsets[cell + 1])
+					return false;
+
+			bool valid = true;
+#pragma omp parallel for schedule(dynamic, 256) reduction(&&:valid)
+			for (int64_t cell = 0; cell < cellCount; ++cell)
+				for (auto i = cellOffsets[cell]; valid && i < cellOffsets[cell + 1]; ++i)
+				{
+					const auto pixel = cellPixels[i];
+					valid = pixel < pixelCount && cellIds[pixel] == cell &&
+						(i == cellOffsets[cell] || cellPixels[i - 1] < pixel);
+				}
+			return valid;
+		}
+
+		// Write to a temporary file then rename it, readers never see a partial entry
+		template <typename Lambda_T>
+		void writeEntry(const std::filesystem::path& path, Lambda_T write)
+		{
+			std::stringstream suffix;
+			suffix << ".tmp" << std::hex << mix64(reinterpret_cast<uintptr_t>(&path) ^ static_cast<uint64_t>(
+				std::chrono::steady_clock::now().time_since_epoch().count()));
+			const auto temporary = path.string() + suffix.str();
+			try
+			{
+				write(temporary);
+				std::filesystem::rename(temporary, path);
+			}
+			catch (const std::exception& error)
+			{
+				std::error_code ignored;
+				std::filesystem::remove(temporary, ignored);
+				std::cerr << "Failed to write cache entry '" << path.string() << "' : " << error.what() << std::endl;
+			}
+		}
+	}
+
+	StageCache::StageCache(const std::string& _directory) : directory(_directory)
+	{
+		std::filesystem::create_directories(directory);
+	}
+
+	uint64_t StageCache::hashFile(const std::string& path)
+	{
+		const LibTIM::MappedFile file(path.c_str());
+		const auto size = file.size();
+
+		// Chunks are hashed in parallel, then their hashes are combined in order
+		constexpr uint64_t chunkSize = 1 << 20;
+		const auto chunkCount = static_cast<int64_t>((size + chunkSize - 1) / chunkSize);
+		std::vector<uint64_t> chunkHashes(chunkCount);
+#pragma omp parallel for
+		for (int64_t chunk = 0; chunk < chunkCount; ++chunk)
+		{
+			const uint64_t begin = chunk * chunkSize;
+			const uint64_t end = std::min(size, begin + chunkSize);
+			uint64_t hash = mix64(chunk);
+			uint64_t i = begin;
+			for (; i + 8 <= end; i += 8)
+			{
+				uint64_t word;
+				memcpy(&word, file.data() + i, 8);
+				hash = combineHash(hash, word);
+			}
+			for (; i < end; ++i)
+				hash = combineHash(hash, file.data()[i]);
+			chunkHashes[chunk] = hash;
+		}
+
+		uint64_t hash = combineHash(CACHE_VERSION, size);
+		for (const auto chunkHash : chunkHashes)
+			hash = combineHash(hash, chunkHash);
+		return hash;
+	}
+
+	uint64_t StageCache::combineHash(uint64_t hash, uint64_t value)
+	{
+		return mix64(hash * 0x9e3779b97f4a7c15ull ^ value);
+	}
+
+	std::filesystem::path StageCache::entryPath(const std::string& stage, uint64_t key,
+	                                            const std::string& extension) const
+	{
+		std::stringstream name;
+		name << stage << "-" << std::hex << std::setw(16) << std::setfill('0') << key << extension;
+		return directory / name.str();
+	}
+
+	VoronoiGraph StageCache::voronoi(size_t width, size_t height, const std::vector<glm::ivec2>& centers) const
+	{
+		uint64_t key = combineHash(combineHash(combineHash(CACHE_VERSION, width), height), centers.size());
+		for (const auto& center : centers)
+			key = combineHash(key, static_cast<uint32_t>(center.x) | static_cast<uint64_t>(center.y) << 32);
+		const auto path = entryPath("voronoi", key, ".bin");
+
+		const uint64_t pixelCount = width * height;
+		const uint64_t centersBytes = centers.size() * sizeof(glm::ivec2);
+		const uint64_t offsetsBytes = (centers.size() + 1) * sizeof(uint32_t);
+		const uint64_t mapBytes = pixelCount * sizeof(uint32_t);
+		const uint64_t fileSize = sizeof(VoronoiFileHeader) + centersBytes + 2 * mapBytes + offsetsBytes;
+
+		if (std::filesystem::exists(path))
+		{
+			MEASURE_DURATION(loadVoronoi, "Load cached voronoi cells");
+			const LibTIM::MappedFile file(path.string().c_str());
+			VoronoiFileHeader header;
+			if (file.size() == fileSize)
+				memcpy(&header, file.data(), sizeof(header));
+			if (file.size() == fileSize && memcmp(header.magic, VORONOI_MAGIC, sizeof(VORONOI_MAGIC)) == 0 &&
+				header.version == CACHE_VERSION && header.width == width && header.height == height &&
+				header.cellCount == centers.size())
+			{
+				const unsigned char* data = file.data() + sizeof(VoronoiFileHeader);
+				std::vector<glm::ivec2> storedCenters(centers.size());
+				std::vector<uint32_t> cellIds(pixelCount);
+				std::vector<uint32_t> cellOffsets(centers.size() + 1);
+				std::vector<uint32_t> cellPixels(pixelCount);
+				LibTIM::parallelCopy(storedCenters.data(), data, centersBytes);
+				LibTIM::parallelCopy(cellIds.data(), data += centersBytes, mapBytes);
+				LibTIM::parallelCopy(cellOffsets.data(), data += mapBytes, offsetsBytes);
+				LibTIM::parallelCopy(cellPixels.data(), data += offsetsBytes, mapBytes);
+				if (storedCenters == centers && isValidVoronoiLayout(cellIds, cellOffsets, cellPixels))
+					return VoronoiGraph(width, height, std::move(storedCenters), std::move(cellIds),
+					                    std::move(cellOffsets), std::move(cellPixels));
+			}
+			std::cerr << "Ignoring invalid cache entry '" << path.string() << "'" << std::endl;
+		}
+
+		VoronoiGraph graph;
+		{
+			MEASURE_DURATION(voronoiCells, "Generate voronoi cells");
+			graph = VoronoiGraph(width, height, centers);
+		}
+		writeEntry(path, [&](const std::string& temporary)
+		{
+			LibTIM::MappedFile file(temporary.c_str(), fileSize);
+			VoronoiFileHeader header{};
+			memcpy(header.magic, VORONOI_MAGIC, sizeof(VORONOI_MAGIC));
+			header.version = CACHE_VERSION;
+			header.width = width;
+			header.height = height;
+			header.cellCount = centers.size();
+			memcpy(file.data(), &header, sizeof(header));
+			unsigned char* data = file.data() + sizeof(VoronoiFileHeader);
+			LibTIM::parallelCopy(data, graph.centers().data(), centersBytes);
+			LibTIM::parallelCopy(data += centersBytes, graph.cellMap().data(), mapBytes);
+			LibTIM::parallelCopy(data += mapBytes, graph.pixelOffsets().data(), offsetsBytes);
+			LibTIM::parallelCopy(data += offsetsBytes, graph.pixelIndex().data(), mapBytes);
+		});
+		return graph;
+	}
+
+	bool StageCache::loadImage(const std::string& stage, uint64_t key, LibTIM::Image<LibTIM::U8>& image) const
+	{
+		const auto path = entryPath(stage, key, ".pgm");
+		if (!std::filesystem::exists(path))
+			return false;
+		try
+		{
+			return LibTIM::Image<LibTIM::U8>::load(path.string().c_str(), image) != 0;
+		}
+		catch (const std::exception& error)
+		{
+			std::cerr << "Ignoring invalid cache entry '" << path.string() << "' : " << error.what() << std::endl;
+			return false;
+		}
+	}
+
+	void StageCache::storeImage(const std::string& stage, uint64_t key, LibTIM::Image<LibTIM::U8>& image) const
+	{
+		writeEntry(entryPath(stage, key, ".pgm"),
+		           [&](const std::string& temporary)
+		           {
+			           if (!image.save(temporary.c_str()))
+				           throw std::runtime_error("the image could not be saved");
+		           });
+	}
+}
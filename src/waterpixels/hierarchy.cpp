@@ -0,0 +1,330 @@
+#include "waterpixels/hierarchy.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#include "waterpixels/regularization.hpp"
+#include "waterpixels/utils.hpp"
+
+#include <libtim/Algorithms/ConnectedComponents.hxx>
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Algorithms/Watershed.hxx>
+#include <libtim/Common/FlatSE.h>
+
+namespace WP
+{
+	namespace
+	{
+		constexpr uint32_t noRegion = UINT32_MAX;
+
+		struct BorderPair
+		{
+			uint64_t regions; // lower region << 32 | higher region
+			uint32_t pixel; // pixel of the pair with the highest gradient
+			LibTIM::U8 pass; // gradient of that pixel
+		};
+
+		// Union-find over the regions, each set carrying the marker it was reached from (0 if none yet)
+		class MarkerForest
+		{
+		public:
+			MarkerForest(std::vector<LibTIM::TLabel> _markers) : parents(_markers.size()), markers(std::move(_markers))
+			{
+				std::iota(parents.begin(), parents.end(), 0);
+			}
+
+			uint32_t find(uint32_t region)
+			{
+				while (parents[region] != region)
+					region = parents[region] = parents[parents[region]];
+				return region;
+			}
+
+			// Join the sets of a and b unless they already hold two different markers
+			void join(uint32_t a, uint32_t b)
+			{
+				a = find(a);
+				b = find(b);
+				if (a == b || (markers[a] && markers[b]))
+					return;
+				parents[b] = a;
+				if (!markers[a])
+					markers[a] = markers[b];
+			}
+
+			[[nodiscard]] LibTIM::TLabel marker(uint32_t region) { return markers[find(region)]; }
+
+		private:
+			std::vector<uint32_t> parents;
+			std::vector<LibTIM::TLabel> markers;
+		};
+
+		// Stable order of items by an 8 bits key (counting sort)
+		template <typename Key_T>
+		std::vector<uint32_t> sortByByte(size_t count, Key_T key)
+		{
+			std::vector<uint32_t> offsets(257, 0);
+			for (size_t i = 0; i < count; ++i)
+				offsets[key(i) + 1]++;
+			std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+			std::vector<uint32_t> order(count);
+			for (size_t i = 0; i < count; ++i)
+				order[offsets[key(i)]++] = static_cast<uint32_t>(i);
+			return order;
+		}
+
+		// Nearest center coordinate along one axis of a makeRectGrid2D grid : index of the closest of coordinates
+		// for each position in [0, size[ (the lowest one on ties)
+		std::vector<uint32_t> nearestCoordinates(const std::vector<int>& coordinates, int size)
+		{
+			std::vector<uint32_t> nearest(size);
+			size_t i = 0;
+			for (int position = 0; position < size; ++position)
+			{
+				while (i + 1 < coordinates.size() &&
+					std::abs(coordinates[i + 1] - position) < std::abs(coordinates[i] - position))
+					++i;
+				nearest[position] = static_cast<uint32_t>(i);
+			}
+			return nearest;
+		}
+	}
+
+	WaterpixelHierarchy::WaterpixelHierarchy(const LibTIM::Image<LibTIM::U8>& gradient, int atomSize) :
+		width(gradient.getSizeX()), height(gradient.getSizeY())
+	{
+		const int64_t pixelCount = static_cast<int64_t>(width) * height;
+		if (pixelCount > static_cast<int64_t>(UINT32_MAX))
+			throw std::runtime_error("WaterpixelHierarchy supports at most 2^32 pixels");
+
+		// Catchment basins of every regional minimum
+		LibTIM::Image<LibTIM::TLabel> basins;
+		{
+			MEASURE_DURATION(basinsDuration, "Flood the gradient from its regional minima");
+			LibTIM::FlatSE connectivity;
+			connectivity.make2DN4();
+			auto minima = regionalMinima(gradient, connectivity);
+			basins = labelConnectedComponents(minima, connectivity);
+			LibTIM::watershedMeyer<LibTIM::U8>(gradient, basins, connectivity);
+		}
+
+		MEASURE_DURATION(adjacency, "Build the region adjacency graph");
+		// Regions : connected parts of the basins within each atomSize x atomSize block (union-find over the pixels)
+		{
+			std::vector<uint32_t> parents(pixelCount);
+			std::iota(parents.begin(), parents.end(), 0);
+			const auto find = [&](uint32_t p)
+			{
+				while (parents[p] != p)
+					p = parents[p] = parents[parents[p]];
+				return p;
+			};
+			const auto same = [&](int64_t p, int64_t q, int64_t xp, int64_t yp, int64_t xq, int64_t yq)
+			{
+				return basins(p) == basins(q) && xp / atomSize == xq / atomSize && yp / atomSize == yq / atomSize;
+			};
+			for (int64_t y = 0; y < height; ++y)
+				for (int64_t x = 0; x < width; ++x)
+				{
+					const auto p = x + y * width;
+					if (x > 0 && same(p, p - 1, x, y, x - 1, y))
+						parents[find(p)] = find(p - 1);
+					if (y > 0 && same(p, p - width, x, y, x, y - 1))
+					{
+						const auto a = find(p);
+						const auto b = find(p - width);
+						parents[std::max(a, b)] = std::min(a, b);
+					}
+				}
+			regionOf.resize(pixelCount);
+			uint32_t regions = 0;
+			for (int64_t p = 0; p < pixelCount; ++p)
+				regionOf[p] = find(p) == p ? regions++ : regionOf[find(p)];
+			regionMinima.assign(regions, 255);
+			regionSeeds.assign(regions, noRegion);
+			regionAreas.assign(regions, 0);
+		}
+
+		// Lowest pixel of each region (first one in raster order on ties) : the only pixel a level looks at to place
+		// its markers
+		for (int64_t p = 0; p < pixelCount; ++p)
+		{
+			const auto region = regionOf[p];
+			if (regionSeeds[region] == noRegion || gradient(p) < regionMinima[region])
+			{
+				regionMinima[region] = gradient(p);
+				regionSeeds[region] = static_cast<uint32_t>(p);
+			}
+			regionAreas[region]++;
+		}
+
+		// N4 neighbours in different regions, grouped by pair of regions : bucketed by lower region (two scans of the
+		// image), then each small bucket is sorted on its own
+		const auto regionCount = static_cast<int64_t>(regionMinima.size());
+		std::vector<uint32_t> bucketOffsets(regionCount + 1, 0);
+		std::vector<BorderPair> pairs;
+		const auto forEachPair = [&](auto visit)
+		{
+			const auto visitIfBorder = [&](int64_t p, int64_t q)
+			{
+				auto a = regionOf[p];
+				auto b = regionOf[q];
+				if (a == b)
+					return;
+				if (a > b)
+					std::swap(a, b);
+				const auto pass = gradient(p) >= gradient(q) ? p : q;
+				visit(a, b, static_cast<uint32_t>(pass), gradient(pass));
+			};
+			for (int64_t y = 0; y < height; ++y)
+				for (int64_t x = 0; x < width; ++x)
+				{
+					const auto p = x + y * width;
+					if (x + 1 < width)
+						visitIfBorder(p, p + 1);
+					if (y + 1 < height)
+						visitIfBorder(p, p + width);
+				}
+		};
+		forEachPair([&](uint32_t a, uint32_t, uint32_t, LibTIM::U8) { bucketOffsets[a + 1]++; });
+		std::partial_sum(bucketOffsets.begin(), bucketOffsets.end(), bucketOffsets.begin());
+		pairs.resize(bucketOffsets.back());
+		{
+			auto next = bucketOffsets;
+			forEachPair([&](uint32_t a, uint32_t b, uint32_t pixel, LibTIM::U8 pass)
+			{
+				pairs[next[a]++] = {static_cast<uint64_t>(a) << 32 | b, pixel, pass};
+			});
+		}
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int64_t region = 0; region < regionCount; ++region)
+			std::sort(pairs.begin() + bucketOffsets[region], pairs.begin() + bucketOffsets[region + 1],
+			          [](const BorderPair& a, const BorderPair& b)
+			          {
+				          return a.regions < b.regions || (a.regions == b.regions && (a.pass < b.pass ||
+					          (a.pass == b.pass && a.pixel < b.pixel)));
+			          });
+
+		// Region adjacency graph, each edge keeping its lowest pass (the first pair of its sorted group)
+		for (size_t i = 0; i < pairs.size(); ++i)
+			if (i == 0 || pairs[i].regions != pairs[i - 1].regions)
+				edges.push_back({static_cast<uint32_t>(pairs[i].regions >> 32), static_cast<uint32_t>(pairs[i].regions),
+				                 pairs[i].pixel, pairs[i].pass});
+	}
+
+	std::vector<LibTIM::TLabel> WaterpixelHierarchy::cut(float sigma, float k, float cellScale,
+	                                                     const WaterpixelOptions& options) const
+	{
+		MEASURE_DURATION(cutDuration, "Grow the markers over the region graph");
+		// Grid of makeRectGrid2D, column by column : the nearest center is the nearest column and the nearest row
+		const auto centers = makeRectGrid2D(width, height, sigma);
+		std::vector<int> columns;
+		std::vector<int> rows;
+		for (const auto& center : centers)
+		{
+			if (columns.empty() || columns.back() != center.x)
+				columns.emplace_back(center.x);
+			if (columns.size() == 1)
+				rows.emplace_back(center.y);
+		}
+		const auto nearestColumn = nearestCoordinates(columns, width);
+		const auto nearestRow = nearestCoordinates(rows, height);
+		const auto cellOf = [&](uint32_t pixel)
+		{
+			return nearestColumn[pixel % width] * static_cast<uint32_t>(rows.size()) + nearestRow[pixel / width];
+		};
+		const auto offsetToCenter = [&](uint32_t pixel)
+		{
+			return glm::ivec2(pixel % width, pixel / width) - centers[cellOf(pixel)];
+		};
+
+		// Marker of each cell : among the regions whose lowest pixel is in the shrunk cell, the lowest ones (within
+		// markerEpsilon), then the closest to the center or the largest, as makeWatershedMarkers selects pixels
+		const auto regionCount = regionMinima.size();
+		const float reach = cellScale * sigma / 2.f;
+		const auto inShrunkCell = [&](uint32_t region)
+		{
+			const auto offset = offsetToCenter(regionSeeds[region]);
+			return static_cast<float>(std::abs(offset.x)) <= reach && static_cast<float>(std::abs(offset.y)) <= reach;
+		};
+		std::vector<int> cellMinima(centers.size(), 256);
+		for (uint32_t region = 0; region < regionCount; ++region)
+			if (inShrunkCell(region))
+			{
+				auto& minimum = cellMinima[cellOf(regionSeeds[region])];
+				minimum = std::min<int>(minimum, regionMinima[region]);
+			}
+		std::vector<uint32_t> cellRegions(centers.size(), noRegion);
+		for (uint32_t region = 0; region < regionCount; ++region)
+		{
+			if (!inShrunkCell(region))
+				continue;
+			const auto cell = cellOf(regionSeeds[region]);
+			if (std::abs(static_cast<float>(regionMinima[region]) - cellMinima[cell]) >= options.markerEpsilon)
+				continue;
+			auto& selected = cellRegions[cell];
+			if (selected == noRegion)
+				selected = region;
+			else if (options.markerSelection == MarkerSelection::ClosestToCenter)
+			{
+				const auto a = offsetToCenter(regionSeeds[region]);
+				const auto b = offsetToCenter(regionSeeds[selected]);
+				if (a.x * a.x + a.y * a.y < b.x * b.x + b.y * b.y)
+					selected = region;
+			}
+			else if (regionAreas[region] > regionAreas[selected])
+				selected = region;
+		}
+
+		// Label of a cell is its index + 1, as in makeWatershedMarkers. A cell without any candidate region is marked
+		// by the region of its center, when no other cell took it.
+		std::vector<LibTIM::TLabel> regionMarkers(regionCount, 0);
+		for (size_t cell = 0; cell < centers.size(); ++cell)
+			if (cellRegions[cell] != noRegion)
+				regionMarkers[cellRegions[cell]] = static_cast<LibTIM::TLabel>(cell + 1);
+		for (size_t cell = 0; cell < centers.size(); ++cell)
+			if (cellRegions[cell] == noRegion)
+			{
+				const auto x = std::clamp(centers[cell].x, 0, width - 1);
+				const auto y = std::clamp(centers[cell].y, 0, height - 1);
+				auto& marker = regionMarkers[regionOf[x + static_cast<int64_t>(y) * width]];
+				if (!marker)
+					marker = static_cast<LibTIM::TLabel>(cell + 1);
+			}
+
+		// Edges weighted by the regularized gradient at their pass, then grown from the markers in increasing order
+		// (minimum spanning forest rooted at the markers, the graph counterpart of the Meyer flooding)
+		std::vector<LibTIM::U8> weights(edges.size());
+		withDistance(options.distance, [&](auto distance)
+		{
+			using Table = RegularizationTable<decltype(distance)::value>;
+			const Table table(sigma, k);
+			for (size_t e = 0; e < edges.size(); ++e)
+			{
+				const auto offset = offsetToCenter(edges[e].pixel);
+				weights[e] = Table::regularize(edges[e].pass, table.at(offset.x, offset.y));
+			}
+		});
+		MarkerForest forest(std::move(regionMarkers));
+		for (const auto e : sortByByte(edges.size(), [&](size_t e) { return weights[e]; }))
+			forest.join(edges[e].first, edges[e].second);
+
+		std::vector<LibTIM::TLabel> regionLabels(regionCount);
+		for (uint32_t region = 0; region < regionCount; ++region)
+			regionLabels[region] = forest.marker(region);
+		return regionLabels;
+	}
+
+	LibTIM::Image<LibTIM::TLabel> WaterpixelHierarchy::extract(float sigma, float k, float cellScale,
+	                                                           const WaterpixelOptions& options) const
+	{
+		const auto regionLabels = cut(sigma, k, cellScale, options);
+		LibTIM::Image<LibTIM::TLabel> labels(width, height);
+#pragma omp parallel for
+		for (int64_t i = 0; i < static_cast<int64_t>(regionOf.size()); ++i)
+			labels(i) = regionLabels[regionOf[i]];
+		return labels;
+	}
+}
@@ -0,0 +1,136 @@
+#include "waterpixels/runs.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+
+#include "waterpixels/utils.hpp"
+
+namespace WP
+{
+	namespace
+	{
+		// Bump when the layout of a dump changes
+		constexpr uint64_t LABEL_RUNS_VERSION = 1;
+		constexpr char LABEL_RUNS_MAGIC[8] = {'W', 'P', 'L', 'R', 'U', 'N', 'S', '\0'};
+
+		struct LabelRunsFileHeader
+		{
+			char magic[8];
+			uint64_t version;
+			uint64_t width;
+			uint64_t height;
+			uint64_t runCount;
+		};
+	}
+
+	LabelRuns encodeLabelRuns(const LibTIM::Image<LibTIM::TLabel>& labels)
+	{
+		MEASURE_DURATION(encoding, "Encode label runs");
+		const int64_t width = labels.getSizeX();
+		const int64_t height = labels.getSizeY();
+		LabelRuns result;
+		result.width = static_cast<uint32_t>(width);
+		result.height = static_cast<uint32_t>(height);
+
+		// Count the runs of each row, then write them where the counts place them
+		result.rowOffsets.assign(height + 1, 0);
+#pragma omp parallel for
+		for (int64_t y = 0; y < height; y++)
+		{
+			const LibTIM::TLabel* row = &labels(0, y);
+			uint64_t count = width > 0 ? 1 : 0;
+			for (int64_t x = 1; x < width; x++)
+				count += row[x] != row[x - 1];
+			result.rowOffsets[y + 1] = count;
+		}
+		std::partial_sum(result.rowOffsets.begin(), result.rowOffsets.end(), result.rowOffsets.begin());
+
+		result.runs.resize(result.rowOffsets.back());
+#pragma omp parallel for
+		for (int64_t y = 0; y < height; y++)
+		{
+			const LibTIM::TLabel* row = &labels(0, y);
+			LabelRun* run = result.runs.data() + result.rowOffsets[y];
+			int64_t start = 0;
+			for (int64_t x = 1; x <= width; x++)
+				if (x == width || row[x] != row[start])
+				{
+					*run++ = {static_cast<uint32_t>(row[start]), static_cast<uint32_t>(x - start)};
+					start = x;
+				}
+		}
+		return result;
+	}
+
+	LibTIM::Image<LibTIM::TLabel> decodeLabelRuns(const LabelRuns& runs)
+	{
+		LibTIM::Image<LibTIM::TLabel> labels(runs.width, runs.height);
+#pragma omp parallel for
+		for (int64_t y = 0; y < static_cast<int64_t>(runs.height); y++)
+		{
+			LibTIM::TLabel* pixel = &labels(0, y);
+			for (auto i = runs.rowOffsets[y]; i < runs.rowOffsets[y + 1]; i++)
+				pixel = std::fill_n(pixel, runs.runs[i].length, static_cast<LibTIM::TLabel>(runs.runs[i].label));
+		}
+		return labels;
+	}
+
+	bool saveLabelRuns(const LabelRuns& runs, const std::string& path)
+	{
+		std::ofstream file(path, std::ios::binary);
+		LabelRunsFileHeader header{};
+		memcpy(header.magic, LABEL_RUNS_MAGIC, sizeof(LABEL_RUNS_MAGIC));
+		header.version = LABEL_RUNS_VERSION;
+		header.width = runs.width;
+		header.height = runs.height;
+		header.runCount = runs.runs.size();
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(runs.rowOffsets.data()), runs.rowOffsets.size() * sizeof(uint64_t));
+		file.write(reinterpret_cast<const char*>(runs.runs.data()), runs.runs.size() * sizeof(LabelRun));
+		if (!file)
+		{
+			std::cerr << "Failed to write label runs '" << path << "'" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool loadLabelRuns(const std::string& path, LabelRuns& runs)
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return false;
+		const auto size = static_cast<uint64_t>(file.tellg());
+		file.seekg(0);
+		LabelRunsFileHeader header;
+		if (size < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+			memcmp(header.magic, LABEL_RUNS_MAGIC, sizeof(LABEL_RUNS_MAGIC)) != 0 ||
+			header.version != LABEL_RUNS_VERSION ||
+			size != sizeof(header) + (header.height + 1) * sizeof(uint64_t) + header.runCount * sizeof(LabelRun))
+			return false;
+
+		runs.width = static_cast<uint32_t>(header.width);
+		runs.height = static_cast<uint32_t>(header.height);
+		runs.rowOffsets.resize(header.height + 1);
+		runs.runs.resize(header.runCount);
+		file.read(reinterpret_cast<char*>(runs.rowOffsets.data()), runs.rowOffsets.size() * sizeof(uint64_t));
+		file.read(reinterpret_cast<char*>(runs.runs.data()), runs.runs.size() * sizeof(LabelRun));
+		if (!file || runs.rowOffsets.front() != 0 || runs.rowOffsets.back() != header.runCount)
+			return false;
+		// Rows must cover the width exactly, decodeLabelRuns() writes them without checking
+		for (uint32_t y = 0; y < runs.height; y++)
+		{
+			if (runs.rowOffsets[y] > runs.rowOffsets[y + 1] || runs.rowOffsets[y + 1] > header.runCount)
+				return false;
+			uint64_t length = 0;
+			for (auto i = runs.rowOffsets[y]; i < runs.rowOffsets[y + 1]; i++)
+				length += runs.runs[i].length;
+			if (length != runs.width)
+				return false;
+		}
+		return true;
+	}
+}
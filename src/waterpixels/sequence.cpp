@@ -0,0 +1,250 @@
+#include "waterpixels/sequence.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "waterpixels/batch.hpp"
+#include "waterpixels/queue.hpp"
+#include "waterpixels/utils.hpp"
+#include "waterpixels/watershed.hpp"
+#include "waterpixels/writer.hpp"
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Common/FlatSE.h>
+
+namespace WP
+{
+	namespace
+	{
+		struct Frame
+		{
+			std::string name;
+			LibTIM::Image<LibTIM::RGB> image;
+		};
+
+		// Opening / closing prefilter of intensity, only recomputed on the rows reached by the rows that differ from
+		// previousIntensity (prefiltered holds the prefilter of previousIntensity)
+		void updatePrefiltered(const LibTIM::Image<LibTIM::U8>& intensity,
+		                       const LibTIM::Image<LibTIM::U8>& previousIntensity, const LibTIM::FlatSE& filter,
+		                       int filterReach, LibTIM::Image<LibTIM::U8>& prefiltered)
+		{
+			const int64_t width = intensity.getSizeX();
+			const int height = intensity.getSizeY();
+			const auto rowChanged = [&](int y)
+			{
+				return !std::equal(&intensity(0, y), &intensity(0, y) + width, &previousIntensity(0, y));
+			};
+			int first = 0;
+			while (first < height && !rowChanged(first))
+				++first;
+			if (first == height)
+				return;
+			int last = height;
+			while (!rowChanged(last - 1))
+				--last;
+
+			// Rows [writeBegin, writeEnd[ may change, the rows read around them make them exact
+			const int writeBegin = std::max(0, first - filterReach);
+			const int writeEnd = std::min(height, last + filterReach);
+			const int readBegin = std::max(0, writeBegin - filterReach);
+			const int readEnd = std::min(height, writeEnd + filterReach);
+			LibTIM::Image<LibTIM::U8> rows(width, readEnd - readBegin);
+			std::copy(&intensity(0, readBegin), &intensity(0, readBegin) + width * (readEnd - readBegin), rows.getData());
+			rows = closingNoBorder(openingNoBorder(std::move(rows), filter), filter);
+			std::copy(&rows(0, writeBegin - readBegin), &rows(0, writeBegin - readBegin) + width * (writeEnd - writeBegin),
+			          &prefiltered(0, writeBegin));
+		}
+	}
+
+	std::vector<std::string> listSequenceFrames(const std::string& input)
+	{
+		const auto conversion = input.find('%');
+		if (conversion == std::string::npos)
+			return listBatchInputs(input);
+
+		// The pattern is parsed instead of handed to snprintf : "%d", or "%0<width>d" for zero padded numbers
+		size_t end = conversion + 1;
+		const bool zeroPadded = end < input.size() && input[end] == '0';
+		while (end < input.size() && std::isdigit(static_cast<unsigned char>(input[end])))
+			++end;
+		if (end == input.size() || (input[end] != 'd' && input[end] != 'i') || end - conversion > 4 ||
+			(!zeroPadded && end != conversion + 1) || input.find('%', end) != std::string::npos)
+			throw std::invalid_argument("'" + input + "' is not a frame pattern with a single %d or %0<width>d");
+		const int width = end > conversion + 1 ? std::stoi(input.substr(conversion + 1, end - conversion - 1)) : 0;
+		const auto prefix = input.substr(0, conversion);
+		const auto suffix = input.substr(end + 1);
+
+		std::vector<std::string> frames;
+		const auto frameName = [&](int index)
+		{
+			const auto number = std::to_string(index);
+			return prefix + std::string(std::max(0, width - static_cast<int>(number.size())), '0') + number + suffix;
+		};
+		int index = std::filesystem::exists(frameName(0)) ? 0 : 1;
+		while (std::filesystem::exists(frameName(index)))
+			frames.emplace_back(frameName(index++));
+		return frames;
+	}
+
+	void waterpixelSequence(const std::string& input, const std::string& outputDirectory, float sigma, float k,
+	                        float cellScale, int blurRadius, int changeThreshold, const WaterpixelOptions& options)
+	{
+		const auto frames = listSequenceFrames(input);
+		std::filesystem::create_directories(outputDirectory);
+
+		BoundedQueue<Frame> loaded(2);
+		std::thread loader([&]
+		{
+			for (const auto& path : frames)
+			{
+				Frame frame{std::filesystem::path(path).stem().string(), {}};
+				try
+				{
+					if (!LibTIM::Image<LibTIM::RGB>::load(path.c_str(), frame.image))
+						throw std::runtime_error("not a binary ppm image");
+				}
+				catch (const std::exception& error)
+				{
+					std::cerr << "Skipping '" << path << "' : " << error.what() << std::endl;
+					continue;
+				}
+				if (!loaded.push(std::move(frame)))
+					break;
+			}
+			loaded.close();
+		});
+
+		MEASURE_CUMULATIVE_DURATION(prefiltering, "Sequence frame pre-filtering");
+		MEASURE_CUMULATIVE_DURATION(updating, "Sequence frame update from the previous one");
+		MEASURE_CUMULATIVE_DURATION(delimiting, "Sequence frame delimitation");
+
+		std::vector<double> latencies;
+		const auto start = std::chrono::steady_clock::now();
+		try
+		{
+			AsyncWriter writer;
+			LibTIM::FlatSE filter;
+			filter.make2DEuclidianBall(blurRadius);
+			// Rows reached by the prefilter (erosion, dilation, dilation, erosion), see waterpixelStream()
+			int filterReach = 0;
+			for (unsigned long i = 0; blurRadius >= 1 && i < filter.getNbPoints(); i++)
+				filterReach = std::max(filterReach, 4 * std::abs(static_cast<int>(filter.getPoint(i).y)));
+
+			// State carried from one frame to the next
+			int width = -1;
+			int height = -1;
+			VoronoiGraph voronoi;
+			LibTIM::Image<LibTIM::U8> intensity;
+			LibTIM::Image<LibTIM::U8> prefiltered;
+			LibTIM::Image<LibTIM::U8> gradient;
+			LibTIM::Image<LibTIM::TLabel> markers;
+			LibTIM::Image<LibTIM::TLabel> labels;
+
+			while (auto frame = loaded.pop())
+			{
+				const auto frameStart = std::chrono::steady_clock::now();
+				if (width >= 0 && (frame->image.getSizeX() != width || frame->image.getSizeY() != height))
+				{
+					std::cerr << "Skipping frame '" << frame->name << "' : its size differs from the first frame" <<
+						std::endl;
+					continue;
+				}
+
+				{
+					MEASURE_ADD_CUMULATOR(prefiltering);
+					auto frameIntensity = rgbImageIntensity(frame->image);
+					frame->image = LibTIM::Image<LibTIM::RGB>();
+					if (blurRadius < 1)
+						prefiltered = frameIntensity;
+					else if (width < 0)
+						prefiltered = closingNoBorder(openingNoBorder(frameIntensity, filter), filter);
+					else
+						updatePrefiltered(frameIntensity, intensity, filter, filterReach, prefiltered);
+					intensity = std::move(frameIntensity);
+				}
+
+				size_t changedCount;
+				if (width < 0)
+				{
+					width = prefiltered.getSizeX();
+					height = prefiltered.getSizeY();
+					voronoi = VoronoiGraph(width, height, makeRectGrid2D(width, height, sigma));
+					// The next frames flood the regularized gradient, the first one must too
+					WaterpixelOptions firstOptions = options;
+					firstOptions.flooding = FloodingEngine::Regularized;
+					WaterpixelStages stages;
+					labels = waterpixel(prefiltered, voronoi, sigma, k, cellScale, nullptr, firstOptions, &stages);
+					gradient = std::move(stages.gradient);
+					markers = std::move(stages.markers);
+					changedCount = voronoi.cellCount();
+				}
+				else
+				{
+					MEASURE_ADD_CUMULATOR(updating);
+					LibTIM::Image<LibTIM::U8> frameGradient;
+					const auto regularized = regularizedGradient(prefiltered, voronoi, sigma, k, &frameGradient, options);
+
+					const auto cellCount = static_cast<int64_t>(voronoi.cellCount());
+					std::vector<uint8_t> changed(cellCount, 0);
+					changedCount = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : changedCount)
+					for (int64_t ci = 0; ci < cellCount; ++ci)
+						for (const auto offset : voronoi.cell(ci))
+							if (std::abs(frameGradient(offset) - gradient(offset)) > changeThreshold)
+							{
+								changed[ci] = 1;
+								changedCount++;
+								break;
+							}
+					gradient = std::move(frameGradient);
+
+					if (changedCount)
+					{
+						updateWatershedMarkers(gradient, voronoi, cellScale, changed, markers, options);
+
+						// Flood again the changed cells and the waterpixels of their previous markers
+						const auto& cellMap = voronoi.cellMap();
+#pragma omp parallel for
+						for (int64_t i = 0; i < static_cast<int64_t>(cellMap.size()); ++i)
+							if (changed[cellMap[i]] || (labels(i) && changed[labels(i) - 1]))
+								labels(i) = markers(i);
+						watershedMeyerFloodUnlabeled(regularized, labels);
+					}
+				}
+
+				MEASURE_ADD_CUMULATOR(delimiting);
+				writer.save(labelBoundaries(labels),
+				            (std::filesystem::path(outputDirectory) / (frame->name + ".pgm")).string());
+
+				latencies.emplace_back(
+					std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+				std::cout << "Frame " << frame->name << " : " << latencies.back() << "ms, " << changedCount << "/" <<
+					voronoi.cellCount() << " cells changed" << std::endl;
+			}
+		}
+		catch (...)
+		{
+			loaded.close();
+			loader.join();
+			throw;
+		}
+		loader.join();
+
+		if (latencies.empty())
+			return;
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto sorted = latencies;
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for (const auto latency : latencies)
+			total += latency;
+		std::cout << "Sequence : " << latencies.size() << " frames in " << seconds << "s, " << latencies.size() /
+			seconds << " frames/s, latency " << total / latencies.size() << "ms average, " << sorted[sorted.size() / 2]
+			<< "ms median, " << sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)] << "ms p95" << std::endl;
+	}
+}
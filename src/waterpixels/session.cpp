@@ -0,0 +1,172 @@
+#include "waterpixels/session.hpp"
+
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+
+#include "waterpixels/writer.hpp"
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Common/FlatSE.h>
+
+namespace WP
+{
+	namespace
+	{
+		// Stages reading the output of each stage, in the order of the Stage bits (a stage only feeds later ones)
+		constexpr std::pair<Session::Stage, uint32_t> STAGE_DEPENDENTS[] = {
+			{Session::Prefiltered, Session::Gradient},
+			{Session::Gradient, Session::Regularized | Session::Markers},
+			{Session::Voronoi, Session::Regularized | Session::Markers},
+			{Session::Regularized, Session::Labels},
+			{Session::Markers, Session::Labels},
+			{Session::Labels, 0},
+		};
+	}
+
+	Session::Session(const LibTIM::Image<LibTIM::RGB>& image, float _sigma, float _k, float _cellScale,
+	                 int _blurRadius, const WaterpixelOptions& _options) : sigma(_sigma), k(_k), cellScale(_cellScale),
+	                                                                      blurRadius(_blurRadius), options(_options)
+	{
+		MEASURE_DURATION(intensityDuration, "Session : image intensity");
+		intensity = rgbImageIntensity(image);
+	}
+
+	void Session::setSigma(float _sigma)
+	{
+		if (_sigma != sigma)
+			invalidate(Voronoi);
+		sigma = _sigma;
+	}
+
+	void Session::setK(float _k)
+	{
+		if (_k != k)
+			invalidate(Regularized);
+		k = _k;
+	}
+
+	void Session::setCellScale(float _cellScale)
+	{
+		if (_cellScale != cellScale)
+			invalidate(Markers);
+		cellScale = _cellScale;
+	}
+
+	void Session::setBlurRadius(int _blurRadius)
+	{
+		if (_blurRadius != blurRadius)
+			invalidate(Prefiltered);
+		blurRadius = _blurRadius;
+	}
+
+	void Session::setOptions(const WaterpixelOptions& _options)
+	{
+		if (_options.distance != options.distance)
+			invalidate(Regularized);
+		if (_options.flooding != options.flooding)
+			invalidate(Labels);
+		if (_options.markerSelection != options.markerSelection || _options.markerEpsilon != options.markerEpsilon)
+			invalidate(Markers);
+		options = _options;
+	}
+
+	void Session::invalidate(uint32_t stages)
+	{
+		for (const auto& [stage, dependents] : STAGE_DEPENDENTS)
+			if (stages & stage)
+				stages |= dependents;
+		valid &= ~stages;
+	}
+
+	const LibTIM::Image<LibTIM::TLabel>& Session::labels()
+	{
+		// The compact flooding regularizes the gradient itself, the regularized image stays out of date
+		const bool compact = options.flooding == FloodingEngine::Compact;
+		recomputed = ~valid & (Prefiltered | Gradient | Voronoi | Regularized | Markers | Labels);
+		if (compact)
+			recomputed &= ~Regularized;
+
+		LibTIM::FlatSE connectivity;
+		connectivity.make2DN4();
+		if (!(valid & Prefiltered))
+		{
+			MEASURE_DURATION(prefiltering, "Session : image pre-filtering");
+			LibTIM::FlatSE filter;
+			filter.make2DEuclidianBall(blurRadius);
+			prefiltered = blurRadius >= 1 ? closingNoBorder(openingNoBorder(intensity, filter), filter) : intensity;
+		}
+		if (!(valid & Gradient))
+		{
+			MEASURE_DURATION(gradientDuration, "Session : image gradient");
+			gradient = morphologicalGradient(prefiltered, connectivity);
+		}
+		if (!(valid & Voronoi))
+		{
+			MEASURE_DURATION(voronoiCells, "Session : voronoi cells");
+			const auto width = intensity.getSizeX();
+			const auto height = intensity.getSizeY();
+			voronoi = VoronoiGraph(width, height, makeRectGrid2D(width, height, sigma));
+		}
+		if (recomputed & Regularized)
+		{
+			MEASURE_DURATION(regularization, "Session : spatial regularization");
+			regularized = spatialRegularization(gradient, voronoi, sigma, k, options);
+		}
+		if (!(valid & Markers))
+		{
+			MEASURE_DURATION(watMark, "Session : watershed markers");
+			markers = makeWatershedMarkers(gradient, voronoi, sigma, cellScale, options);
+		}
+		if (!(valid & Labels))
+		{
+			// The flooding overwrites its markers, the next runs need the original ones
+			labelImage = markers;
+			if (compact)
+				floodCompactWatershed(gradient, voronoi, sigma, k, labelImage, options);
+			else
+				floodWatershed(regularized, labelImage, sigma, options.flooding);
+		}
+		valid |= recomputed;
+		return labelImage;
+	}
+
+	LibTIM::Image<LibTIM::U8> Session::delimitation()
+	{
+		return labelBoundaries(labels());
+	}
+
+	void waterpixelSweep(const std::string& input, const std::string& outputDirectory, const std::vector<float>& sigmas,
+	                     const std::vector<float>& ks, const std::vector<float>& cellScales, int blurRadius,
+	                     const WaterpixelOptions& options)
+	{
+		if (sigmas.empty() || ks.empty() || cellScales.empty())
+			return;
+		LibTIM::Image<LibTIM::RGB> image;
+		{
+			MEASURE_DURATION(loading, "Load image");
+			if (!LibTIM::Image<LibTIM::RGB>::load(input.c_str(), image))
+				throw std::runtime_error("failed to load '" + input + "'");
+		}
+		std::filesystem::create_directories(outputDirectory);
+		const auto name = std::filesystem::path(input).stem().string();
+
+		MEASURE_DURATION(sweep, "Waterpixel parameter sweep");
+		Session session(image, sigmas.front(), ks.front(), cellScales.front(), blurRadius, options);
+		image = LibTIM::Image<LibTIM::RGB>();
+
+		// Outputs are saved while the next combination is computed
+		AsyncWriter writer;
+		for (const auto sigma : sigmas)
+			for (const auto cellScale : cellScales)
+				for (const auto k : ks)
+				{
+					session.setSigma(sigma);
+					session.setCellScale(cellScale);
+					session.setK(k);
+					std::stringstream file;
+					file << name << "_s" << sigma << "_k" << k << "_c" << cellScale << ".pgm";
+					writer.save(session.delimitation(), (std::filesystem::path(outputDirectory) / file.str()).string());
+				}
+	}
+}
@@ -0,0 +1,244 @@
+#include "waterpixels/streaming.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "waterpixels/utils.hpp"
+#include "waterpixels/waterpixels.hpp"
+#include "waterpixels/watershed.hpp"
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Common/FlatSE.h>
+#include <libtim/Common/ImageMapping.h>
+
+namespace WP
+{
+	namespace
+	{
+		// Rows [y0, y1[ of image
+		template <typename T>
+		LibTIM::Image<T> cropRows(const LibTIM::Image<T>& image, int y0, int y1)
+		{
+			LibTIM::Image<T> rows(image.getSizeX(), y1 - y0);
+			std::copy(&image(0, y0), &image(0, y0) + static_cast<int64_t>(image.getSizeX()) * (y1 - y0),
+			          rows.getData());
+			return rows;
+		}
+
+		// The last topRows rows of top followed by the first bottomRows rows of bottom
+		template <typename T>
+		LibTIM::Image<T> stackRows(const LibTIM::Image<T>& top, int topRows, const LibTIM::Image<T>& bottom,
+		                           int bottomRows)
+		{
+			const int64_t width = top.getSizeX();
+			LibTIM::Image<T> rows(top.getSizeX(), topRows + bottomRows);
+			const T* topBegin = &top(0, top.getSizeY() - topRows);
+			std::copy(topBegin, topBegin + width * topRows, rows.getData());
+			std::copy(&bottom(0), &bottom(0) + width * bottomRows, rows.getData() + width * topRows);
+			return rows;
+		}
+
+		// Inverse of stackRows : write back rows [y0, y1[ of the stacked image
+		template <typename T>
+		void unstackRows(const LibTIM::Image<T>& rows, int y0, int y1, LibTIM::Image<T>& top, int topRows,
+		                 LibTIM::Image<T>& bottom)
+		{
+			for (int y = y0; y < y1; ++y)
+			{
+				T* destination = y < topRows ? &top(0, top.getSizeY() - topRows + y) : &bottom(0, y - topRows);
+				std::copy(&rows(0, y), &rows(0, y) + rows.getSizeX(), destination);
+			}
+		}
+
+		// One row of tiles of the watershed
+		struct Band
+		{
+			int y0 = 0;
+			int y1 = 0;
+			LibTIM::Image<LibTIM::U8> priority;
+			LibTIM::Image<LibTIM::TLabel> sources;
+			LibTIM::Image<LibTIM::TLabel> labels;
+			bool hasSources = false;
+		};
+
+		// Bands without sources are left unlabeled by watershedMeyerTiled until its last step floods them from the
+		// bands around. run holds the band above them (if any) followed by them, next is the band below them (if any).
+		void floodEmptyBands(std::vector<Band>& run, const Band* next)
+		{
+			const int width = run.front().labels.getSizeX();
+			const auto empty = run.begin() + (run.front().hasSources ? 1 : 0);
+			int rowCount = (empty != run.begin() ? 1 : 0) + (next ? 1 : 0);
+			for (auto band = empty; band != run.end(); ++band)
+				rowCount += band->y1 - band->y0;
+
+			LibTIM::Image<LibTIM::U8> priority(width, rowCount);
+			LibTIM::Image<LibTIM::TLabel> labels(width, rowCount);
+			int y = 0;
+			const auto append = [&](const Band& band, int y0, int y1)
+			{
+				const int64_t size = static_cast<int64_t>(width) * (y1 - y0);
+				std::copy(&band.priority(0, y0), &band.priority(0, y0) + size, &priority(0, y));
+				std::copy(&band.labels(0, y0), &band.labels(0, y0) + size, &labels(0, y));
+				y += y1 - y0;
+			};
+			if (empty != run.begin())
+				append(run.front(), run.front().y1 - run.front().y0 - 1, run.front().y1 - run.front().y0);
+			for (auto band = empty; band != run.end(); ++band)
+				append(*band, 0, band->y1 - band->y0);
+			if (next)
+				append(*next, 0, 1);
+
+			watershedMeyerFloodUnlabeled(priority, labels);
+
+			y = empty != run.begin() ? 1 : 0;
+			for (auto band = empty; band != run.end(); ++band)
+			{
+				std::copy(&labels(0, y), &labels(0, y) + band->labels.getBufSize(), band->labels.getData());
+				y += band->y1 - band->y0;
+			}
+		}
+	}
+
+	void waterpixelStream(const std::string& input, const std::string& output, float sigma, float k, float cellScale,
+	                      int blurRadius, const WaterpixelOptions& options)
+	{
+		MEASURE_DURATION(streaming, "Waterpixel algorithm (streamed by bands)");
+		const LibTIM::MappedImage<LibTIM::RGB> image(input.c_str());
+		const int width = image.getSizeX();
+		const int height = image.getSizeY();
+		const auto centers = makeRectGrid2D(width, height, sigma);
+
+		// Bands are the rows of tiles of watershedMeyerTiled (the last one absorbs the remainder)
+		const int tileSize = watershedTileSize(sigma);
+		const int seamMargin = watershedSeamMargin(sigma);
+		const int marginY = std::min(seamMargin, tileSize / 2 - 1);
+		std::vector<int> bandRows = {0};
+		for (int y = tileSize; y + tileSize <= height; y += tileSize)
+			bandRows.emplace_back(y);
+		bandRows.emplace_back(height);
+		const int bandCount = static_cast<int>(bandRows.size()) - 1;
+
+		// Rows of context : the cells crossing a band (and the centers they can be closest to), then the prefilter
+		LibTIM::FlatSE filter;
+		filter.make2DEuclidianBall(blurRadius);
+		int filterReach = 0;
+		for (unsigned long i = 0; blurRadius >= 1 && i < filter.getNbPoints(); i++)
+			filterReach = std::max(filterReach, 4 * std::abs(static_cast<int>(filter.getPoint(i).y)));
+		const int cellReach = 2 * static_cast<int>(std::ceil(sigma)) + 2;
+
+		MEASURE_CUMULATIVE_DURATION(prefiltering, "Band pre-filtering");
+		MEASURE_CUMULATIVE_DURATION(gradientAndMarkers, "Band regularized gradient and watershed markers");
+		MEASURE_CUMULATIVE_DURATION(flooding, "Band tiled watershed-meyer");
+
+		const auto computeBand = [&](int band)
+		{
+			Band result;
+			result.y0 = bandRows[band];
+			result.y1 = bandRows[band + 1];
+			const int windowBegin = std::max(0, result.y0 - cellReach);
+			const int windowEnd = std::min(height, result.y1 + cellReach);
+			const int readBegin = std::max(0, windowBegin - filterReach);
+			const int readEnd = std::min(height, windowEnd + filterReach);
+
+			LibTIM::Image<LibTIM::U8> window;
+			{
+				MEASURE_ADD_CUMULATOR(prefiltering);
+				auto intensity = rgbImageIntensity(&image(0, readBegin), width, readEnd - readBegin);
+				if (blurRadius >= 1)
+					intensity = closingNoBorder(openingNoBorder(std::move(intensity), filter), filter);
+				window = cropRows(intensity, windowBegin - readBegin, windowEnd - readBegin);
+			}
+
+			{
+				MEASURE_ADD_CUMULATOR(gradientAndMarkers);
+				// Centers around the window, in window coordinates. The global order is kept so that ties between
+				// centers resolve as in the whole image.
+				std::vector<glm::ivec2> windowCenters;
+				std::vector<LibTIM::TLabel> centerLabels;
+				for (size_t i = 0; i < centers.size(); ++i)
+					if (centers[i].y >= windowBegin - cellReach && centers[i].y < windowEnd + cellReach)
+					{
+						windowCenters.emplace_back(centers[i] - glm::ivec2(0, windowBegin));
+						centerLabels.emplace_back(static_cast<LibTIM::TLabel>(i + 1));
+					}
+				const VoronoiGraph voronoi(width, windowEnd - windowBegin, windowCenters);
+
+				LibTIM::Image<LibTIM::U8> gradient;
+				const auto regularized = regularizedGradient(window, voronoi, sigma, k, &gradient, options);
+				const auto markers = makeWatershedMarkers(gradient, voronoi, sigma, cellScale, options);
+
+				result.priority = cropRows(regularized, result.y0 - windowBegin, result.y1 - windowBegin);
+				result.sources = cropRows(markers, result.y0 - windowBegin, result.y1 - windowBegin);
+				for (int64_t i = 0; i < result.sources.getBufSize(); ++i)
+					if (result.sources(i))
+					{
+						result.sources(i) = centerLabels[result.sources(i) - 1];
+						result.hasSources = true;
+					}
+			}
+
+			{
+				MEASURE_ADD_CUMULATOR(flooding);
+				result.labels = result.sources;
+				watershedMeyerTiled(result.priority, result.labels, tileSize, result.y1 - result.y0, seamMargin);
+			}
+			return result;
+		};
+
+		// Delimitation of a band with final labels, the rows above and below are needed by the N4 comparisons
+		LibTIM::MappedImageWriter<LibTIM::U8> writer(output.c_str(), width, height);
+		LibTIM::Image<LibTIM::TLabel> rowAbove;
+		const auto writeBand = [&](const Band& band, const Band* below)
+		{
+			const int aboveRows = band.y0 > 0 ? 1 : 0;
+			auto rows = aboveRows ? stackRows(rowAbove, 1, band.labels, band.y1 - band.y0) : band.labels;
+			if (below)
+				rows = stackRows(rows, rows.getSizeY(), below->labels, 1);
+			const auto delimitation = labelBoundaries(rows);
+			writer.write(&delimitation(0, aboveRows), static_cast<LibTIM::TOffset>(band.y0) * width,
+			             static_cast<LibTIM::TOffset>(band.y1 - band.y0) * width);
+			rowAbove = cropRows(band.labels, band.y1 - band.y0 - 1, band.y1 - band.y0);
+		};
+
+		// Bands not written yet : the last band with sources, then the bands without any source below it, which are
+		// only final once the next band with sources is known
+		std::vector<Band> run;
+		const auto writeRun = [&](const Band* next)
+		{
+			if (run.size() > 1 || (!run.empty() && !run.front().hasSources))
+			{
+				MEASURE_ADD_CUMULATOR(flooding);
+				floodEmptyBands(run, next);
+			}
+			for (size_t i = 0; i < run.size(); ++i)
+				writeBand(run[i], i + 1 < run.size() ? &run[i + 1] : next);
+			run.clear();
+		};
+
+		for (int band = 0; band < bandCount; ++band)
+		{
+			std::cout << "Waterpixel band " << band + 1 << "/" << bandCount << " (rows " << bandRows[band] << " to " <<
+				bandRows[band + 1] << ")" << std::endl;
+			Band current = computeBand(band);
+			if (!run.empty() && marginY > 0)
+			{
+				// Horizontal seam between the two bands, as in watershedMeyerTiled
+				MEASURE_ADD_CUMULATOR(flooding);
+				Band& previous = run.back();
+				const int topRows = marginY + 1;
+				const int bottomRows = marginY + 1;
+				const auto priority = stackRows(previous.priority, topRows, current.priority, bottomRows);
+				const auto sources = stackRows(previous.sources, topRows, current.sources, bottomRows);
+				auto labels = stackRows(previous.labels, topRows, current.labels, bottomRows);
+				watershedMeyerRefloodRows(priority, sources, labels, 1, 1 + 2 * marginY);
+				unstackRows(labels, 1, 1 + 2 * marginY, previous.labels, topRows, current.labels);
+			}
+			if (current.hasSources)
+				writeRun(&current);
+			run.emplace_back(std::move(current));
+		}
+		writeRun(nullptr);
+	}
+}
@@ -0,0 +1,285 @@
+#include "waterpixels/superpixels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+
+#include "waterpixels/utils.hpp"
+
+namespace WP
+{
+	namespace
+	{
+		// Bump when the layout of a dump changes
+		constexpr uint64_t SUPERPIXELS_VERSION = 1;
+		constexpr char SUPERPIXELS_MAGIC[8] = {'W', 'P', 'S', 'U', 'P', 'E', 'R', 'P'};
+
+		struct SuperpixelFileHeader
+		{
+			char magic[8];
+			uint64_t version;
+			uint64_t width;
+			uint64_t height;
+			uint64_t superpixelCount;
+			uint64_t neighbourCount;
+		};
+
+		// Colours are summed in fixed point : the totals do not depend on the order the partial sums are merged in
+		constexpr double COLOUR_SCALE = 1 << 16;
+
+		struct SuperpixelSums
+		{
+			uint64_t area = 0;
+			uint64_t x = 0;
+			uint64_t y = 0;
+			uint32_t xMin = std::numeric_limits<uint32_t>::max();
+			uint32_t yMin = std::numeric_limits<uint32_t>::max();
+			uint32_t xMax = 0;
+			uint32_t yMax = 0;
+			int64_t l = 0;
+			int64_t a = 0;
+			int64_t b = 0;
+
+			void merge(const SuperpixelSums& other)
+			{
+				area += other.area;
+				x += other.x;
+				y += other.y;
+				xMin = std::min(xMin, other.xMin);
+				yMin = std::min(yMin, other.yMin);
+				xMax = std::max(xMax, other.xMax);
+				yMax = std::max(yMax, other.yMax);
+				l += other.l;
+				a += other.a;
+				b += other.b;
+			}
+		};
+
+		struct BoundarySums
+		{
+			uint32_t length = 0;
+			uint64_t gradient = 0;
+		};
+
+		// Boundaries keyed by lower superpixel << 32 | higher superpixel
+		using BoundaryMap = std::unordered_map<uint64_t, BoundarySums>;
+	}
+
+	SuperpixelGraph superpixelGraph(const LibTIM::Image<LibTIM::TLabel>& labels, size_t labelCount,
+	                                const LibTIM::Image<LibTIM::U8>& gradient, const PixelView* image)
+	{
+		MEASURE_DURATION(superpixels, "Compute superpixel statistics and adjacency graph");
+		const int64_t width = labels.getSizeX();
+		const int64_t height = labels.getSizeY();
+		const auto count = static_cast<LibTIM::TLabel>(labelCount);
+
+		std::vector<SuperpixelSums> sums(labelCount);
+		BoundaryMap boundaries;
+#pragma omp parallel
+		{
+			std::vector<SuperpixelSums> threadSums(labelCount);
+			BoundaryMap threadBoundaries;
+			// Consecutive pixel pairs of a row mostly lie on the same boundary
+			uint64_t lastKey = std::numeric_limits<uint64_t>::max();
+			BoundarySums* last = nullptr;
+			const auto addPair = [&](int64_t p, int64_t q)
+			{
+				auto first = labels(p);
+				auto second = labels(q);
+				if (first == second || !second || second > count)
+					return;
+				if (first > second)
+					std::swap(first, second);
+				const uint64_t key = static_cast<uint64_t>(first - 1) << 32 | (second - 1);
+				if (key != lastKey)
+				{
+					lastKey = key;
+					last = &threadBoundaries[key];
+				}
+				last->length++;
+				last->gradient += gradient(p) + gradient(q);
+			};
+
+			std::vector<LibTIM::RGB> row;
+#pragma omp for schedule(static)
+			for (int64_t y = 0; y < height; ++y)
+			{
+				const LibTIM::RGB* colours = image ? pixelRow(*image, y, row) : nullptr;
+				for (int64_t x = 0; x < width; ++x)
+				{
+					const auto p = x + y * width;
+					const auto label = labels(p);
+					if (!label || label > count)
+						continue;
+
+					auto& superpixel = threadSums[label - 1];
+					superpixel.area++;
+					superpixel.x += x;
+					superpixel.y += y;
+					superpixel.xMin = std::min(superpixel.xMin, static_cast<uint32_t>(x));
+					superpixel.yMin = std::min(superpixel.yMin, static_cast<uint32_t>(y));
+					superpixel.xMax = std::max(superpixel.xMax, static_cast<uint32_t>(x));
+					superpixel.yMax = std::max(superpixel.yMax, static_cast<uint32_t>(y));
+					if (colours)
+					{
+						const auto lab = rgbToCIELAB(colours[x]);
+						superpixel.l += static_cast<int64_t>(std::llround(lab.x * COLOUR_SCALE));
+						superpixel.a += static_cast<int64_t>(std::llround(lab.y * COLOUR_SCALE));
+						superpixel.b += static_cast<int64_t>(std::llround(lab.z * COLOUR_SCALE));
+					}
+
+					if (x + 1 < width)
+						addPair(p, p + 1);
+					if (y + 1 < height)
+						addPair(p, p + width);
+				}
+			}
+
+#pragma omp critical
+			{
+				for (size_t i = 0; i < labelCount; ++i)
+					sums[i].merge(threadSums[i]);
+				for (const auto& [key, boundary] : threadBoundaries)
+				{
+					auto& total = boundaries[key];
+					total.length += boundary.length;
+					total.gradient += boundary.gradient;
+				}
+			}
+		}
+
+		SuperpixelGraph graph;
+		graph.width = static_cast<uint32_t>(width);
+		graph.height = static_cast<uint32_t>(height);
+		graph.superpixels.resize(labelCount);
+		for (size_t i = 0; i < labelCount; ++i)
+		{
+			const auto& total = sums[i];
+			auto& superpixel = graph.superpixels[i];
+			if (!total.area)
+				continue;
+			const auto area = static_cast<double>(total.area);
+			superpixel.area = static_cast<uint32_t>(total.area);
+			superpixel.xMin = total.xMin;
+			superpixel.yMin = total.yMin;
+			superpixel.xMax = total.xMax;
+			superpixel.yMax = total.yMax;
+			superpixel.centroidX = static_cast<float>(total.x / area);
+			superpixel.centroidY = static_cast<float>(total.y / area);
+			superpixel.l = static_cast<float>(total.l / COLOUR_SCALE / area);
+			superpixel.a = static_cast<float>(total.a / COLOUR_SCALE / area);
+			superpixel.b = static_cast<float>(total.b / COLOUR_SCALE / area);
+		}
+
+		// Both sides of each boundary, in the order of the keys : the neighbours of a superpixel come out sorted
+		std::vector<std::pair<uint64_t, BoundarySums>> sorted(boundaries.begin(), boundaries.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+		graph.offsets.assign(labelCount + 1, 0);
+		for (const auto& [key, boundary] : sorted)
+		{
+			graph.offsets[(key >> 32) + 1]++;
+			graph.offsets[(key & 0xFFFFFFFF) + 1]++;
+		}
+		std::partial_sum(graph.offsets.begin(), graph.offsets.end(), graph.offsets.begin());
+		graph.neighbours.resize(graph.offsets.back());
+		graph.boundaryLengths.resize(graph.offsets.back());
+		graph.boundaryGradients.resize(graph.offsets.back());
+		auto next = graph.offsets;
+		for (const auto& [key, boundary] : sorted)
+		{
+			const auto first = static_cast<uint32_t>(key >> 32);
+			const auto second = static_cast<uint32_t>(key);
+			const auto meanGradient = static_cast<float>(boundary.gradient / (2. * boundary.length));
+			for (const auto& [from, to] : {std::make_pair(first, second), std::make_pair(second, first)})
+			{
+				const auto entry = next[from]++;
+				graph.neighbours[entry] = to;
+				graph.boundaryLengths[entry] = boundary.length;
+				graph.boundaryGradients[entry] = meanGradient;
+			}
+		}
+		return graph;
+	}
+
+	bool saveSuperpixelGraph(const SuperpixelGraph& graph, const std::string& path)
+	{
+		std::ofstream file(path, std::ios::binary);
+		SuperpixelFileHeader header{};
+		memcpy(header.magic, SUPERPIXELS_MAGIC, sizeof(SUPERPIXELS_MAGIC));
+		header.version = SUPERPIXELS_VERSION;
+		header.width = graph.width;
+		header.height = graph.height;
+		header.superpixelCount = graph.superpixels.size();
+		header.neighbourCount = graph.neighbours.size();
+		const auto write = [&](const auto& values)
+		{
+			file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(values[0]));
+		};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		write(graph.superpixels);
+		write(graph.offsets);
+		write(graph.neighbours);
+		write(graph.boundaryLengths);
+		write(graph.boundaryGradients);
+		if (!file)
+		{
+			std::cerr << "Failed to write superpixels '" << path << "'" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool loadSuperpixelGraph(const std::string& path, SuperpixelGraph& graph)
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return false;
+		const auto size = static_cast<uint64_t>(file.tellg());
+		file.seekg(0);
+		SuperpixelFileHeader header;
+		if (size < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+			memcmp(header.magic, SUPERPIXELS_MAGIC, sizeof(SUPERPIXELS_MAGIC)) != 0 ||
+			header.version != SUPERPIXELS_VERSION)
+			return false;
+		// Each entry takes at least 4 bytes : larger counts can't fit in the file, and would overflow the expected size
+		if (header.superpixelCount > size / sizeof(uint32_t) || header.neighbourCount > size / sizeof(uint32_t))
+			return false;
+		const uint64_t expected = sizeof(header) + header.superpixelCount * sizeof(Superpixel) +
+			(header.superpixelCount + 1) * sizeof(uint32_t) + header.neighbourCount * (2 * sizeof(uint32_t) +
+				sizeof(float));
+		if (size != expected)
+			return false;
+
+		graph.width = static_cast<uint32_t>(header.width);
+		graph.height = static_cast<uint32_t>(header.height);
+		graph.superpixels.resize(header.superpixelCount);
+		graph.offsets.resize(header.superpixelCount + 1);
+		graph.neighbours.resize(header.neighbourCount);
+		graph.boundaryLengths.resize(header.neighbourCount);
+		graph.boundaryGradients.resize(header.neighbourCount);
+		const auto read = [&](auto& values)
+		{
+			file.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(values[0]));
+		};
+		read(graph.superpixels);
+		read(graph.offsets);
+		read(graph.neighbours);
+		read(graph.boundaryLengths);
+		read(graph.boundaryGradients);
+		if (!file || graph.offsets.front() != 0 || graph.offsets.back() != header.neighbourCount)
+			return false;
+		// The consumers walk the CSR layout without checking it
+		for (uint64_t i = 0; i < header.superpixelCount; i++)
+			if (graph.offsets[i] > graph.offsets[i + 1])
+				return false;
+		for (const auto neighbour : graph.neighbours)
+			if (neighbour >= header.superpixelCount)
+				return false;
+		return true;
+	}
+}
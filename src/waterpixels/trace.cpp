@@ -0,0 +1,266 @@
+#include "waterpixels/trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace WP
+{
+	namespace
+	{
+		struct TraceEvent
+		{
+			const char* name;
+			uint64_t timestamp;
+			bool begin;
+		};
+
+		// Calls of one scope on one thread
+		struct ScopeTotals
+		{
+			uint64_t calls = 0;
+			uint64_t busy = 0;
+			uint64_t firstBegin = UINT64_MAX;
+			uint64_t lastEnd = 0;
+		};
+
+		// Events of one thread, only written by this thread : a ring buffer for the timeline, and the totals of each
+		// scope, which never wrap
+		class TraceBuffer
+		{
+		public:
+			TraceBuffer(uint32_t _thread) : events(new TraceEvent[TraceRecorder::bufferCapacity]), thread(_thread)
+			{
+			}
+
+			void push(const char* name, bool begin)
+			{
+				const auto timestamp = TraceRecorder::now();
+				const auto index = written.load(std::memory_order_relaxed);
+				events[index % TraceRecorder::bufferCapacity] = {name, timestamp, begin};
+				written.store(index + 1, std::memory_order_release);
+
+				if (begin)
+					open.emplace_back(name, timestamp);
+				else if (!open.empty() && open.back().first == name)
+				{
+					auto& scope = totals[name];
+					scope.calls++;
+					scope.busy += timestamp - open.back().second;
+					scope.firstBegin = std::min(scope.firstBegin, open.back().second);
+					scope.lastEnd = timestamp;
+					open.pop_back();
+				}
+			}
+
+			[[nodiscard]] const std::unordered_map<const char*, ScopeTotals>& scopes() const { return totals; }
+
+			// Events overwritten in the ring buffer
+			[[nodiscard]] uint64_t dropped() const
+			{
+				const auto end = written.load(std::memory_order_acquire);
+				return end > TraceRecorder::bufferCapacity ? end - TraceRecorder::bufferCapacity : 0;
+			}
+
+			// Events still held, oldest first
+			[[nodiscard]] std::vector<TraceEvent> snapshot() const
+			{
+				const auto end = written.load(std::memory_order_acquire);
+				const auto begin = end > TraceRecorder::bufferCapacity ? end - TraceRecorder::bufferCapacity : 0;
+				std::vector<TraceEvent> result;
+				result.reserve(end - begin);
+				for (auto i = begin; i < end; ++i)
+					result.emplace_back(events[i % TraceRecorder::bufferCapacity]);
+				return result;
+			}
+
+			[[nodiscard]] uint32_t getThread() const { return thread; }
+
+		private:
+			std::unique_ptr<TraceEvent[]> events;
+			std::atomic<uint64_t> written = 0;
+			// Scopes begun and not ended yet, innermost last
+			std::vector<std::pair<const char*, uint64_t>> open;
+			std::unordered_map<const char*, ScopeTotals> totals;
+			const uint32_t thread;
+		};
+
+		// Buffers of every thread that recorded an event. They are kept until the end of the program, so that the
+		// events of finished threads still appear in the trace.
+		struct TraceRegistry
+		{
+			std::mutex mutex;
+			std::vector<std::unique_ptr<TraceBuffer>> buffers;
+		};
+
+		TraceRegistry& registry()
+		{
+			static TraceRegistry instance;
+			return instance;
+		}
+
+		// Registration on the first event of the thread is the only locked operation
+		TraceBuffer& threadBuffer()
+		{
+			thread_local TraceBuffer* buffer = nullptr;
+			if (!buffer)
+			{
+				auto& threads = registry();
+				std::lock_guard lock(threads.mutex);
+				threads.buffers.emplace_back(std::make_unique<TraceBuffer>(static_cast<uint32_t>(threads.buffers.size())));
+				buffer = threads.buffers.back().get();
+			}
+			return *buffer;
+		}
+
+		struct TraceSpan
+		{
+			const char* name;
+			uint32_t thread;
+			uint64_t begin;
+			uint64_t end;
+		};
+
+		// Matching begin / end pairs of every thread still in the ring buffers (the timeline only)
+		std::vector<TraceSpan> collectSpans()
+		{
+			std::vector<TraceSpan> spans;
+			auto& threads = registry();
+			std::lock_guard lock(threads.mutex);
+			for (const auto& buffer : threads.buffers)
+			{
+				std::vector<TraceSpan> open;
+				for (const auto& event : buffer->snapshot())
+				{
+					if (event.begin)
+						open.push_back({event.name, buffer->getThread(), event.timestamp, 0});
+					else if (!open.empty() && open.back().name == event.name)
+					{
+						spans.push_back(open.back());
+						spans.back().end = event.timestamp;
+						open.pop_back();
+					}
+				}
+			}
+			return spans;
+		}
+
+		std::string escapeJson(const std::string& text)
+		{
+			std::string result;
+			for (const char c : text)
+			{
+				if (c == '"' || c == '\\')
+					result += '\\';
+				result += c;
+			}
+			return result;
+		}
+	}
+
+	void TraceRecorder::begin(const char* name)
+	{
+		threadBuffer().push(name, true);
+	}
+
+	void TraceRecorder::end(const char* name)
+	{
+		threadBuffer().push(name, false);
+	}
+
+	uint64_t TraceRecorder::now()
+	{
+		static const auto epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	uint64_t TraceRecorder::droppedEvents()
+	{
+		auto& threads = registry();
+		std::lock_guard lock(threads.mutex);
+		uint64_t dropped = 0;
+		for (const auto& buffer : threads.buffers)
+			dropped += buffer->dropped();
+		return dropped;
+	}
+
+	void TraceRecorder::printSummary(std::ostream& stream)
+	{
+		struct Summary
+		{
+			uint64_t firstBegin = UINT64_MAX;
+			uint64_t lastEnd = 0;
+			uint64_t busy = 0;
+			uint64_t calls = 0;
+			std::set<uint32_t> threads;
+		};
+		// Scopes are merged by name : the same literal may have several addresses
+		std::map<std::string, Summary> summaries;
+		{
+			auto& threads = registry();
+			std::lock_guard lock(threads.mutex);
+			for (const auto& buffer : threads.buffers)
+				for (const auto& [name, scope] : buffer->scopes())
+				{
+					auto& summary = summaries[name];
+					summary.firstBegin = std::min(summary.firstBegin, scope.firstBegin);
+					summary.lastEnd = std::max(summary.lastEnd, scope.lastEnd);
+					summary.busy += scope.busy;
+					summary.calls += scope.calls;
+					summary.threads.insert(buffer->getThread());
+				}
+		}
+
+		std::vector<std::pair<std::string, Summary>> ordered(summaries.begin(), summaries.end());
+		std::sort(ordered.begin(), ordered.end(),
+		          [](const auto& a, const auto& b) { return a.second.firstBegin < b.second.firstBegin; });
+		stream << "Trace summary :" << std::endl;
+		for (const auto& [name, summary] : ordered)
+		{
+			const double wall = static_cast<double>(summary.lastEnd - summary.firstBegin);
+			stream << " " << name << " : " << summary.calls << " calls, " << summary.busy / 1e6 << "ms busy, " << wall /
+				1e6 << "ms wall, " << summary.threads.size() << " threads, " << (wall > 0
+					? 100 * summary.busy / (wall * summary.threads.size())
+					: 100) << "% utilisation" << std::endl;
+		}
+		if (const auto dropped = droppedEvents())
+			stream << " (" << dropped << " events dropped from the timeline of the trace file)" << std::endl;
+	}
+
+	bool TraceRecorder::writeChromeTrace(const std::string& path)
+	{
+		std::ofstream file(path, std::ios_base::trunc);
+		if (!file)
+			return false;
+
+		const auto spans = collectSpans();
+		std::set<uint32_t> threads;
+		file << std::fixed << std::setprecision(3);
+		file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+		bool first = true;
+		for (const auto& span : spans)
+		{
+			file << (first ? "" : ",") << "\n{\"name\": \"" << escapeJson(span.name) <<
+				"\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << span.thread << ", \"ts\": " << span.begin / 1000.0 <<
+				", \"dur\": " << (span.end - span.begin) / 1000.0 << "}";
+			first = false;
+			threads.insert(span.thread);
+		}
+		for (const auto thread : threads)
+		{
+			file << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << thread
+				<< ", \"args\": {\"name\": \"thread " << thread << "\"}}";
+			first = false;
+		}
+		file << "\n], \"otherData\": {\"droppedEvents\": " << droppedEvents() << "}}\n";
+		return static_cast<bool>(file);
+	}
+}
@@ -5,8 +5,19 @@
 #include <corecrt_math_defines.h>
 #endif
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #include <vector>
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <glm/glm.hpp>
 #include <libtim/Common/Types.h>
 
@@ -54,27 +65,130 @@ namespace WP
 		return points;
 	}
 
-	glm::vec3 rgbToCIELAB(const LibTIM::RGB& pixelRGB)
+	namespace
 	{
-		const glm::vec3 normalizedRGB(static_cast<float>(pixelRGB[0]), static_cast<float>(pixelRGB[1]),
-		                              static_cast<float>(pixelRGB[2]));
+		// CIELAB lightness from the Y component of a pixel and of the white point
+		float cielabLightness(float y, float yn)
+		{
+			if (y / yn > 0.008856)
+				return 116.f * std::pow(y / yn, 1.f / 3.f) - 16;
+			return 903.3f * y / yn;
+		}
 
 		const glm::mat3 rgbToXYZ(
 			0.618f, 0.299f, 0.0f, // First column
 			0.177f, 0.587f, 0.056f,
 			0.205f, 0.114f, 0.944f);
 
+		// Y = 0.299 R + 0.587 G + 0.114 B, scaled by 1000 to stay integer
+		constexpr int lightnessWeightR = 299;
+		constexpr int lightnessWeightG = 587;
+		constexpr int lightnessWeightB = 114;
+		constexpr int lightnessTableSize = 255 * 1000 + 1;
+		// Set when the lightness of an entry can round to two different values depending on float rounding of Y
+		constexpr uint16_t lightnessAmbiguous = 0x100;
+
+		/*
+		* Scaled lightness (L / 100 * 255) for each integer value of 1000 * Y.
+		* The float Y computed by rgbToCIELAB never deviates from the integer one by more than ~1e-4, so an entry is
+		* exact unless a rounding step of the lightness falls within half a unit of it. Those entries are flagged and
+		* computed with the float path.
+		*/
+		const std::vector<uint16_t>& lightnessTable()
+		{
+			static const std::vector<uint16_t> table = []
+			{
+				const float yn = (rgbToXYZ * glm::vec3(255.f)).y;
+				const auto scaledLightness = [&](float y)
+				{
+					return static_cast<LibTIM::U8>(cielabLightness(y, yn) / 100.f * 255.f);
+				};
+				// One more entry so that 32 bits gathers never read out of the table
+				std::vector<uint16_t> values(lightnessTableSize + 1, 0);
+				for (int i = 0; i < lightnessTableSize; ++i)
+				{
+					const auto low = scaledLightness((i - 0.5f) / 1000.f);
+					const auto high = scaledLightness((i + 0.5f) / 1000.f);
+					values[i] = low == high ? low : lightnessAmbiguous;
+				}
+				return values;
+			}();
+			return table;
+		}
+
+		LibTIM::U8 lookupLightness(const uint16_t* table, const LibTIM::RGB& pixel)
+		{
+			const auto entry = table[lightnessWeightR * pixel[0] + lightnessWeightG * pixel[1] + lightnessWeightB * pixel[2]];
+			if (entry & lightnessAmbiguous)
+				return static_cast<LibTIM::U8>(rgbToCIELAB(pixel).r / 100.f * 255.f);
+			return static_cast<LibTIM::U8>(entry);
+		}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define WP_LIGHTNESS_AVX2 1
+		// 8 pixels per iteration : deinterleave with byte shuffles, 1000 * Y with integer products, then gather the table
+		__attribute__((target("avx2"))) size_t rgbRowToLightnessAVX2(const uint16_t* table,
+		                                                              const LibTIM::RGB* pixels,
+		                                                              LibTIM::U8* lightness, size_t count)
+		{
+			const auto* bytes = reinterpret_cast<const uint8_t*>(pixels);
+			// Lane 0 gets bytes 0..15, lane 1 bytes 12..27 : pixels 0-3 and 4-7 both start at the lane start
+			const __m256i splitLanes = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+			const __m256i channelR = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+			                                          0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+			const __m256i channelG = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+			                                          1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+			const __m256i channelB = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+			                                          2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+			const __m256i packBytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			                                           0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+			const __m256i weightR = _mm256_set1_epi32(lightnessWeightR);
+			const __m256i weightG = _mm256_set1_epi32(lightnessWeightG);
+			const __m256i weightB = _mm256_set1_epi32(lightnessWeightB);
+			const __m256i entryMask = _mm256_set1_epi32(0xFFFF);
+			const __m256i ambiguousMask = _mm256_set1_epi32(lightnessAmbiguous);
+
+			size_t i = 0;
+			// A 32 bytes load covers 8 pixels (24 bytes) and must stay inside the row
+			for (; i + 11 <= count; i += 8)
+			{
+				const __m256i raw = _mm256_permutevar8x32_epi32(
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i * 3)), splitLanes);
+				const __m256i index = _mm256_add_epi32(
+					_mm256_add_epi32(_mm256_mullo_epi32(_mm256_shuffle_epi8(raw, channelR), weightR),
+					                 _mm256_mullo_epi32(_mm256_shuffle_epi8(raw, channelG), weightG)),
+					_mm256_mullo_epi32(_mm256_shuffle_epi8(raw, channelB), weightB));
+				const __m256i entries = _mm256_and_si256(
+					_mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 2), entryMask);
+
+				if (!_mm256_testz_si256(entries, ambiguousMask))
+				{
+					for (size_t j = i; j < i + 8; ++j)
+						lightness[j] = lookupLightness(table, pixels[j]);
+					continue;
+				}
+
+				const __m256i packed = _mm256_shuffle_epi8(entries, packBytes);
+				const int low = _mm_cvtsi128_si32(_mm256_castsi256_si128(packed));
+				const int high = _mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1));
+				std::memcpy(lightness + i, &low, 4);
+				std::memcpy(lightness + i + 4, &high, 4);
+			}
+			return i;
+		}
+#endif
+	}
+
+	glm::vec3 rgbToCIELAB(const LibTIM::RGB& pixelRGB)
+	{
+		const glm::vec3 normalizedRGB(static_cast<float>(pixelRGB[0]), static_cast<float>(pixelRGB[1]),
+		                              static_cast<float>(pixelRGB[2]));
 
 		const glm::vec3 pixelXYZ = rgbToXYZ * normalizedRGB;
 
 		const glm::vec3 XYZn = rgbToXYZ * glm::vec3(255.f);
 
-		float L;
-
-		if (pixelXYZ.y / XYZn.y > 0.008856)
-			L = 116.f * std::pow(pixelXYZ.y / XYZn.y, 1.f / 3.f) - 16;
-		else
-			L = 903.3f * pixelXYZ.y / XYZn.y;
+		const float L = cielabLightness(pixelXYZ.y, XYZn.y);
 
 		auto f = [](float t)
 		{
@@ -90,181 +204,390 @@ namespace WP
 		return {L, a, b};
 	}
 
+	LibTIM::U8 rgbToLightness(const LibTIM::RGB& pixelRGB)
+	{
+		return lookupLightness(lightnessTable().data(), pixelRGB);
+	}
+
+	void rgbRowToLightness(const LibTIM::RGB* pixels, LibTIM::U8* lightness, size_t count)
+	{
+		const uint16_t* table = lightnessTable().data();
+		size_t i = 0;
+#if WP_LIGHTNESS_AVX2
+		static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+		if (hasAVX2)
+			i = rgbRowToLightnessAVX2(table, pixels, lightness, count);
+#endif
+		for (; i < count; ++i)
+			lightness[i] = lookupLightness(table, pixels[i]);
+	}
+
 	LibTIM::Image<LibTIM::U8> sobelFilter(LibTIM::Image<LibTIM::U8> image)
 	{
 		int dx = image.getSizeX();
 		int dy = image.getSizeY();
 
-		LibTIM::Image<LibTIM::U8> imgSobelX{static_cast<LibTIM::TSize>(dx), static_cast<LibTIM::TSize>(dy)};
-		LibTIM::Image<LibTIM::U8> imgSobelY{static_cast<LibTIM::TSize>(dx), static_cast<LibTIM::TSize>(dy)};
 		LibTIM::Image<LibTIM::U8> resImg{static_cast<LibTIM::TSize>(dx), static_cast<LibTIM::TSize>(dy)};
 
 		float kernelX[3][3] = {{-1 - 2, -1}, {0, 0, 0}, {1, 2, 1}};
 		float kernelY[3][3] = {{1, 0, -1}, {2, 0, -2}, {1, 0, -1}};
-#pragma omp parallel for collapse(2)
-		for (int y = 0; y < dy; y++)
+		LibTIM::forEachTile(LibTIM::TileGrid(dx, dy), [&](const LibTIM::TileRange& tile)
 		{
-			for (int x = 0; x < dx; x++)
-			{
-				const int startY = y - 1;
-				const int startX = x - 1;
-				const int endY = y + 1;
-				const int endX = x + 1;
-
-				float resX = 0.0f;
-				float resY = 0.0f;
-				for (int i = startY; i <= endY; i++)
+			for (int y = tile.y0; y < tile.y1; y++)
+				for (int x = tile.x0; x < tile.x1; x++)
 				{
-					if (i < 0 || i >= dy)
-						continue;
-					for (int j = startX; j <= endX; j++)
+					const int startY = y - 1;
+					const int startX = x - 1;
+					const int endY = y + 1;
+					const int endX = x + 1;
+
+					float resX = 0.0f;
+					float resY = 0.0f;
+					for (int i = startY; i <= endY; i++)
 					{
-						if (j < 0 || j >= dx)
+						if (i < 0 || i >= dy)
 							continue;
-						float p = image(j, i);
-						resX += kernelX[j - startX][i - startY] * p;
-						resY += kernelY[j - startX][i - startY] * p;
+						for (int j = startX; j <= endX; j++)
+						{
+							if (j < 0 || j >= dx)
+								continue;
+							float p = image.row(i)[j];
+							resX += kernelX[j - startX][i - startY] * p;
+							resY += kernelY[j - startX][i - startY] * p;
+						}
 					}
+					resImg.row(y)[x] = static_cast<LibTIM::U8>(std::sqrt(resX * resX + resY * resY));
 				}
-				imgSobelX(x, y) = static_cast<LibTIM::U8>(resX);
-				imgSobelY(x, y) = static_cast<LibTIM::U8>(resY);
-
-				resImg(x, y) = static_cast<LibTIM::U8>(std::sqrt(resX * resX + resY * resY));
-			}
-		}
+		});
 		return resImg;
 	}
 
 	LibTIM::Image<LibTIM::U8> labelToImage(const LibTIM::Image<LibTIM::TLabel>& image)
 	{
-		LibTIM::Image<LibTIM::TLabel> binaryImage(image.getSizeX(), image.getSizeY());
-#pragma omp parallel for collapse(2)
-		for (int x = 0; x < binaryImage.getSizeX(); x++)
-			for (int y = 0; y < binaryImage.getSizeY(); y++)
-				binaryImage(x, y) = image(x, y);
-		return binaryImage;
+		LibTIM::Image<LibTIM::U8> result(image.getSizeX(), image.getSizeY());
+#pragma omp parallel for
+		for (int64_t i = 0; i < image.getBufSize(); i++)
+			result(i) = static_cast<LibTIM::U8>(image(i));
+		return result;
 	}
 
 	LibTIM::Image<LibTIM::U8> labelToBinaryImage(const LibTIM::Image<LibTIM::TLabel>& image)
 	{
-		LibTIM::Image<LibTIM::TLabel> binaryImage(image.getSizeX(), image.getSizeY());
-#pragma omp parallel for collapse(2)
-		for (int x = 0; x < binaryImage.getSizeX(); x++)
-			for (int y = 0; y < binaryImage.getSizeY(); y++)
-				binaryImage(x, y) = image(x, y) ? 255 : 0;
+		LibTIM::Image<LibTIM::U8> binaryImage(image.getSizeX(), image.getSizeY());
+#pragma omp parallel for
+		for (int64_t i = 0; i < image.getBufSize(); i++)
+			binaryImage(i) = image(i) ? 255 : 0;
 		return binaryImage;
 	}
 
 	LibTIM::Image<LibTIM::TLabel> imageToBinaryLabel(const LibTIM::Image<LibTIM::U8>& image)
 	{
-		LibTIM::Image<LibTIM::U8> binaryLabels(image.getSizeX(), image.getSizeY());
-#pragma omp parallel for collapse(2)
-		for (int x = 0; x < image.getSizeX(); x++)
-			for (int y = 0; y < image.getSizeY(); y++)
-				binaryLabels(x, y) = image(x, y) ? 1 : 0;
+		LibTIM::Image<LibTIM::TLabel> binaryLabels(image.getSizeX(), image.getSizeY());
+#pragma omp parallel for
+		for (int64_t i = 0; i < image.getBufSize(); i++)
+			binaryLabels(i) = image(i) ? 1 : 0;
 		return binaryLabels;
 	}
 
-	VoronoiGraph::VoronoiGraph() : width(0), height(0)
+	LibTIM::Image<LibTIM::U8> labelBoundaries(const LibTIM::Image<LibTIM::TLabel>& labels)
 	{
-	}
-
-	VoronoiGraph::VoronoiGraph(size_t _width, size_t _height, const std::vector<glm::ivec2>& centers) :
-		voronoiCells(centers.size()), width(_width), height(_height)
-	{
-		// Estimate center average spacing
-		const auto approxSigma = std::sqrt(_width * _height) / std::sqrt(centers.size());
-
-		// Compute bounds
-		glm::ivec2 min = centers[0];
-		glm::ivec2 max = centers[0];
-		for (const auto& point : centers)
+		const int64_t width = labels.getSizeX();
+		const int64_t height = labels.getSizeY();
+		LibTIM::Image<LibTIM::U8> boundaries(labels.getSizeX(), labels.getSizeY());
+		if (width < 2 || height < 2)
 		{
-			if (point.x < min.x)
-				min.x = point.x;
-			if (point.y < min.y)
-				min.y = point.y;
-			if (point.x > max.x)
-				max.x = point.x;
-			if (point.y > max.y)
-				max.y = point.y;
+			// Lines : the neighbours are the previous and the next pixels
+			const int64_t count = width * height;
+			for (int64_t i = 0; i < count; i++)
+				boundaries(i) = i > 0 && i + 1 < count && labels(i - 1) != labels(i + 1) ? 255 : 0;
+			return boundaries;
 		}
-		const auto size = max - min;
 
-		// Generate a 2D grid
-		const auto gridRes = glm::ivec2(size.x / approxSigma, size.y / approxSigma);
-		std::vector<std::vector<std::pair<size_t, glm::ivec2>>> cellGrid((gridRes.x + 1) * (gridRes.y + 1));
-
-		const auto imageToGrid = [&](const glm::ivec2& image)
+#pragma omp parallel for
+		for (int64_t y = 0; y < height; y++)
 		{
-			return glm::ivec2(glm::vec2(image) / static_cast<float>(approxSigma));
-		};
+			const LibTIM::TLabel* row = &labels(0, y);
+			// The first and last rows compare their only vertical neighbour with itself
+			const LibTIM::TLabel* above = y > 0 ? row - width : row + width;
+			const LibTIM::TLabel* below = y + 1 < height ? row + width : row - width;
+			LibTIM::U8* boundary = &boundaries(0, y);
+			boundary[0] = row[1] != above[0] || row[1] != below[0] ? 255 : 0;
+			for (int64_t x = 1; x + 1 < width; x++)
+				boundary[x] = (row[x - 1] != row[x + 1]) | (row[x - 1] != above[x]) | (row[x - 1] != below[x]) ? 255 : 0;
+			boundary[width - 1] = row[width - 2] != above[width - 1] || row[width - 2] != below[width - 1] ? 255 : 0;
+		}
+		return boundaries;
+	}
 
-		const auto isGridPosValid = [&](int x, int y)
+	namespace
+	{
+		// Centers stored column by column (x increasing, then y increasing inside a column), each column using one of
+		// a few row patterns. This is the layout of makeRectGrid2D (one pattern) and makeHexGrid2D (two patterns).
+		struct ColumnLattice
 		{
-			return !(x < 0 || y < 0 || x > gridRes.x || y > gridRes.y);
+			std::vector<int> columnX;
+			std::vector<uint32_t> columnStart;
+			std::vector<uint32_t> columnPattern;
+			std::vector<std::vector<int>> patterns;
 		};
 
-		const auto fetchGrid = [&](const glm::ivec2& pos) -> std::vector<std::pair<size_t, glm::ivec2>>&
+		constexpr size_t maxLatticePatterns = 4;
+
+		bool makeColumnLattice(const std::vector<glm::ivec2>& centers, ColumnLattice& lattice)
 		{
-			if (!isGridPosValid(pos.x, pos.y))
+			std::vector<int> column;
+			const auto closeColumn = [&]()
+			{
+				const auto pattern = std::find(lattice.patterns.begin(), lattice.patterns.end(), column);
+				lattice.columnPattern.emplace_back(static_cast<uint32_t>(pattern - lattice.patterns.begin()));
+				if (pattern == lattice.patterns.end())
+					lattice.patterns.emplace_back(column);
+				column.clear();
+				return lattice.patterns.size() <= maxLatticePatterns;
+			};
+
+			for (size_t i = 0; i < centers.size(); ++i)
 			{
-				std::cerr << "invalid grid pos : " << pos.x << "x" << pos.y << std::endl;
-				throw std::runtime_error("invalid grid pos");
+				if (lattice.columnX.empty() || centers[i].x != lattice.columnX.back())
+				{
+					if (!lattice.columnX.empty() && (centers[i].x < lattice.columnX.back() || !closeColumn()))
+						return false;
+					lattice.columnX.emplace_back(centers[i].x);
+					lattice.columnStart.emplace_back(static_cast<uint32_t>(i));
+				}
+				else if (centers[i].y <= column.back())
+					return false;
+				column.emplace_back(centers[i].y);
 			}
-			return cellGrid[pos.x + pos.y * gridRes.x];
-		};
+			return closeColumn();
+		}
 
-		// Place centers in the 2D grid
-		for (int64_t i = 0; i < centers.size(); ++i)
+		// For each coordinate in [0, size[, index of the closest value in sorted (the lowest index on ties)
+		std::vector<uint32_t> makeClosestLUT(const std::vector<int>& sorted, size_t size)
 		{
-			constexpr int radius = 1;
-			for (int x = -radius; x <= radius; ++x)
-				for (int y = -radius; y <= radius; ++y)
-				{
-					const auto pos = imageToGrid(centers[i]) + glm::ivec2(x, y);
-					if (isGridPosValid(pos.x, pos.y))
-						fetchGrid(pos).emplace_back(std::pair{i, centers[i]});
-				}
+			std::vector<uint32_t> lut(size);
+			size_t index = 0;
+			for (size_t i = 0; i < size; ++i)
+			{
+				const auto pos = static_cast<int64_t>(i);
+				while (index + 1 < sorted.size() && std::abs(sorted[index + 1] - pos) < std::abs(sorted[index] - pos))
+					++index;
+				lut[i] = static_cast<uint32_t>(index);
+			}
+			return lut;
 		}
+	}
+
+	VoronoiGraph::VoronoiGraph() : width(0), height(0)
+	{
+	}
+
+	VoronoiGraph::VoronoiGraph(size_t _width, size_t _height, std::vector<glm::ivec2> centers,
+	                           std::vector<uint32_t> _cellIds, std::vector<uint32_t> _cellOffsets,
+	                           std::vector<uint32_t> _cellPixels) :
+		cellCenters(std::move(centers)), cellIds(std::move(_cellIds)), cellOffsets(std::move(_cellOffsets)),
+		cellPixels(std::move(_cellPixels)), width(_width), height(_height)
+	{
+		if (cellIds.size() != width * height || cellPixels.size() != width * height ||
+			cellOffsets.size() != cellCenters.size() + 1)
+			throw std::runtime_error("inconsistent voronoi graph layout");
+	}
+
+	VoronoiGraph::VoronoiGraph(size_t _width, size_t _height, const std::vector<glm::ivec2>& centers) :
+		cellCenters(centers), cellIds(_width * _height), cellOffsets(centers.size() + 1, 0), width(_width),
+		height(_height)
+	{
+		if (centers.empty())
+			throw std::runtime_error("cannot build a voronoi graph without centers");
+		// Pixels are indexed by 32 bits offsets
+		if (static_cast<uint64_t>(_width) * _height > std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error("voronoi graphs are limited to 2^32 pixels, use the band-streaming mode");
+
+		// Rows are split in chunks, each chunk counts its pixels per cell then writes them at its own place in the
+		// CSR layout. Cell pixels end up in raster order whatever the chunk count, and no lock is needed.
+#ifdef _OPENMP
+		const int64_t chunkCount = std::max<int64_t>(1, std::min<int64_t>(omp_get_max_threads(), height));
+#else
+		const int64_t chunkCount = 1;
+#endif
+		const auto chunkBegin = [&](int64_t chunk) { return chunk * static_cast<int64_t>(height) / chunkCount; };
+		std::vector<std::vector<uint32_t>> chunkCellCounts(chunkCount, std::vector<uint32_t>(centers.size(), 0));
 
-		const auto getClosestCenter = [&](const glm::ivec2& pos) -> unsigned long
+		const auto fillCellMap = [&](const auto& getClosestCenter)
 		{
-			float closestDistance = FLT_MAX;
-			size_t closestIndex = 0;
-			
-			const auto gridPos = imageToGrid(pos);
-			for (const auto& point : fetchGrid({gridPos.x, gridPos.y}))
+#pragma omp parallel for schedule(static, 1)
+			for (int64_t chunk = 0; chunk < chunkCount; ++chunk)
 			{
-				const auto delta = pos - point.second;
-				const auto distance = static_cast<float>(std::sqrt(delta.x * delta.x + delta.y * delta.y));
-				if (distance < closestDistance)
+				auto& counts = chunkCellCounts[chunk];
+				for (int64_t y = chunkBegin(chunk); y < chunkBegin(chunk + 1); ++y)
 				{
-					closestDistance = distance;
-					closestIndex = point.first;
+					uint32_t* row = cellIds.data() + y * width;
+					for (int64_t x = 0; x < static_cast<int64_t>(width); ++x)
+					{
+						const auto center = getClosestCenter(x, y);
+						row[x] = center;
+						counts[center]++;
+					}
 				}
 			}
+		};
+
 
-			if (closestDistance < FLT_MAX)
+		// Nearest center of a pixel, the lowest index wins on ties
+		ColumnLattice lattice;
+		std::vector<uint32_t> closestColumn;
+		std::vector<std::vector<uint32_t>> closestRow;
+
+		// Spatial hash used for arbitrary centers
+		glm::ivec2 bucketMin;
+		glm::ivec2 bucketRes;
+		int bucketSize = 1;
+		std::vector<uint32_t> bucketOffsets;
+		std::vector<uint32_t> bucketCenters;
+
+		if (makeColumnLattice(centers, lattice))
+		{
+			// Closed-form lookup : closest column, closest row in each column pattern, then neighbour columns
+			// only while they can still be closer.
+			closestColumn = makeClosestLUT(lattice.columnX, width);
+			for (const auto& pattern : lattice.patterns)
+				closestRow.emplace_back(makeClosestLUT(pattern, height));
+
+			fillCellMap([&](int64_t x, int64_t y) -> uint32_t
+			{
+				int64_t closestDistance = INT64_MAX;
+				uint32_t closestIndex = 0;
+				const auto testColumn = [&](int64_t column)
+				{
+					const auto& pattern = lattice.columnPattern[column];
+					const auto row = closestRow[pattern][y];
+					const int64_t dx = lattice.columnX[column] - x;
+					const int64_t dy = lattice.patterns[pattern][row] - y;
+					const int64_t distance = dx * dx + dy * dy;
+					const uint32_t index = lattice.columnStart[column] + row;
+					if (distance < closestDistance || (distance == closestDistance && index < closestIndex))
+					{
+						closestDistance = distance;
+						closestIndex = index;
+					}
+				};
+				const auto isColumnInRange = [&](int64_t column)
+				{
+					const int64_t dx = lattice.columnX[column] - x;
+					return dx * dx <= closestDistance;
+				};
+
+				const int64_t first = closestColumn[x];
+				testColumn(first);
+				for (int64_t c = first - 1; c >= 0 && isColumnInRange(c); --c)
+					testColumn(c);
+				for (int64_t c = first + 1; c < static_cast<int64_t>(lattice.columnX.size()) && isColumnInRange(c); ++c)
+					testColumn(c);
 				return closestIndex;
+			});
+		}
+		else
+		{
+			// Estimate center average spacing
+			bucketSize = std::max(1, static_cast<int>(std::sqrt(width * height / static_cast<double>(centers.size()))));
 
-			std::cerr << "failed to find voronoi center" << std::endl;
-			throw std::runtime_error("failed to find voronoi center");
-		};
+			// Buckets cover both the centers and the image
+			bucketMin = glm::ivec2(0);
+			glm::ivec2 max(static_cast<int>(width) - 1, static_cast<int>(height) - 1);
+			for (const auto& point : centers)
+			{
+				bucketMin = glm::min(bucketMin, point);
+				max = glm::max(max, point);
+			}
+			bucketRes = (max - bucketMin) / bucketSize + 1;
 
-#pragma omp parallel for
-		for (int64_t i = 0; i < centers.size(); ++i)
-			voronoiCells[i] = {centers[i], {}};
+			const auto bucketOf = [&](const glm::ivec2& pos)
+			{
+				const auto cell = (pos - bucketMin) / bucketSize;
+				return cell.x + cell.y * bucketRes.x;
+			};
+
+			bucketOffsets.resize(static_cast<size_t>(bucketRes.x) * bucketRes.y + 1, 0);
+			for (const auto& point : centers)
+				bucketOffsets[bucketOf(point) + 1]++;
+			for (size_t i = 1; i < bucketOffsets.size(); ++i)
+				bucketOffsets[i] += bucketOffsets[i - 1];
+			bucketCenters.resize(centers.size());
+			std::vector<uint32_t> bucketFill(bucketOffsets.begin(), bucketOffsets.end() - 1);
+			for (size_t i = 0; i < centers.size(); ++i)
+				bucketCenters[bucketFill[bucketOf(centers[i])]++] = static_cast<uint32_t>(i);
+
+			// Search rings of buckets around the pixel until no unvisited bucket can be closer
+			fillCellMap([&](int64_t x, int64_t y) -> uint32_t
+			{
+				int64_t closestDistance = INT64_MAX;
+				uint32_t closestIndex = 0;
+				const glm::ivec2 pos(static_cast<int>(x), static_cast<int>(y));
+				const auto home = (pos - bucketMin) / bucketSize;
+				const auto testBucket = [&](int bx, int by)
+				{
+					if (bx < 0 || by < 0 || bx >= bucketRes.x || by >= bucketRes.y)
+						return;
+					const auto bucket = bx + by * bucketRes.x;
+					for (auto i = bucketOffsets[bucket]; i < bucketOffsets[bucket + 1]; ++i)
+					{
+						const auto delta = glm::i64vec2(centers[bucketCenters[i]] - pos);
+						const int64_t distance = delta.x * delta.x + delta.y * delta.y;
+						if (distance < closestDistance || (distance == closestDistance && bucketCenters[i] < closestIndex))
+						{
+							closestDistance = distance;
+							closestIndex = bucketCenters[i];
+						}
+					}
+				};
 
-		std::vector<std::mutex> cellMutex(voronoiCells.size());
+				const int maxRing = std::max(bucketRes.x, bucketRes.y);
+				for (int ring = 0; ring <= maxRing; ++ring)
+				{
+					for (int i = -ring; i <= ring; ++i)
+					{
+						testBucket(home.x + i, home.y - ring);
+						if (ring > 0)
+							testBucket(home.x + i, home.y + ring);
+					}
+					for (int i = -ring + 1; i < ring; ++i)
+					{
+						testBucket(home.x - ring, home.y + i);
+						testBucket(home.x + ring, home.y + i);
+					}
+					// Everything outside this ring is at least ring * bucketSize away
+					const int64_t reach = static_cast<int64_t>(ring) * bucketSize;
+					if (closestDistance < reach * reach)
+						break;
+				}
+				return closestIndex;
+			});
+		}
 
-#pragma omp parallel for collapse(2) if(width > 1000 && height > 1000)
-		for (int64_t x = 0; x < width; ++x)
-			for (int64_t y = 0; y < height; ++y) {
-				const auto center = getClosestCenter({ x, y });
-				std::lock_guard m(cellMutex[center]);
-				voronoiCells[center].second.emplace_back(glm::ivec2{ x, y });
+		for (size_t i = 0; i < centers.size(); ++i)
+		{
+			uint32_t cellSize = 0;
+			for (auto& counts : chunkCellCounts)
+			{
+				const auto count = counts[i];
+				counts[i] = cellOffsets[i] + cellSize;
+				cellSize += count;
 			}
+			cellOffsets[i + 1] = cellOffsets[i] + cellSize;
+		}
+
+		cellPixels.resize(width * height);
+#pragma omp parallel for schedule(static, 1)
+		for (int64_t chunk = 0; chunk < chunkCount; ++chunk)
+		{
+			auto& cursors = chunkCellCounts[chunk];
+			for (int64_t y = chunkBegin(chunk); y < chunkBegin(chunk + 1); ++y)
+			{
+				const uint32_t* row = cellIds.data() + y * width;
+				for (int64_t x = 0; x < static_cast<int64_t>(width); ++x)
+					cellPixels[cursors[row[x]]++] = static_cast<uint32_t>(x + y * width);
+			}
+		}
 	}
 
 	LibTIM::Image<LibTIM::RGB> VoronoiGraph::debugVisualization() const
@@ -272,45 +595,49 @@ namespace WP
 		LibTIM::Image<LibTIM::RGB> result(width, height);
 		result.fill(LibTIM::RGB({0, 0, 0}));
 		LibTIM::Image<LibTIM::U8> stamp(width, height);
-		int ccId = 1;
-		for (const auto& cc : voronoiCells)
-		{
-			for (const auto& pixel : cc.second)
-				stamp(pixel.x, pixel.y) = ccId;
+#pragma omp parallel for
+		for (int64_t i = 0; i < static_cast<int64_t>(cellIds.size()); ++i)
+			stamp(i) = static_cast<LibTIM::U8>(cellIds[i] + 1);
 
-			if (result.isPosValid(cc.first.x, cc.first.y))
-				result(cc.first.x, cc.first.y)[0] = 255;
-
-			ccId++;
-		}
+		for (const auto& center : cellCenters)
+			if (result.isPosValid(center.x, center.y))
+				result(center.x, center.y)[0] = 255;
 
 		LibTIM::FlatSE connectivity;
 		connectivity.make2DN4();
 		const auto borders = morphologicalGradient(stamp, connectivity);
 
-#pragma omp parallel for collapse(2)
-		for (int64_t x = 0; x < width; ++x)
-			for (int64_t y = 0; y < height; ++y)
-				result(x, y)[1] = borders(x, y) ? 255 : 0;
+		LibTIM::forEachRow(static_cast<LibTIM::TCoord>(height), [&](LibTIM::TCoord y)
+		{
+			LibTIM::RGB* pixels = result.row(y);
+			const LibTIM::U8* border = borders.row(y);
+			for (int64_t x = 0; x < static_cast<int64_t>(width); ++x)
+				pixels[x][1] = border[x] ? 255 : 0;
+		});
 		return result;
 	}
 
-	static int profilerIndent = 0;
-	static std::mutex profilerIndentMutex;
+	// Enclosing Profiler and ProfilerCumulator scopes of the thread
+	static thread_local int profilerIndent = 0;
+
+	Profiler::Profiler(const char* _description) : start(TraceRecorder::now()), description(_description)
+	{
+		TraceRecorder::begin(description);
+		profilerIndent++;
+	}
 
 	Profiler::~Profiler()
 	{
+		TraceRecorder::end(description);
 		if (print)
 			Profiler::printDuration(description, getDuration());
-		std::lock_guard m(profilerIndentMutex);
 		profilerIndent--;
 	}
 
 	double Profiler::getDuration()
 	{
 		print = false;
-		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() /
-			1000.0;
+		return (TraceRecorder::now() - start) / 1e6;
 	}
 
 	void Profiler::printDuration(const std::string& description, double duration)
@@ -321,52 +648,37 @@ namespace WP
 	std::string Profiler::makeIndent()
 	{
 		std::string str = " ";
-		std::lock_guard m(profilerIndentMutex);
 		for (int i = 0; i < profilerIndent; ++i)
 			str = "--" + str;
 		return str;
 	}
 
-	Profiler::Profiler(std::string _description) : start(std::chrono::steady_clock::now()),
-	                                               description(std::move(_description))
+	ProfilerCumulator::ProfilerCumulator(const char* _description, bool _average) :
+		description(_description), average(_average)
 	{
-		std::lock_guard m(profilerIndentMutex);
 		profilerIndent++;
 	}
 
 	ProfilerCumulator::~ProfilerCumulator()
 	{
+		const double totalMs = total / 1e6;
 		if (average)
-			std::cout << Profiler::makeIndent() << total / calls << "ms elapsed in average : " << description <<
-				" (" << calls <<
-				" calls)" << std::endl;
+			std::cout << Profiler::makeIndent() << (calls ? totalMs / calls : 0) << "ms elapsed in average : " <<
+				description << " (" << calls << " calls)" << std::endl;
 		else
-			std::cout << Profiler::makeIndent() << total << "ms elapsed in total : " << description << " (" <<
+			std::cout << Profiler::makeIndent() << totalMs << "ms elapsed in total : " << description << " (" <<
 				calls << " calls)" << std::endl;
-		std::lock_guard m(profilerIndentMutex);
 		profilerIndent--;
 	}
 
-	ProfilerCumulator::Instance::Instance(ProfilerCumulator& _parent)
-		: start(std::chrono::steady_clock::now()), parent(_parent)
+	ProfilerCumulator::Instance::Instance(ProfilerCumulator& _parent) : start(TraceRecorder::now()), parent(_parent)
 	{
-		std::lock_guard m(profilerIndentMutex);
-		profilerIndent++;
+		TraceRecorder::begin(parent.description);
 	}
 
 	ProfilerCumulator::Instance::~Instance()
 	{
-		parent.append(
-			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).
-			count() / 1000.0);
-		std::lock_guard m(profilerIndentMutex);
-		profilerIndent--;
-	}
-
-	ProfilerCumulator::ProfilerCumulator(std::string _description, bool _average) :
-		description(std::move(_description)), average(_average)
-	{
-		std::lock_guard m(profilerIndentMutex);
-		profilerIndent++;
+		TraceRecorder::end(parent.description);
+		parent.append(TraceRecorder::now() - start);
 	}
 }
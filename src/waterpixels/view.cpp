@@ -0,0 +1,129 @@
+#include "waterpixels/view.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "waterpixels/superpixels.hpp"
+#include "waterpixels/utils.hpp"
+
+#include <libtim/Algorithms/Morphology.h>
+#include <libtim/Common/FlatSE.h>
+
+namespace WP
+{
+	namespace
+	{
+		static_assert(sizeof(LibTIM::RGB) == 3, "RGB rows are read as interleaved bytes");
+
+		void checkViews(const PixelView& input, const LabelView& output)
+		{
+			if (!input.data || input.width <= 0 || input.height <= 0)
+				throw std::invalid_argument("waterpixel : empty input view");
+			if (input.rowStride < static_cast<size_t>(input.width) * pixelSize(input.layout))
+				throw std::invalid_argument("waterpixel : input row stride smaller than a row");
+			if (!output.data || output.width != input.width || output.height != input.height)
+				throw std::invalid_argument("waterpixel : the output view must have the size of the input view");
+			if (output.rowStride < output.width * sizeof(LibTIM::TLabel) || output.rowStride % sizeof(LibTIM::TLabel))
+				throw std::invalid_argument("waterpixel : output row stride must hold a row of whole labels");
+		}
+	}
+
+	const LibTIM::RGB* pixelRow(const PixelView& image, int64_t y, std::vector<LibTIM::RGB>& buffer)
+	{
+		const uint8_t* pixel = image.data + y * image.rowStride;
+		// Rows are already in the layout of LibTIM::RGB
+		if (image.layout == PixelLayout::RGB)
+			return reinterpret_cast<const LibTIM::RGB*>(pixel);
+
+		const int channels = pixelSize(image.layout);
+		const int red = image.layout == PixelLayout::BGR || image.layout == PixelLayout::BGRA ? 2 : 0;
+		const int green = channels == 1 ? 0 : 1;
+		const int blue = channels == 1 ? 0 : 2 - red;
+		buffer.resize(image.width);
+		for (int64_t x = 0; x < image.width; ++x, pixel += channels)
+		{
+			buffer[x][0] = pixel[red];
+			buffer[x][1] = pixel[green];
+			buffer[x][2] = pixel[blue];
+		}
+		return buffer.data();
+	}
+
+	PixelView pixelView(const LibTIM::Image<LibTIM::RGB>& image)
+	{
+		return {
+			reinterpret_cast<const uint8_t*>(&image(0)), image.getSizeX(), image.getSizeY(),
+			static_cast<size_t>(image.getSizeX()) * 3, PixelLayout::RGB
+		};
+	}
+
+	LibTIM::Image<LibTIM::U8> imageIntensity(const PixelView& image)
+	{
+		const int64_t width = image.width;
+		LibTIM::Image<LibTIM::U8> lImage(image.width, image.height);
+#pragma omp parallel
+		{
+			std::vector<LibTIM::RGB> row;
+#pragma omp for
+			for (int64_t y = 0; y < image.height; y++)
+				rgbRowToLightness(pixelRow(image, y, row), lImage.getData() + y * width, width);
+		}
+		return lImage;
+	}
+
+	void waterpixel(const PixelView& input, const LabelView& output, float sigma, float k, float cellScale,
+	                int blurRadius, const WaterpixelOptions& options, SuperpixelGraph* superpixels)
+	{
+		checkViews(input, output);
+		VoronoiGraph voronoi;
+		{
+			MEASURE_DURATION(voronoiCells, "Generate voronoi cells");
+			voronoi = VoronoiGraph(input.width, input.height, makeRectGrid2D(input.width, input.height, sigma));
+		}
+		waterpixel(input, output, voronoi, sigma, k, cellScale, blurRadius, options, superpixels);
+	}
+
+	void waterpixel(const PixelView& input, const LabelView& output, const VoronoiGraph& voronoi, float sigma, float k,
+	                float cellScale, int blurRadius, const WaterpixelOptions& options, SuperpixelGraph* superpixels)
+	{
+		checkViews(input, output);
+		if (voronoi.getWidth() != static_cast<size_t>(input.width) ||
+			voronoi.getHeight() != static_cast<size_t>(input.height))
+			throw std::invalid_argument("waterpixel : the voronoi graph must have the size of the views");
+
+		LibTIM::Image<LibTIM::U8> preFilteredImage;
+		{
+			MEASURE_DURATION(prefiltering, "Image pre-filtering");
+			preFilteredImage = imageIntensity(input);
+			if (blurRadius >= 1)
+			{
+				LibTIM::FlatSE filter;
+				filter.make2DEuclidianBall(blurRadius);
+				preFilteredImage = closingNoBorder(openingNoBorder(std::move(preFilteredImage), filter), filter);
+			}
+		}
+
+		// Contiguous output rows : the whole algorithm writes into the caller buffer
+		const auto rowLabels = static_cast<int64_t>(output.rowStride / sizeof(LibTIM::TLabel));
+		auto labels = rowLabels == output.width
+			              ? LibTIM::Image<LibTIM::TLabel>::borrow(output.data, output.width, output.height)
+			              : LibTIM::Image<LibTIM::TLabel>(output.width, output.height);
+		WaterpixelStages stages;
+		{
+			MEASURE_DURATION(watershed, "Waterpixel algorithm");
+			waterpixel(preFilteredImage, voronoi, sigma, k, cellScale, labels, nullptr, options,
+			           superpixels ? &stages : nullptr);
+		}
+		if (superpixels)
+			*superpixels = superpixelGraph(labels, voronoi.cellCount(), stages.gradient, &input);
+		if (labels.getData() == output.data)
+			return;
+
+		MEASURE_DURATION(copy, "Copy labels to the output view");
+#pragma omp parallel for
+		for (int64_t y = 0; y < output.height; y++)
+			std::copy(&labels(0, y), &labels(0, y) + output.width, output.data + y * rowLabels);
+	}
+}
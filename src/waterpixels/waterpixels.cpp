@@ -1,265 +1,459 @@
 #include "waterpixels/waterpixels.hpp"
 
-#include <unordered_set>
-
+#include "waterpixels/regularization.hpp"
 #include "waterpixels/utils.hpp"
+#include "waterpixels/watershed.hpp"
 
 #include <libtim/Algorithms/ConnectedComponents.hxx>
+#include <libtim/Algorithms/Morphology.h>
 #include <libtim/Algorithms/Watershed.hxx>
 #include <libtim/Common/FlatSE.h>
+#include <libtim/Common/OrderedQueue.h>
 #include <atomic>
+#include <limits>
+#include <optional>
+#include <stdexcept>
 #include <glm/glm.hpp>
 
-template <>
-struct std::hash<glm::ivec2>
+namespace WP
 {
-	std::size_t operator()(const glm::ivec2& k) const
-	{
-		using std::size_t;
-		using std::hash;
-		using std::string;
 
-		// Compute individual hash values for first,
-		// second and third and combine them using XOR
-		// and bit shifting:
-
-		return ((hash<int>()(k.x)
-			^ (hash<int>()(k.y) << 1)) >> 1);
+	LibTIM::Image<LibTIM::U8> rgbImageIntensity(const LibTIM::Image<LibTIM::RGB>& image)
+	{
+		return rgbImageIntensity(&image(0), image.getSizeX(), image.getSizeY());
 	}
-};
 
+	LibTIM::Image<LibTIM::U8> rgbImageIntensity(const LibTIM::RGB* pixels, LibTIM::TSize width, LibTIM::TSize height)
+	{
+		LibTIM::Image<LibTIM::U8> lImage(width, height);
+#pragma omp parallel for
+		for (int64_t y = 0; y < height; y++)
+			rgbRowToLightness(pixels + y * width, lImage.getData() + y * width, width);
+		return lImage;
+	}
 
-namespace WP
-{
-	glm::ivec2 clampPointToImage(const LibTIM::Image<LibTIM::TLabel>& image, glm::ivec2 point)
+	void rgbImageCIELAB(const LibTIM::Image<LibTIM::RGB>& image, LibTIM::Image<float>& l, LibTIM::Image<float>& a,
+	                    LibTIM::Image<float>& b)
 	{
-		return glm::ivec2{
-			std::clamp(point.x, 0, image.getSizeX() - 1), std::clamp(point.y, 0, image.getSizeY() - 1)
-		};
+		l.setSize(image.getSizeX(), image.getSizeY(), 1);
+		a.setSize(image.getSizeX(), image.getSizeY(), 1);
+		b.setSize(image.getSizeX(), image.getSizeY(), 1);
+#pragma omp parallel for
+		for (int64_t i = 0; i < image.getBufSize(); i++)
+		{
+			const auto lab = rgbToCIELAB(image(i));
+			l(i) = lab.x;
+			a(i) = lab.y;
+			b(i) = lab.z;
+		}
 	}
 
-	template <typename Lambda_T>
-	void iterateConnectedComponent(LibTIM::Image<LibTIM::TLabel>& background, int ccOffset, const glm::ivec2& start,
-	                               Lambda_T callback)
+	namespace
 	{
-		const auto centerClamped = clampPointToImage(background, start);
-		const unsigned long componentValue = background(centerClamped.x, centerClamped.y);
-		std::vector testedPoints = {centerClamped};
-		background(centerClamped.x, centerClamped.y) += ccOffset;
-		while (!testedPoints.empty())
+		// Fixed point scale of the compact flooding priorities, which must fit in 16 bits
+		constexpr float COMPACT_PRIORITY_SCALE = 64;
+		constexpr int COMPACT_PRIORITY_MAX = std::numeric_limits<uint16_t>::max();
+
+		// Pixel reached by a label in the compact flooding
+		struct CompactEntry
 		{
-			const auto point = testedPoints.back();
-			testedPoints.pop_back();
+			uint32_t pixel;
+			uint32_t label;
+		};
 
-			callback(point);
+		template <RegularizationDistance Distance>
+		void floodCompactKernel(const LibTIM::Image<LibTIM::U8>& gradient, const VoronoiGraph& voronoiCells,
+		                        float sigma, float k, LibTIM::Image<LibTIM::TLabel>& markers)
+		{
+			const int64_t width = gradient.getSizeX();
+			const int64_t height = gradient.getSizeY();
+			const auto& centers = voronoiCells.centers();
+			const RegularizationTable<Distance> table(sigma, k);
+			const auto priority = [&](int64_t x, int64_t y, LibTIM::TLabel label)
+			{
+				const auto& seed = centers[label - 1];
+				const float value = gradient(x + y * width) + table.at(x - seed.x, y - seed.y);
+				return std::min(static_cast<int>(value * COMPACT_PRIORITY_SCALE + 0.5f), COMPACT_PRIORITY_MAX);
+			};
 
-			const auto testPosition = [&](const glm::ivec2& pos)
+			// A pixel may be queued by several labels, each with its own priority : the first entry popped labels
+			// it, the others are stale
+			LibTIM::HierarchicalQueue<CompactEntry, uint16_t> queue;
+			const auto pushNeighbours = [&](int64_t p, LibTIM::TLabel label)
 			{
-				if (!background.isPosValid(pos.x, pos.y) || background(pos.x, pos.y) != componentValue)
-					return;
-				testedPoints.emplace_back(pos);
-				background(pos.x, pos.y) += ccOffset;
+				const auto x = p % width;
+				const auto y = p / width;
+				const auto push = [&](int64_t qx, int64_t qy)
+				{
+					const auto q = qx + qy * width;
+					if (!markers(q))
+						queue.put(priority(qx, qy, label), {static_cast<uint32_t>(q), static_cast<uint32_t>(label)});
+				};
+				if (y > 0)
+					push(x, y - 1);
+				if (x > 0)
+					push(x - 1, y);
+				if (x + 1 < width)
+					push(x + 1, y);
+				if (y + 1 < height)
+					push(x, y + 1);
 			};
 
-			testPosition(point + glm::ivec2{1, 0});
-			testPosition(point + glm::ivec2{-1, 0});
-			testPosition(point + glm::ivec2{0, 1});
-			testPosition(point + glm::ivec2{0, -1});
+			for (int64_t p = 0; p < width * height; ++p)
+				if (const auto label = markers(p))
+					pushNeighbours(p, label);
+
+			while (!queue.empty())
+			{
+				const auto entry = queue.get();
+				if (markers(entry.pixel))
+					continue;
+				markers(entry.pixel) = entry.label;
+				pushNeighbours(entry.pixel, entry.label);
+			}
 		}
 	}
 
-
-	LibTIM::Image<LibTIM::U8> rgbImageIntensity(const LibTIM::Image<LibTIM::RGB>& image)
+	LibTIM::Image<LibTIM::U8> spatialRegularization(const LibTIM::Image<LibTIM::U8>& source,
+	                                                const VoronoiGraph& voronoiCells, float sigma, float k,
+	                                                const WaterpixelOptions& options)
 	{
-		LibTIM::Image<LibTIM::U8> lImage(image.getSizeX(), image.getSizeY());
-#pragma omp parallel for collapse(2)
-		for (int x = 0; x < image.getSizeX(); x++)
-			for (int y = 0; y < image.getSizeY(); y++)
-				lImage(x, y) = static_cast<LibTIM::U8>(rgbToCIELAB(image(x, y)).r / 100.f * 255.f);
-		return lImage;
+		LibTIM::Image<LibTIM::U8> result(source.getSizeX(), source.getSizeY());
+		const int64_t width = source.getSizeX();
+		withDistance(options.distance, [&](auto distance)
+		{
+			const RegularizationTable<decltype(distance)::value> table(sigma, k);
+#pragma omp parallel for
+			for (int64_t y = 0; y < source.getSizeY(); ++y)
+				table.apply(&source(y * width), &result(y * width), voronoiCells.cellMap().data() + y * width,
+				            voronoiCells.centers().data(), width, y);
+		});
+		return result;
 	}
 
-	LibTIM::Image<LibTIM::U8> spatialRegularization(const LibTIM::Image<LibTIM::U8>& source,
-	                                                const VoronoiGraph& voronoiCells, float sigma, float k)
+	LibTIM::Image<LibTIM::U8> regularizedGradient(const LibTIM::Image<LibTIM::U8>& image,
+	                                              const VoronoiGraph& voronoiCells, float sigma, float k,
+	                                              LibTIM::Image<LibTIM::U8>* gradient, const WaterpixelOptions& options)
 	{
-		LibTIM::Image<LibTIM::U8> result(source.getSizeX(), source.getSizeY());
-		for (const auto& cell : voronoiCells.cells())
+		const int64_t width = image.getSizeX();
+		const int64_t height = image.getSizeY();
+		LibTIM::Image<LibTIM::U8> result(image.getSizeX(), image.getSizeY());
+		if (gradient)
+			gradient->setSize(image.getSizeX(), image.getSizeY(), 1);
+
+		withDistance(options.distance, [&](auto distance)
 		{
-			const auto& center = cell.first;
-			for (const auto& point : cell.second)
+			const RegularizationTable<decltype(distance)::value> table(sigma, k);
+#pragma omp parallel
 			{
-#if USE_LINF_REG_DISTANCE
-				const float d = std::max(std::abs(point.x - center.x),std::abs(point.y - center.y));
-#else
-				const auto delta = point - center;
-				const float d = std::sqrt(delta.x * delta.x + delta.y * delta.y);
-#endif
-
-				result(point.x, point.y) = static_cast<LibTIM::U8>(std::min(
-					static_cast<int>(source(point.x, point.y) + k * (2.f * d / sigma)), 255));
+				std::vector<LibTIM::U8> rowBuffer(gradient ? 0 : width);
+#pragma omp for
+				for (int64_t y = 0; y < height; ++y)
+				{
+					LibTIM::U8* gradRow = gradient ? gradient->getData() + y * width : rowBuffer.data();
+					LibTIM::n4GradientRow(&image(0), gradRow, width, height, y);
+					table.apply(gradRow, result.getData() + y * width, voronoiCells.cellMap().data() + y * width,
+					            voronoiCells.centers().data(), width, y);
+				}
 			}
-		}
+		});
 		return result;
 	}
 
-	LibTIM::Image<LibTIM::TLabel> makeWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source,
-	                                                   const VoronoiGraph& voronoiCells, float sigma,
-	                                                   float cellScale)
+	namespace
 	{
-		LibTIM::Image<LibTIM::TLabel> markers(source.getSizeX(), source.getSizeY());
-		LibTIM::Image<LibTIM::TLabel> voronoiMap(source.getSizeX(), source.getSizeY());
-		LibTIM::Image<LibTIM::TLabel> ccMarkerMap(source.getSizeX(), source.getSizeY());
-		markers.fill(0);
-
-		size_t cellIndex = 1;
-		MEASURE_AVERAGE_DURATION(cellMarkerAvg, "Generate watershed markers for one cell");
-		MEASURE_CUMULATIVE_DURATION(cellHomotTot, "Apply homothety for one cell");
-		MEASURE_CUMULATIVE_DURATION(searchAllMin, "Search all pixels with minimum value in cell");
-		MEASURE_CUMULATIVE_DURATION(cellFilterBestTarget,
-		                            "Filter and keep only the best connected component for each cell");
-		MEASURE_CUMULATIVE_DURATION(iterateSubCellComponents,
-		                            "Local cell component iteration");
-
-		const auto& cells = voronoiCells.cells();
-
-		std::mutex lastMutex;
-		auto last = std::chrono::steady_clock::now();
-
-		std::atomic_int64_t handledCells = 0;
-
-#pragma omp parallel for
-		for (int64_t ci = 0; ci < cells.size(); ++ci)
+		// State of a pixel in the bounding box of the cell being processed by makeWatershedMarkers
+		enum CellPixelState : uint8_t
 		{
-			const auto& cell = cells[ci];
-			MEASURE_ADD_CUMULATOR(cellMarkerAvg);
-			const auto& center = cell.first;
-
-			auto cellPoints = cell.second;
+			Untouched = 0,
+			// Target of the homothety
+			Shrunk,
+			// Shrunk, and of minimum value in the cell
+			Minimum,
+			// Minimum, and already iterated as part of a connected component
+			Visited,
+			// Member of the connected component kept as marker
+			Selected
+		};
 
-			// (1) Apply homothety on the cell points;
+		// Scratch buffer covering the bounding box of one cell, reused for all the cells handled by a thread
+		class CellScratch
+		{
+		public:
+			void reset(const VoronoiGraph::Cell& cell, int64_t imageWidth)
 			{
-				MEASURE_ADD_CUMULATOR(cellHomotTot);
-#pragma omp parallel for
-				for (int64_t i = 0; i < cellPoints.size(); ++i) {
-					const auto& point = cellPoints[i];
-					const auto pointToCenter = glm::vec2(center - point);
-					const auto distance = length(pointToCenter);
-					const auto newPos = center + glm::ivec2(normalize(-pointToCenter) * distance * cellScale);
-					if (source.isPosValid(newPos.x, newPos.y))
-						markers(newPos.x, newPos.y) = 1;
+				width = imageWidth;
+				x0 = INT64_MAX;
+				int64_t x1 = -1;
+				// Cell pixels are in raster order
+				y0 = *cell.begin() / width;
+				const int64_t y1 = *(cell.end() - 1) / width;
+				for (const auto offset : cell)
+				{
+					x0 = std::min<int64_t>(x0, offset % width);
+					x1 = std::max<int64_t>(x1, offset % width);
 				}
+				boxWidth = x1 - x0 + 1;
+				boxHeight = y1 - y0 + 1;
+				states.assign(boxWidth * boxHeight, Untouched);
+			}
 
-				const std::vector<glm::ivec2> oldCellPoints = cellPoints;
-				cellPoints.clear();				
-#pragma omp parallel for
-				for (int64_t i = 0; i < oldCellPoints.size(); ++i) {
-					const auto& point = oldCellPoints[i];
-					if (markers(point.x, point.y)) {
-						cellPoints.emplace_back(point);
-						markers(point.x, point.y) = 0;
-					}
-				}
+			[[nodiscard]] bool contains(const glm::ivec2& pos) const
+			{
+				return pos.x >= x0 && pos.x < x0 + boxWidth && pos.y >= y0 && pos.y < y0 + boxHeight;
 			}
 
-			// (2) Search the local minimum in each voronoi cell
-			float minValue = FLT_MAX;
+			[[nodiscard]] uint8_t& at(const glm::ivec2& pos) { return states[pos.x - x0 + (pos.y - y0) * boxWidth]; }
+			[[nodiscard]] uint8_t& at(uint32_t imageOffset) { return at(position(imageOffset)); }
+
+			[[nodiscard]] glm::ivec2 position(uint32_t imageOffset) const
 			{
-				MEASURE_ADD_CUMULATOR(searchAllMin);
-				for (const auto& point : cellPoints)
-					if (const float val = source(point.x, point.y); val < minValue)
-						minValue = val;
+				return {static_cast<int>(imageOffset % width), static_cast<int>(imageOffset / width)};
+			}
 
-#pragma omp parallel for
-				for (int64_t i = 0; i < cellPoints.size(); ++i) {
-					const auto& point = cellPoints[i];
-					if (const float val = source(point.x, point.y); std::abs(val - minValue) < WP_MARKER_EPSILON)
-						markers(point.x, point.y) = 1;
+			// Move the N4 connected component of start from state 'from' to state 'to'
+			template <typename Lambda_T>
+			void floodComponent(const glm::ivec2& start, uint8_t from, uint8_t to, Lambda_T callback)
+			{
+				stack.clear();
+				stack.emplace_back(start);
+				at(start) = to;
+				while (!stack.empty())
+				{
+					const auto point = stack.back();
+					stack.pop_back();
+					callback(point);
+					for (const auto& delta : {glm::ivec2{1, 0}, glm::ivec2{-1, 0}, glm::ivec2{0, 1}, glm::ivec2{0, -1}})
+					{
+						const auto neighbor = point + delta;
+						if (contains(neighbor) && at(neighbor) == from)
+						{
+							at(neighbor) = to;
+							stack.emplace_back(neighbor);
+						}
+					}
 				}
 			}
 
-			// (3) Keep only largest cell
-#if PREFER_CELL_CENTER
-			float selectedValue = FLT_MAX;
-#else
-			int selectedValue = 0;
-#endif
+		private:
+			std::vector<uint8_t> states;
+			std::vector<glm::ivec2> stack;
+			int64_t width = 0;
+			int64_t x0 = 0;
+			int64_t y0 = 0;
+			int64_t boxWidth = 0;
+			int64_t boxHeight = 0;
+		};
+
+		// Markers of the cells flagged in cellMask (every cell if null), written over their previous markers
+		template <MarkerSelection Selection>
+		void makeWatershedMarkersKernel(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells,
+		                                float cellScale, float markerEpsilon, const uint8_t* cellMask,
+		                                LibTIM::Image<LibTIM::TLabel>& markers)
+		{
+			MEASURE_AVERAGE_DURATION(cellMarkerAvg, "Generate watershed markers for one cell");
+			MEASURE_CUMULATIVE_DURATION(cellHomotTot, "Apply homothety for one cell");
+			MEASURE_CUMULATIVE_DURATION(searchAllMin, "Search all pixels with minimum value in cell");
+			MEASURE_CUMULATIVE_DURATION(iterateSubCellComponents, "Local cell component iteration");
+
+			const auto cellCount = static_cast<int64_t>(voronoiCells.cellCount());
+			const auto width = static_cast<int64_t>(voronoiCells.getWidth());
+
+			std::mutex lastMutex;
+			auto last = std::chrono::steady_clock::now();
 
-			size_t selectedIndex = 0;
-			std::vector<std::vector<glm::ivec2>> componentSizes;
+			std::atomic_int64_t handledCells = 0;
+
+			// Each cell only reads and writes its own pixels (through a scratch buffer of the size of its bounding box),
+			// and its label is its index + 1 : the result does not depend on the thread count nor on the scheduling.
+			// So an empty cell has no marker, and a cell without candidate pixel falls back on its center only when the
+			// center lies in the cell, else on its first pixel.
+#pragma omp parallel
 			{
-				for (const auto& point : cellPoints)
+				CellScratch scratch;
+#pragma omp for schedule(dynamic, 16)
+				for (int64_t ci = 0; ci < cellCount; ++ci)
 				{
-					if (markers(point.x, point.y) == 1)
+					if (cellMask && !cellMask[ci])
+						continue;
+					const auto cell = voronoiCells.cell(ci);
+					const auto label = static_cast<LibTIM::TLabel>(ci + 1);
+					if (cellMask)
+						for (const auto offset : cell)
+							if (markers(offset) == label)
+								markers(offset) = 0;
+					MEASURE_ADD_CUMULATOR(cellMarkerAvg);
+					const auto& center = cell.center;
+
+					if (cell.empty())
+						continue;
+					scratch.reset(cell, width);
+
+					// (1) Apply homothety on the cell points
 					{
-#if PREFER_CELL_CENTER
-						/* VERSION WITH CLOSEST Connected Component */
-						float minDistance = FLT_MAX;
-						std::vector<glm::ivec2> componentElements;
-						{
-							MEASURE_ADD_CUMULATOR(iterateSubCellComponents);
-
-							iterateConnectedComponent(markers, 1, point, [&](const glm::ivec2& pt)
-							{
-								componentElements.emplace_back(pt);
-								const auto delta = pt - center;
-								const auto distance = std::sqrt(delta.x * delta.x + delta.y * delta.y);
-								if (distance < minDistance)
-									minDistance = distance;
-							});
-						}
-						if (minDistance < selectedValue)
+						MEASURE_ADD_CUMULATOR(cellHomotTot);
+						for (const auto offset : cell)
 						{
-							selectedValue = minDistance;
-							selectedIndex = componentSizes.size();
+							const auto point = scratch.position(offset);
+							const auto pointToCenter = glm::vec2(center - point);
+							const auto distance = length(pointToCenter);
+							const auto newPos = distance > 0
+								                    ? center + glm::ivec2(normalize(-pointToCenter) * distance * cellScale)
+								                    : center;
+							// Targets outside of the cell are ignored by the next steps
+							if (scratch.contains(newPos))
+								scratch.at(newPos) = Shrunk;
 						}
-#else
-						/* VERSION WITH LARGEST Connected Component */
-						std::vector<glm::ivec2> componentElements;
+					}
+
+					// (2) Search the local minimum in each voronoi cell
+					{
+						MEASURE_ADD_CUMULATOR(searchAllMin);
+						float minValue = FLT_MAX;
+						for (const auto offset : cell)
+							if (scratch.at(offset) == Shrunk)
+								minValue = std::min(minValue, static_cast<float>(source(offset)));
+
+						for (const auto offset : cell)
+							if (scratch.at(offset) == Shrunk &&
+								std::abs(static_cast<float>(source(offset)) - minValue) < markerEpsilon)
+								scratch.at(offset) = Minimum;
+					}
+
+					// (3) Keep the best connected component of minimums, first one in raster order on ties
+					// Closest to the cell center (squared distance) or largest
+					int64_t selectedValue = Selection == MarkerSelection::ClosestToCenter ? INT64_MAX : 0;
+					std::optional<glm::ivec2> selectedStart;
+					{
+						MEASURE_ADD_CUMULATOR(iterateSubCellComponents);
+						for (const auto offset : cell)
 						{
-							MEASURE_ADD_CUMULATOR(iterateSubCellComponents);
-							iterateConnectedComponent(markers, 1, point, [&](const glm::ivec2& pt)
+							if (scratch.at(offset) != Minimum)
+								continue;
+							const auto start = scratch.position(offset);
+							int64_t value;
+							bool better;
+							if constexpr (Selection == MarkerSelection::ClosestToCenter)
+							{
+								value = INT64_MAX;
+								scratch.floodComponent(start, Minimum, Visited, [&](const glm::ivec2& pt)
 								{
-									componentElements.emplace_back(pt);
+									const auto delta = glm::i64vec2(pt - center);
+									value = std::min(value, delta.x * delta.x + delta.y * delta.y);
 								});
+								better = value < selectedValue;
+							}
+							else
+							{
+								value = 0;
+								scratch.floodComponent(start, Minimum, Visited, [&](const glm::ivec2&) { value++; });
+								better = value > selectedValue;
+							}
+							if (better)
+							{
+								selectedValue = value;
+								selectedStart = start;
+							}
 						}
-						if (componentElements.size() > selectedValue)
-						{
-							selectedValue = componentElements.size();
-							selectedIndex = componentSizes.size();
-						}
-#endif
-						componentSizes.emplace_back(componentElements);
 					}
-				}
-			}
 
-			if (componentSizes.empty())
-				componentSizes = {{clampPointToImage(source, center)}};
-			for (const auto& point : cellPoints)
-				markers(point.x, point.y) = 0;
-			for (const auto& ccPoint : componentSizes[selectedIndex])
-				markers(ccPoint.x, ccPoint.y) = cellIndex;
-			cellIndex++;
+					if (selectedStart)
+						scratch.floodComponent(*selectedStart, Visited, Selected,
+						                       [&](const glm::ivec2& pt) { markers(pt.x, pt.y) = label; });
+					else
+					{
+						const int64_t x = std::clamp(center.x, 0, source.getSizeX() - 1);
+						const int64_t y = std::clamp(center.y, 0, source.getSizeY() - 1);
+						markers(voronoiCells.cellAt(x, y) == ci ? x + y * width : *cell.begin()) = label;
+					}
 
-			if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last).count()
-				>= 1000)
-			{
-				std::lock_guard m(lastMutex);
-				last = std::chrono::steady_clock::now();
-				std::cout << "Watershed markers generation : " << static_cast<float>(++handledCells) / cells.size() *
-					100 << "% (" << handledCells << "/" << cells.size() << ") ..." << std::endl;
+					if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last).
+						count() >= 1000)
+					{
+						std::lock_guard m(lastMutex);
+						last = std::chrono::steady_clock::now();
+						std::cout << "Watershed markers generation : " << static_cast<float>(++handledCells) / cellCount *
+							100 << "% (" << handledCells << "/" << cellCount << ") ..." << std::endl;
+					}
+					else
+						++handledCells;
+				}
 			}
+		}
+
+		void makeWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells,
+		                          float cellScale, const WaterpixelOptions& options, const uint8_t* cellMask,
+		                          LibTIM::Image<LibTIM::TLabel>& markers)
+		{
+			if (options.markerSelection == MarkerSelection::Largest)
+				makeWatershedMarkersKernel<MarkerSelection::Largest>(source, voronoiCells, cellScale,
+				                                                     options.markerEpsilon, cellMask, markers);
 			else
-				++handledCells;
+				makeWatershedMarkersKernel<MarkerSelection::ClosestToCenter>(source, voronoiCells, cellScale,
+				                                                             options.markerEpsilon, cellMask, markers);
 		}
+	}
 
+	LibTIM::Image<LibTIM::TLabel> makeWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source,
+	                                                   const VoronoiGraph& voronoiCells, float,
+	                                                   float cellScale, const WaterpixelOptions& options)
+	{
+		LibTIM::Image<LibTIM::TLabel> markers(source.getSizeX(), source.getSizeY());
+		markers.fill(0);
+		makeWatershedMarkers(source, voronoiCells, cellScale, options, nullptr, markers);
 		return markers;
 	}
 
+	void updateWatershedMarkers(const LibTIM::Image<LibTIM::U8>& source, const VoronoiGraph& voronoiCells,
+	                            float cellScale, const std::vector<uint8_t>& changedCells,
+	                            LibTIM::Image<LibTIM::TLabel>& markers, const WaterpixelOptions& options)
+	{
+		makeWatershedMarkers(source, voronoiCells, cellScale, options, changedCells.data(), markers);
+	}
+
+
+	int watershedTileSize(float sigma)
+	{
+		// Tiles of about 256 pixels, made of whole grid cells
+		return static_cast<int>(std::max(1.f, std::round(256.f / sigma)) * sigma);
+	}
+
+	int watershedSeamMargin(float sigma)
+	{
+		return static_cast<int>(std::ceil(sigma));
+	}
+
+	void floodWatershed(const LibTIM::Image<LibTIM::U8>& priority, LibTIM::Image<LibTIM::TLabel>& markers,
+	                    float sigma, FloodingEngine flooding)
+	{
+		if (flooding == FloodingEngine::Tiled)
+		{
+			MEASURE_DURATION(watMark, "Run tiled watershed-meyer algorithm");
+			const int tileSize = watershedTileSize(sigma);
+			watershedMeyerTiled(priority, markers, tileSize, tileSize, watershedSeamMargin(sigma));
+			return;
+		}
+		MEASURE_DURATION(watMark, "Run watershed-meyer algorithm");
+		LibTIM::FlatSE connectivity;
+		connectivity.make2DN4();
+		LibTIM::watershedMeyer<uint8_t>(priority, markers, connectivity);
+	}
+
+	void floodCompactWatershed(const LibTIM::Image<LibTIM::U8>& gradient, const VoronoiGraph& voronoiCells, float sigma,
+	                           float k, LibTIM::Image<LibTIM::TLabel>& markers, const WaterpixelOptions& options)
+	{
+		MEASURE_DURATION(watMark, "Run compact watershed algorithm");
+		if (static_cast<uint64_t>(gradient.getBufSize()) > UINT32_MAX)
+			throw std::runtime_error("floodCompactWatershed supports at most 2^32 pixels");
+		withDistance(options.distance, [&](auto distance)
+		{
+			floodCompactKernel<decltype(distance)::value>(gradient, voronoiCells, sigma, k, markers);
+		});
+	}
 
 	LibTIM::Image<LibTIM::TLabel> waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage,
 	                                         const std::vector<glm::ivec2> cellCenters, float sigma, float k,
-	                                         float cellScale)
+	                                         float cellScale, const WaterpixelOptions& options, WaterpixelStages* stages)
 	{
 		// Generate a voronoi graph from source points
 		VoronoiGraph voronoi;
@@ -267,36 +461,78 @@ namespace WP
 			MEASURE_DURATION(voronoiCells, "Generate voronoi cells");
 			voronoi = VoronoiGraph(grayScaleImage.getSizeX(), grayScaleImage.getSizeY(), cellCenters);
 		}
+		auto labels = waterpixel(grayScaleImage, voronoi, sigma, k, cellScale, nullptr, options, stages);
+		if (stages)
+			stages->voronoi = std::move(voronoi);
+		return labels;
+	}
 
-		// Move to the derivative space
-		LibTIM::Image<LibTIM::U8> gradient;
-		{
-			LibTIM::FlatSE filter;
-			filter.make2DN4();
-			MEASURE_DURATION(grad, "Compute image gradient");
-			gradient = morphologicalGradient(grayScaleImage, filter);
-		}
+	LibTIM::Image<LibTIM::TLabel> waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage,
+	                                         const VoronoiGraph& voronoi, float sigma, float k, float cellScale,
+	                                         const LibTIM::Image<LibTIM::U8>* precomputedGradient,
+	                                         const WaterpixelOptions& options, WaterpixelStages* stages)
+	{
+		LibTIM::Image<LibTIM::TLabel> labels(grayScaleImage.getSizeX(), grayScaleImage.getSizeY());
+		waterpixel(grayScaleImage, voronoi, sigma, k, cellScale, labels, precomputedGradient, options, stages);
+		return labels;
+	}
 
-		// This will serve as guide to the watershed algorithm
+	void waterpixel(const LibTIM::Image<LibTIM::U8>& grayScaleImage, const VoronoiGraph& voronoi, float sigma, float k,
+	                float cellScale, LibTIM::Image<LibTIM::TLabel>& labels,
+	                const LibTIM::Image<LibTIM::U8>* precomputedGradient, const WaterpixelOptions& options,
+	                WaterpixelStages* stages)
+	{
+		// Move to the derivative space and add the spatial regularization in the same pass.
+		// The regularized gradient will serve as guide to the watershed algorithm
+		// The compact flooding regularizes the gradient itself while flooding
+		const bool compact = options.flooding == FloodingEngine::Compact;
+		LibTIM::Image<LibTIM::U8> computedGradient;
 		LibTIM::Image<LibTIM::U8> gradientWithRegularization;
+		if (compact)
+		{
+			if (!precomputedGradient)
+			{
+				MEASURE_DURATION(grad, "Compute image gradient");
+				LibTIM::FlatSE connectivity;
+				connectivity.make2DN4();
+				computedGradient = morphologicalGradient(grayScaleImage, connectivity);
+			}
+		}
+		else if (precomputedGradient)
+		{
+			MEASURE_DURATION(grad, "Regularize precomputed image gradient");
+			gradientWithRegularization = spatialRegularization(*precomputedGradient, voronoi, sigma, k, options);
+		}
+		else
 		{
-			MEASURE_DURATION(gradReg, "Add spatial regularization");
-			gradientWithRegularization = spatialRegularization(gradient, voronoi, sigma, k);
+			MEASURE_DURATION(grad, "Compute regularized image gradient");
+			gradientWithRegularization = regularizedGradient(grayScaleImage, voronoi, sigma, k, &computedGradient, options);
 		}
+		const auto& gradient = precomputedGradient ? *precomputedGradient : computedGradient;
 
 		// Generate watershed origins by finding the lowest connected component for each voronoi cell
-		LibTIM::Image<LibTIM::TLabel> watershedSources;
 		{
 			MEASURE_DURATION(watMark, "Generate watershed markers");
-			watershedSources = makeWatershedMarkers(gradient, voronoi, sigma, cellScale);
+			labels.setSize(grayScaleImage.getSizeX(), grayScaleImage.getSizeY(), 1);
+			labels.fill(0);
+			makeWatershedMarkers(gradient, voronoi, cellScale, options, nullptr, labels);
 		}
+		if (stages)
+			stages->markers = labels;
 
 		// Finally run watershed-meyer algorithm on markers
-		MEASURE_DURATION(watMark, "Run watershed-meyer algorithm");
-		LibTIM::FlatSE connectivity;
-		connectivity.make2DN4();
-		LibTIM::watershedMeyer<uint8_t>(gradientWithRegularization, watershedSources, connectivity);
+		if (compact)
+			floodCompactWatershed(gradient, voronoi, sigma, k, labels, options);
+		else
+			floodWatershed(gradientWithRegularization, labels, sigma, options.flooding);
 
-		return watershedSources;
+		if (stages)
+		{
+			if (precomputedGradient)
+				stages->gradient = *precomputedGradient;
+			else
+				stages->gradient = std::move(computedGradient);
+			stages->regularizedGradient = std::move(gradientWithRegularization);
+		}
 	}
 }
@@ -0,0 +1,222 @@
+#include "waterpixels/watershed.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <libtim/Common/OrderedQueue.h>
+
+namespace WP
+{
+	namespace
+	{
+		using FloodQueue = LibTIM::HierarchicalQueue<LibTIM::TOffset, LibTIM::U8>;
+
+		struct Region
+		{
+			int x0, y0, x1, y1;
+
+			[[nodiscard]] bool contains(int x, int y) const
+			{
+				return x >= x0 && x < x1 && y >= y0 && y < y1;
+			}
+		};
+
+		// Meyer flooding of the unlabeled pixels of region, starting from the elements already in the queue
+		void floodRegion(const LibTIM::U8* image, LibTIM::TLabel* labels, int width, const Region& region,
+		                 FloodQueue& queue)
+		{
+			while (!queue.empty())
+			{
+				const LibTIM::TOffset p = queue.get();
+				const int x = static_cast<int>(p % width);
+				const int y = static_cast<int>(p / width);
+
+				const auto visit = [&](int qx, int qy, LibTIM::TOffset q)
+				{
+					if (region.contains(qx, qy) && labels[q] == 0)
+					{
+						labels[q] = labels[p];
+						queue.put(image[q], q);
+					}
+				};
+				visit(x - 1, y, p - 1);
+				visit(x + 1, y, p + 1);
+				visit(x, y - 1, p - width);
+				visit(x, y + 1, p + width);
+			}
+		}
+
+		// Reset region to its markers, then flood it again from the markers and the labels surrounding it
+		// (only the labels on its left and right when withRowBorders is false)
+		void refloodRegion(const LibTIM::U8* image, const LibTIM::TLabel* sources, LibTIM::TLabel* labels, int width,
+		                   int height, const Region& region, FloodQueue& queue, bool withRowBorders = true)
+		{
+			for (int y = region.y0; y < region.y1; ++y)
+				for (int x = region.x0; x < region.x1; ++x)
+				{
+					const LibTIM::TOffset p = x + static_cast<LibTIM::TOffset>(y) * width;
+					labels[p] = sources[p];
+					if (labels[p])
+						queue.put(image[p], p);
+				}
+
+			const auto pushBorder = [&](int x, int y)
+			{
+				if (x < 0 || y < 0 || x >= width || y >= height)
+					return;
+				const LibTIM::TOffset p = x + static_cast<LibTIM::TOffset>(y) * width;
+				if (labels[p])
+					queue.put(image[p], p);
+			};
+			for (int y = region.y0; y < region.y1; ++y)
+			{
+				pushBorder(region.x0 - 1, y);
+				pushBorder(region.x1, y);
+			}
+			for (int x = region.x0; withRowBorders && x < region.x1; ++x)
+			{
+				pushBorder(x, region.y0 - 1);
+				pushBorder(x, region.y1);
+			}
+
+			floodRegion(image, labels, width, region, queue);
+		}
+
+		// Flood the unlabeled pixels of region from its labeled pixels, queued in raster order
+		void floodUnlabeledRegion(const LibTIM::U8* image, LibTIM::TLabel* labels, int width, const Region& region,
+		                          FloodQueue& queue)
+		{
+			for (int y = region.y0; y < region.y1; ++y)
+				for (int x = region.x0; x < region.x1; ++x)
+				{
+					const LibTIM::TOffset p = x + static_cast<LibTIM::TOffset>(y) * width;
+					if (!labels[p])
+						continue;
+					if ((x > region.x0 && !labels[p - 1]) || (x + 1 < region.x1 && !labels[p + 1]) ||
+						(y > region.y0 && !labels[p - width]) || (y + 1 < region.y1 && !labels[p + width]))
+						queue.put(image[p], p);
+				}
+			floodRegion(image, labels, width, region, queue);
+		}
+
+		// Split [0, size[ in chunks of tileSize, the last chunk absorbs the remainder
+		std::vector<int> makeSeams(int size, int tileSize)
+		{
+			std::vector<int> seams = {0};
+			for (int s = tileSize; s + tileSize <= size; s += tileSize)
+				seams.emplace_back(s);
+			seams.emplace_back(size);
+			return seams;
+		}
+	}
+
+	void watershedMeyerRefloodRows(const LibTIM::Image<LibTIM::U8>& image, const LibTIM::Image<LibTIM::TLabel>& sources,
+	                               LibTIM::Image<LibTIM::TLabel>& labels, int y0, int y1)
+	{
+		const int width = image.getSizeX();
+		const int height = image.getSizeY();
+		FloodQueue queue;
+		refloodRegion(&image(0), &sources(0), labels.getData(), width, height,
+		              {0, std::max(y0, 0), width, std::min(y1, height)}, queue);
+	}
+
+	void watershedMeyerFloodUnlabeled(const LibTIM::Image<LibTIM::U8>& image, LibTIM::Image<LibTIM::TLabel>& labels)
+	{
+		FloodQueue queue;
+		floodUnlabeledRegion(&image(0), labels.getData(), image.getSizeX(), {0, 0, image.getSizeX(), image.getSizeY()},
+		                     queue);
+	}
+
+	void watershedMeyerTiled(const LibTIM::Image<LibTIM::U8>& image, LibTIM::Image<LibTIM::TLabel>& markers,
+	                         int tileWidth, int tileHeight, int seamMargin)
+	{
+		const int width = image.getSizeX();
+		const int height = image.getSizeY();
+		tileWidth = std::max(tileWidth, 1);
+		tileHeight = std::max(tileHeight, 1);
+
+		const LibTIM::Image<LibTIM::TLabel> sourceImage = markers;
+		const LibTIM::TLabel* sources = &sourceImage(0);
+		LibTIM::TLabel* labels = markers.getData();
+		const LibTIM::U8* priorities = &image(0);
+
+		const auto seamsX = makeSeams(width, tileWidth);
+		const auto seamsY = makeSeams(height, tileHeight);
+		const int tilesX = static_cast<int>(seamsX.size()) - 1;
+		const int tilesY = static_cast<int>(seamsY.size()) - 1;
+
+		const int marginX = std::min(seamMargin, tileWidth / 2 - 1);
+		const int marginY = std::min(seamMargin, tileHeight / 2 - 1);
+
+		// Tiles without any marker, flooded from the rest of their row of tiles (then from the other rows when the
+		// whole row of tiles has none) so that a row of tiles only depends on itself up to the horizontal seams
+		std::vector<char> emptyTiles(static_cast<size_t>(tilesX) * tilesY, 0);
+		std::vector<char> emptyRows(tilesY, 0);
+
+#pragma omp parallel
+		{
+			FloodQueue queue;
+
+			// (1) Flood each tile independently from its own markers
+#pragma omp for schedule(dynamic) collapse(2)
+			for (int ty = 0; ty < tilesY; ++ty)
+				for (int tx = 0; tx < tilesX; ++tx)
+				{
+					const Region tile{seamsX[tx], seamsY[ty], seamsX[tx + 1], seamsY[ty + 1]};
+					for (int y = tile.y0; y < tile.y1; ++y)
+						for (int x = tile.x0; x < tile.x1; ++x)
+						{
+							const LibTIM::TOffset p = x + static_cast<LibTIM::TOffset>(y) * width;
+							if (labels[p])
+								queue.put(priorities[p], p);
+						}
+
+					if (queue.empty())
+					{
+						emptyTiles[ty * tilesX + tx] = 1;
+						continue;
+					}
+					floodRegion(priorities, labels, width, tile, queue);
+				}
+
+			// (2) Reconcile labels along vertical seams, one row of tiles at a time (bands are disjoint). Rows of tiles
+			// stay independent, the horizontal pass takes care of their seams.
+			if (marginX > 0)
+			{
+#pragma omp for schedule(dynamic) collapse(2)
+				for (int ty = 0; ty < tilesY; ++ty)
+					for (int s = 1; s < tilesX; ++s)
+						refloodRegion(priorities, sources, labels, width, height,
+						              {seamsX[s] - marginX, seamsY[ty], seamsX[s] + marginX, seamsY[ty + 1]}, queue,
+						              false);
+			}
+
+			// (2b) Tiles without any marker : flood them from the labeled pixels of their row of tiles
+#pragma omp for schedule(dynamic)
+			for (int ty = 0; ty < tilesY; ++ty)
+			{
+				const auto begin = emptyTiles.begin() + ty * tilesX;
+				if (std::find(begin, begin + tilesX, 0) == begin + tilesX)
+					emptyRows[ty] = 1;
+				else if (std::find(begin, begin + tilesX, 1) != begin + tilesX)
+					floodUnlabeledRegion(priorities, labels, width, {0, seamsY[ty], width, seamsY[ty + 1]}, queue);
+			}
+
+			// (3) Then along horizontal seams, from the result of the vertical pass
+			if (marginY > 0)
+			{
+#pragma omp for schedule(dynamic)
+				for (int s = 1; s < tilesY; ++s)
+					refloodRegion(priorities, sources, labels, width, height,
+					              {0, seamsY[s] - marginY, width, seamsY[s] + marginY}, queue);
+			}
+		}
+
+		// (4) Rows of tiles without any marker : flood them from the labeled pixels around
+		if (std::find(emptyRows.begin(), emptyRows.end(), 1) != emptyRows.end())
+		{
+			FloodQueue queue;
+			floodUnlabeledRegion(priorities, labels, width, {0, 0, width, height}, queue);
+		}
+	}
+}
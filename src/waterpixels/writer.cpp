@@ -0,0 +1,40 @@
+#include "waterpixels/writer.hpp"
+
+#include <iostream>
+
+#include "waterpixels/utils.hpp"
+
+namespace WP
+{
+	AsyncWriter::AsyncWriter(size_t capacity) : jobs(capacity), thread(&AsyncWriter::run, this)
+	{
+	}
+
+	AsyncWriter::~AsyncWriter()
+	{
+		jobs.close();
+		thread.join();
+	}
+
+	void AsyncWriter::submit(std::function<void()> job)
+	{
+		jobs.push(std::move(job));
+	}
+
+	void AsyncWriter::run()
+	{
+		MEASURE_CUMULATIVE_DURATION(writing, "Asynchronous writes");
+		while (auto job = jobs.pop())
+		{
+			try
+			{
+				MEASURE_ADD_CUMULATOR(writing);
+				(*job)();
+			}
+			catch (const std::exception& error)
+			{
+				std::cerr << "Asynchronous write failed : " << error.what() << std::endl;
+			}
+		}
+	}
+}
@@ -23,6 +23,10 @@
 #include "Common/Image.h"
 #include <cmath>
 #include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
 
 namespace LibTIM
@@ -58,7 +62,7 @@ namespace LibTIM
 		std::fill(temp.begin(), end, value);
 		temp.copy(im, preWidth[0], preWidth[1], preWidth[2]);
 
-		im = temp;
+		im = std::move(temp);
 	}
 
 	//Maybe should be put in another class "Border Image" or something
@@ -104,7 +108,7 @@ namespace LibTIM
 		std::fill(temp.begin(), end, value);
 		temp.copy(im, abs(backOffsets[0]), abs(backOffsets[1]), abs(backOffsets[2]));
 
-		im = temp;
+		im = std::move(temp);
 	}
 
 	///Basic flat-dilation algorithm
@@ -194,68 +198,257 @@ namespace LibTIM
 		return res;
 	}
 
-	template <class T>
-	Image<T> dilationNoBorders(Image<T> im, FlatSE se)
+	///Running minimum or maximum (van Herk / Gil-Werman)
+	/**
+		Computes out[i] = op(in[i], ..., in[i + length - 1]) for i in [0, outSize[ with three
+		applications of op per element, whatever the window length.
+		in must hold outSize + length - 1 values. forward and backward are scratch buffers.
+	**/
+	template <class T, class Op>
+	void runningExtremum(const T* in, T* out, TOffset outSize, TOffset length, Op op,
+	                     std::vector<T>& forward, std::vector<T>& backward)
 	{
-		Image<T> res = im;
+		const TOffset inSize = outSize + length - 1;
+		forward.resize(inSize);
+		backward.resize(inSize);
 
-		//Symmetric of structuring element, according to Heijman's definition of dilation
-		se.makeSymmetric();
-		
-		se.setContext(im.getSize());
+		for (TOffset start = 0; start < inSize; start += length)
+		{
+			const TOffset end = std::min(start + length, inSize);
+			forward[start] = in[start];
+			for (TOffset i = start + 1; i < end; i++)
+				forward[i] = op(forward[i - 1], in[i]);
+			backward[end - 1] = in[end - 1];
+			for (TOffset i = end - 2; i >= start; i--)
+				backward[i] = op(backward[i + 1], in[i]);
+		}
+
+		for (TOffset i = 0; i < outSize; i++)
+			out[i] = op(backward[i], forward[i + length - 1]);
+	}
+
+	///Flat filter with a row-convex 2D structuring element
+	/**
+		Computes res(x,y) = op(im(x+dx, y+dy)) over the points of se lying inside the image
+		(same border handling as erosionNoBorder and dilationNoBorders).
+		Each row of se must be a contiguous segment (balls, rectangles, lines...). Image rows
+		are filtered once per se row with runningExtremum, so the cost per pixel only grows
+		with the height of se. Rectangles (and lines) are filtered separably in constant time.
+		@param neutral The neutral element of op (max value for a min, min value for a max)
+		@return false if se is not supported (3D or not row-convex), res is then untouched
+	**/
+	template <class T, class Op>
+	bool rowConvexFilter(const Image<T>& im, Image<T>& res, const FlatSE& se, Op op, T neutral)
+	{
+		if (im.getSizeZ() != 1 || se.getNbPoints() == 0)
+			return false;
 
+		std::map<TCoord, std::set<TCoord> > rows;
+		for (unsigned long i = 0; i < se.getNbPoints(); i++)
 		{
-			const std::vector points(se.begin_point(), se.end_point());
+			const Point<TCoord> p = se.getPoint(i);
+			if (p.z != 0)
+				return false;
+			rows[p.y].insert(p.x);
+		}
 
-			T min = std::numeric_limits<T>::min();
+		//One segment [dx, dx + length[ per se row
+		struct Segment
+		{
+			TCoord dy;
+			TCoord dx;
+			TOffset length;
+		};
+		std::vector<Segment> segments;
+		for (const auto& row : rows)
+		{
+			const TCoord first = *row.second.begin();
+			const TCoord last = *row.second.rbegin();
+			if (TOffset(last - first + 1) != TOffset(row.second.size()))
+				return false;
+			segments.push_back({row.first, first, last - first + 1});
+		}
 
-#pragma omp parallel for collapse(3)
-			for (int64_t x = 0; x < res.getSizeX(); ++x)
-				for (int64_t y = 0; y < res.getSizeY(); ++y)
-					for (int64_t z = 0; z < res.getSizeZ(); ++z)
-					{
-						T currentMax = min;
-						for (const auto& pt : points)
-						{
-							const TCoord newX = x + pt.x;
-							const TCoord newY = y + pt.y;
-							const TCoord newZ = z + pt.z;
-							if (im.isPosValid(newX, newY, newZ)) {
-								currentMax = std::max(currentMax, im(newX, newY, newZ));
-							}
-						}
-						res(x, y, z) = currentMax;
-					}
+		const TOffset width = im.getSizeX();
+		const TOffset height = im.getSizeY();
+		const TCoord minY = segments.front().dy;
+		const TCoord maxY = segments.back().dy;
+
+		bool rectangle = TOffset(segments.size()) == TOffset(maxY - minY + 1);
+		for (const auto& segment : segments)
+			rectangle = rectangle && segment.dx == segments.front().dx && segment.length == segments.front().length;
+
+		//Filter one line of n values (read with a stride) by the segment [dx, dx + length[
+		const auto filterLine = [&](const T* line, TOffset n, TOffset stride, TCoord dx, TOffset length, T* out,
+		                            std::vector<T>& padded, std::vector<T>& forward, std::vector<T>& backward)
+		{
+			padded.resize(n + length - 1);
+			for (TOffset i = 0; i < n + length - 1; i++)
+			{
+				const TOffset pos = i + dx;
+				padded[i] = (pos >= 0 && pos < n) ? line[pos * stride] : neutral;
+			}
+			runningExtremum(padded.data(), out, n, length, op, forward, backward);
+		};
+
+		const T* source = &im(0);
+		T* result = res.getData();
+
+		if (rectangle)
+		{
+			const Segment& segment = segments.front();
+			Image<T> horizontal(im.getSize());
+			T* temp = horizontal.getData();
+
+#pragma omp parallel
+			{
+				std::vector<T> padded, forward, backward, column, filtered;
+
+#pragma omp for
+				for (TOffset y = 0; y < height; y++)
+					filterLine(source + y * width, width, 1, segment.dx, segment.length, temp + y * width,
+					           padded, forward, backward);
+
+#pragma omp for
+				for (TOffset x = 0; x < width; x++)
+				{
+					filtered.resize(height);
+					filterLine(temp + x, height, width, minY, maxY - minY + 1, filtered.data(), padded, forward,
+					           backward);
+					for (TOffset y = 0; y < height; y++)
+						result[x + y * width] = filtered[y];
+				}
+			}
+			return true;
 		}
 
-		return res;
+#pragma omp parallel
+		{
+			std::vector<T> padded, forward, backward, filtered(width);
+
+#pragma omp for
+			for (TOffset y = 0; y < height; y++)
+			{
+				T* out = result + y * width;
+				std::fill(out, out + width, neutral);
+				for (const auto& segment : segments)
+				{
+					const TOffset sourceY = y + segment.dy;
+					if (sourceY < 0 || sourceY >= height)
+						continue;
+					filterLine(source + sourceY * width, width, 1, segment.dx, segment.length, filtered.data(),
+					           padded, forward, backward);
+					for (TOffset x = 0; x < width; x++)
+						out[x] = op(out[x], filtered[x]);
+				}
+			}
+		}
+		return true;
 	}
 
-	template <class T>
-	Image<T> erosionNoBorder(Image<T> im, FlatSE se)
+	///Flat filter with any structuring element
+	/**
+		Computes res(x,y,z) = op(im(x+dx, y+dy, z+dz)) over the points of se lying inside the image, like
+		rowConvexFilter. Tiles of each slice are filtered in parallel, row by row : on the rows where every point of
+		se stays inside the image, each point is applied to the whole row through a constant offset (a loop the
+		compiler vectorizes), only the pixels near the borders check the points one by one.
+	**/
+	template <class T, class Op>
+	void tiledFlatFilter(const Image<T>& im, Image<T>& res, const FlatSE& se, Op op, T neutral)
 	{
-		Image<T> res = im;
-		se.setContext(im.getSize());
-
-		const std::vector points(se.begin_point(), se.end_point());
-		T max = std::numeric_limits<T>::max();
+		const TCoord sizeX = im.getSizeX();
+		const TCoord sizeY = im.getSizeY();
+		const TCoord sizeZ = im.getSizeZ();
+		std::vector<Point<TCoord> > points;
+		for (unsigned long i = 0; i < se.getNbPoints(); i++)
+			points.push_back(se.getPoint(i));
+
+		TCoord backX = 0, backY = 0, backZ = 0, frontX = 0, frontY = 0, frontZ = 0;
+		std::vector<TOffset> offsets;
+		for (const auto& pt : points)
+		{
+			backX = std::min(backX, pt.x);
+			backY = std::min(backY, pt.y);
+			backZ = std::min(backZ, pt.z);
+			frontX = std::max(frontX, pt.x);
+			frontY = std::max(frontY, pt.y);
+			frontZ = std::max(frontZ, pt.z);
+			offsets.push_back(im.getOffset(pt.x, pt.y, pt.z));
+		}
 
-#pragma omp parallel for collapse(3)
-		for (int64_t x = 0; x < res.getSizeX(); ++x)
-			for (int64_t y = 0; y < res.getSizeY(); ++y)
-				for (int64_t z = 0; z < res.getSizeZ(); ++z)
+		for (TCoord z = 0; z < sizeZ; z++)
+		{
+			const bool insideZ = z + backZ >= 0 && z + frontZ < sizeZ;
+			forEachTile(TileGrid(sizeX, sizeY), [&](const TileRange& tile)
+			{
+				//Pixels of the tile whose whole neighbourhood lies inside the image
+				const TCoord innerX0 = std::clamp(-backX, tile.x0, tile.x1);
+				const TCoord innerX1 = std::clamp(sizeX - frontX, innerX0, tile.x1);
+				const auto filterPixel = [&](T* out, TCoord x, TCoord y)
 				{
-					T currentMin = max;
+					T value = neutral;
 					for (const auto& pt : points)
+						if (im.isPosValid(x + pt.x, y + pt.y, z + pt.z))
+							value = op(value, im.row(y + pt.y, z + pt.z)[x + pt.x]);
+					out[x] = value;
+				};
+
+				for (TCoord y = tile.y0; y < tile.y1; y++)
+				{
+					T* out = res.row(y, z);
+					if (!insideZ || y + backY < 0 || y + frontY >= sizeY)
 					{
-						const TCoord newX = x + pt.x;
-						const TCoord newY = y + pt.y;
-						const TCoord newZ = z + pt.z;
-						if (im.isPosValid(newX, newY, newZ))
-							currentMin = std::min(currentMin, im(newX, newY, newZ));
+						for (TCoord x = tile.x0; x < tile.x1; x++)
+							filterPixel(out, x, y);
+						continue;
 					}
-					res(x, y, z) = currentMin;
+
+					const T* in = im.row(y, z);
+					std::fill(out + innerX0, out + innerX1, neutral);
+					for (const TOffset offset : offsets)
+					{
+						const T* source = in + offset;
+						for (TCoord x = innerX0; x < innerX1; x++)
+							out[x] = op(out[x], source[x]);
+					}
+					for (TCoord x = tile.x0; x < innerX0; x++)
+						filterPixel(out, x, y);
+					for (TCoord x = innerX1; x < tile.x1; x++)
+						filterPixel(out, x, y);
 				}
+			});
+		}
+	}
+
+	template <class T>
+	Image<T> dilationNoBorders(const Image<T>& im, FlatSE se)
+	{
+		//Every pixel of res is written below, no need to copy im
+		Image<T> res(im.getSize());
+		res.setSpacing(im.getSpacingX(), im.getSpacingY(), im.getSpacingZ());
+
+		//Symmetric of structuring element, according to Heijman's definition of dilation
+		se.makeSymmetric();
+
+		if (rowConvexFilter(im, res, se, [](T a, T b) { return std::max(a, b); }, std::numeric_limits<T>::min()))
+			return res;
+		
+		tiledFlatFilter(im, res, se, [](T a, T b) { return std::max(a, b); }, std::numeric_limits<T>::min());
+
+		return res;
+	}
+
+	template <class T>
+	Image<T> erosionNoBorder(const Image<T>& im, FlatSE se)
+	{
+		//Every pixel of res is written below, no need to copy im
+		Image<T> res(im.getSize());
+		res.setSpacing(im.getSpacingX(), im.getSpacingY(), im.getSpacingZ());
+
+		if (rowConvexFilter(im, res, se, [](T a, T b) { return std::min(a, b); }, std::numeric_limits<T>::max()))
+			return res;
+
+		tiledFlatFilter(im, res, se, [](T a, T b) { return std::min(a, b); }, std::numeric_limits<T>::max());
 
 		return res;
 	}
@@ -383,21 +576,93 @@ namespace LibTIM
 		return erosionNoBorder(dilationNoBorders(im, se), se);
 	}
 
+	///Whether se is the 2D N4 neighbourhood of FlatSE::make2DN4 (center excluded), in any order
+	inline bool isN4(const FlatSE& se)
+	{
+		if (se.getNbPoints() != 4)
+			return false;
+		int found = 0;
+		for (unsigned long i = 0; i < 4; i++)
+		{
+			const Point<TCoord> p = se.getPoint(i);
+			if (p.z != 0 || std::abs(p.x) + std::abs(p.y) != 1)
+				return false;
+			found |= 1 << (p.x ? (p.x + 1) / 2 : 2 + (p.y + 1) / 2);
+		}
+		return found == 15;
+	}
+
+	///Row y of the morphological gradient of image with the 2D N4 neighbourhood, written to result
+	/** 
+		Same result as dilationNoBorders - erosionNoBorder with make2DN4 : the row above, the row and
+		the row below are only read once, the max and the min are taken together.
+	**/
+	template <class T>
+	void n4GradientRow(const T* image, T* result, TOffset width, TOffset height, TOffset y)
+	{
+		const T* row = image + y * width;
+		const T* up = y > 0 ? row - width : 0;
+		const T* down = y + 1 < height ? row + width : 0;
+
+		//By value : a border pixel taking the address of width would keep the loop below from being vectorized
+		const auto borderPixel = [=](TOffset x)
+		{
+			T max = std::numeric_limits<T>::min();
+			T min = std::numeric_limits<T>::max();
+			const auto add = [&](T value)
+			{
+				max = std::max(max, value);
+				min = std::min(min, value);
+			};
+			if (up) add(up[x]);
+			if (down) add(down[x]);
+			if (x > 0) add(row[x - 1]);
+			if (x + 1 < width) add(row[x + 1]);
+			result[x] = max - min;
+		};
+
+		if (!up || !down || width < 3)
+		{
+			for (TOffset x = 0; x < width; x++)
+				borderPixel(x);
+			return;
+		}
+		borderPixel(0);
+		for (TOffset x = 1; x < width - 1; x++)
+		{
+			const T max = std::max(std::max(up[x], down[x]), std::max(row[x - 1], row[x + 1]));
+			const T min = std::min(std::min(up[x], down[x]), std::min(row[x - 1], row[x + 1]));
+			result[x] = max - min;
+		}
+		borderPixel(width - 1);
+	}
+
 	///Morphological gradient
 	/** 
-		Computes the morphological gradient (or Beucher gradient)
+		Computes the morphological gradient (or Beucher gradient). The 2D N4 neighbourhood
+		is computed in one pass (see n4GradientRow).
 		@param im The source image (not modified)
 		@param se The structuring element (not modified)
 		@return The morphological gradient of im
 	**/
 
 	template <class T>
-	Image<T> morphologicalGradient(Image<T> im, FlatSE se)
+	Image<T> morphologicalGradient(const Image<T>& im, const FlatSE& se)
 	{
+		if (im.getSizeZ() == 1 && isN4(se))
+		{
+			Image<T> res(im.getSize());
+			res.setSpacing(im.getSpacingX(), im.getSpacingY(), im.getSpacingZ());
+			forEachRow(im.getSizeY(), [&](TCoord y)
+			{
+				n4GradientRow(im.row(0), res.row(y), im.getSizeX(), im.getSizeY(), y);
+			});
+			return res;
+		}
 		Image<T> tmp = erosionNoBorder(im, se);
-		im = dilationNoBorders(im, se);
-		im -= tmp;
-		return im;
+		Image<T> res = dilationNoBorders(im, se);
+		res -= tmp;
+		return res;
 	}
 
 	///Internal morphological gradient
@@ -315,8 +315,7 @@ void seededRegionGrowingExactAlgorithm(Image <T> &im, Image <TLabel> &marker, Fl
 						isContour=true;
 			}
 			//Compute offset in the markerBorder
-			TOffset offset=(it.x+back[0])+(it.y+back[1])*markerBorder.getSizeX()
-			+(it.z+back[2])*markerBorder.getSizeX()*markerBorder.getSizeY();
+			TOffset offset=markerBorder.getOffset(it.x+back[0],it.y+back[1],it.z+back[2]);
 			if(isContour) {	
 				contour++;					
 				imageContourBorder(offset)=true;
@@ -477,8 +476,7 @@ void seededRegionGrowing(Image <T> &img, Image <T2> &marker, FlatSE &se, bool ob
 			//Highest priority for the seeds
 			double value=0.0; 
 			//compute the offset in the border image
-			TOffset offsetBorder=it.x+back[0]+(it.y+back[1])*markerBorder.getSizeX()+
-			(it.z+back[2])*markerBorder.getSizeX()*markerBorder.getSizeY();
+			TOffset offsetBorder=markerBorder.getOffset(it.x+back[0],it.y+back[1],it.z+back[2]);
 			oq.put(value,offsetBorder);
 			
 			imageRegions.setPoint(offsetBorder,*it);
@@ -614,8 +612,7 @@ void seededRegionGrowing0(Image <T> &img, Image <T2> &marker, FlatSE &se, bool o
 			//Highest priority for the seeds
 			double value=0.0; 
 			//compute the offset in the border image
-			TOffset offsetBorder=it.x+back[0]+(it.y+back[1])*markerBorder.getSizeX()+
-			(it.z+back[2])*markerBorder.getSizeX()*markerBorder.getSizeY();
+			TOffset offsetBorder=markerBorder.getOffset(it.x+back[0],it.y+back[1],it.z+back[2]);
 			oq.put(value,offsetBorder);
 			imageRegions.setPoint(offsetBorder,*it);
 			}
@@ -735,8 +732,7 @@ void seededRegionGrowing0(Image <RGB> &img, Image <T2> &marker, FlatSE &se, bool
 			//Highest priority for the seeds
 			double value=0.0; 
 			//compute the offset in the border image
-			TOffset offsetBorder=it.x+back[0]+(it.y+back[1])*markerBorder.getSizeX()+
-			(it.z+back[2])*markerBorder.getSizeX()*markerBorder.getSizeY();
+			TOffset offsetBorder=markerBorder.getOffset(it.x+back[0],it.y+back[1],it.z+back[2]);
 			oq.put(value,offsetBorder);
 			imageRegions.setPoint(offsetBorder,*it);
 			}
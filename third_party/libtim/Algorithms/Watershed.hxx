@@ -42,19 +42,18 @@ namespace LibTIM
 		@param se The connexity used 
 		@param observe If you want to trace the result (for this you must create
 		a directory "Anims") (facultative) 
+		U8 and U16 images are flooded through a HierarchicalQueue (one FIFO per grey level),
+		other types through the generic OrderedQueue. Both give the same labelling.
 	**/
 
 	template <class T>
-	void watershedMeyer(Image<T>& img, Image<TLabel>& marker, FlatSE& se, bool observe = false)
+	void watershedMeyer(const Image<T>& img, Image<TLabel>& marker, FlatSE& se, bool observe = false)
 	{
-		OrderedQueue<TOffset> oq;
+		typename FloodingQueue<TOffset, T>::type oq;
 
 		Image<T> imBorder = img;
 		Image<TLabel> markerBorder = marker;
 
-		typename Image<TLabel>::iteratorXYZ it;
-		typename Image<TLabel>::iteratorXYZ end = marker.end();
-
 		const TCoord* back = se.getNegativeOffsets();
 		const TCoord* front = se.getPositiveOffsets();
 
@@ -69,18 +68,17 @@ namespace LibTIM
 
 		//Put the markers in the queue
 		//For this, we scan the inner part of marker (without the borders)
-		TOffset offset = 0;
-		for (it = marker.begin(); it != end; ++it, offset++)
-		{
-			if (*it != TLabel(0))
+		for (TCoord z = 0; z < marker.getSizeZ(); z++)
+			for (TCoord y = 0; y < marker.getSizeY(); y++)
 			{
-				int value = (int)img(offset);
-				//compute the offset in the border image
-				TOffset offsetBorder = it.x + back[0] + (it.y + back[1]) * markerBorder.getSizeX() +
-					(it.z + back[2]) * markerBorder.getSizeX() * markerBorder.getSizeY();
-				oq.put(value, offsetBorder);
+				const TLabel* labels = marker.row(y, z);
+				const T* values = img.row(y, z);
+				//offset of the row in the border image
+				const TOffset offsetBorder = markerBorder.getOffset(back[0], y + back[1], z + back[2]);
+				for (TCoord x = 0; x < marker.getSizeX(); x++)
+					if (labels[x] != TLabel(0))
+						oq.put((int)values[x], offsetBorder + x);
 			}
-		}
 
 
 		FlatSE::iterator itSe;
@@ -115,12 +113,15 @@ namespace LibTIM
 				}
 			}
 		}
-		//reCrop the marker resulting image
-#pragma omp parallel for collapse(2)
-		for (int64_t x = 0; x < marker.getSizeX(); ++x)
-			for (int64_t y = 0; y < marker.getSizeY(); ++y)
-				for (int64_t z = 0; z < marker.getSizeZ(); ++z)
-					marker(x, y, z) = markerBorder(x + back[0], y + back[1], z + back[2]);
+		//reCrop the marker resulting image, row by row
+		const TCoord rows = marker.getSizeY();
+		forEachRow(rows * marker.getSizeZ(), [&](TCoord row)
+		{
+			const TCoord y = row % rows;
+			const TCoord z = row / rows;
+			const TLabel* source = markerBorder.row(y + back[1], z + back[2]) + back[0];
+			std::copy(source, source + marker.getSizeX(), marker.row(y, z));
+		});
 	}
 
 	/*@}*/
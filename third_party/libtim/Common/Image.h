@@ -23,12 +23,15 @@
 
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <vector>
 #include <stdlib.h>
 
 #include "Types.h"
+#include "ImageMemory.h"
 #include "Point.h"
 #include "OrderedQueue.h"
+#include "Tiles.h"
 
 #define Image_internal_h
 #include "ImageIterators.h"
@@ -104,6 +107,37 @@ namespace LibTIM
 		TSize size[3];
 		TSpacing spacing[3];
 		TOffset dataSize;
+		///The buffer belongs to the caller of borrow() and is never released
+		bool borrowed = false;
+
+		///Buffers are obtained from ImageMemory (and thus from the active ImageBufferPool, if any)
+		static T* allocateBuffer(TOffset n)
+		{
+			T* buffer = static_cast<T*>(ImageMemory::acquire(uint64_t(n) * sizeof(T)));
+			std::uninitialized_default_construct_n(buffer, n);
+			return buffer;
+		}
+
+		static void releaseBuffer(T* buffer, TOffset n)
+		{
+			if (buffer == 0) return;
+			std::destroy_n(buffer, n);
+			ImageMemory::release(buffer, uint64_t(n) * sizeof(T));
+		}
+
+		///Make the buffer hold n elements, keeping the current one when it already has this size
+		void resizeBuffer(TOffset n)
+		{
+			if (this->data != 0 && this->dataSize == n)
+				return;
+			if (!borrowed)
+				releaseBuffer(this->data, this->dataSize);
+			this->data = 0;
+			this->dataSize = 0;
+			this->borrowed = false;
+			this->data = allocateBuffer(n);
+			this->dataSize = n;
+		}
 
 	public:
 		///Image file loader for 2D images
@@ -133,19 +167,35 @@ namespace LibTIM
 		Image(const TSize xSize = 1, const TSize ySize = 1, const TSize zSize = 1);
 		Image(const TSize* size, const TSpacing* spacing, const T* data);
 
-		///Destructor (delete the buffer)
+		///Image over the xSize * ySize * zSize elements of an external buffer, which stays owned by the caller
+		/*! The buffer is written in place (assigning an image of the same size copies into it) and never released.
+		  It is only replaced by an owned buffer when the image is resized or moved into.
+		!*/
+		static Image<T> borrow(T* data, const TSize xSize, const TSize ySize, const TSize zSize = 1);
+
+		///Destructor (delete the buffer, unless it is borrowed)
 		~Image()
 		{
-			if (this->data != 0) delete[] this->data;
+			if (!borrowed)
+				releaseBuffer(this->data, this->dataSize);
 			this->data = 0;
 		}
 
+		///The buffer belongs to the caller of borrow()
+		bool isBorrowed() const { return borrowed; }
+
 		///Copy constructor
 		Image(const Image<T>& im);
 
-		///Assignment operator
+		///Move constructor (steals the buffer, im is left empty)
+		Image(Image<T>&& im) noexcept;
+
+		///Assignment operator (reuses the buffer when sizes match)
 		Image<T>& operator=(const Image<T>& im);
 
+		///Move assignment operator (steals the buffer, im is left empty)
+		Image<T>& operator=(Image<T>&& im) noexcept;
+
 		///Type conversion constructor
 		template <class T2>
 		Image(const Image<T2>& im);
@@ -160,16 +210,9 @@ namespace LibTIM
 			this->size[0] = size[0];
 			this->size[1] = size[1];
 			this->size[2] = size[2];
-			this->dataSize = this->size[0] * this->size[1] * this->size[2];
-			if (this->data != 0)
-			{
-				delete[] this->data;
-				this->data = 0;
-			}
-
 			try
 			{
-				this->data = new T [this->dataSize];
+				resizeBuffer(TOffset(this->size[0]) * this->size[1] * this->size[2]);
 			}
 			catch (std::exception& e)
 			{
@@ -182,15 +225,9 @@ namespace LibTIM
 			this->size[0] = x;
 			this->size[1] = y;
 			this->size[2] = z;
-			this->dataSize = this->size[0] * this->size[1] * this->size[2];
-			if (this->data != 0)
-			{
-				delete[] this->data;
-				this->data = 0;
-			}
 			try
 			{
-				this->data = new T [this->dataSize];
+				resizeBuffer(TOffset(this->size[0]) * this->size[1] * this->size[2]);
 			}
 			catch (std::exception& e)
 			{
@@ -247,7 +284,7 @@ namespace LibTIM
 		{
 			if (x < 0 || x >= size[0] || y < 0 || y >= size[1] || z < 0 || z >= size[2])
 				throw std::out_of_range("Out of range error");
-			return data[x + y * size[0] + z * size[0] * size[1]];
+			return data[getOffset(x, y, z)];
 		}
 
 		///Coordinates read-only version
@@ -255,7 +292,7 @@ namespace LibTIM
 		{
 			if (x < 0 || x >= size[0] || y < 0 || y >= size[1] || z < 0 || z >= size[2])
 				throw std::out_of_range("Out of range error");
-			return data[x + y * size[0] + z * size[0] * size[1]];
+			return data[getOffset(x, y, z)];
 		}
 
 		///Offset write version
@@ -264,12 +301,16 @@ namespace LibTIM
 		///Offset read-only version
 		inline const T& operator()(TOffset offset) const { return data[offset]; }
 
+		///First pixel of row y of slice z, the pixels of a row being contiguous (not checked)
+		inline T* row(TCoord y, TCoord z = 0) { return data + getOffset(0, y, z); }
+		inline const T* row(TCoord y, TCoord z = 0) const { return data + getOffset(0, y, z); }
+
 		///Point write version
 		inline T& operator()(Point<TCoord> p)
 		{
 			if (p.x < 0 || p.x >= size[0] || p.y < 0 || p.y >= size[1] || p.z < 0 || p.z >= size[2])
 				throw std::out_of_range("Out of range error");
-			return data[p.x + p.y * size[0] + p.z * size[0] * size[1]];
+			return data[getOffset(p)];
 		}
 
 		///Point read-only version
@@ -277,7 +318,7 @@ namespace LibTIM
 		{
 			if (p.x < 0 || p.x >= size[0] || p.y < 0 || p.y >= size[1] || p.z < 0 || p.z >= size[2])
 				throw std::out_of_range("Out of range error");
-			return data[p.x + p.y * size[0] + p.z * size[0] * size[1]];
+			return data[getOffset(p)];
 		}
 
 		///Operators overloading
@@ -341,16 +382,20 @@ namespace LibTIM
 
 		void enlarge();
 
-		int getOffset(TCoord x, TCoord y = 0, TCoord z = 0) { return x + y * size[0] + z * size[0] * size[1]; }
+		TOffset getOffset(TCoord x, TCoord y = 0, TCoord z = 0) const
+		{
+			return x + TOffset(y) * size[0] + TOffset(z) * size[0] * size[1];
+		}
 
-		int getOffset(Point<TCoord> p) { return p.x + p.y * size[0] + p.z * size[0] * size[1]; }
+		TOffset getOffset(Point<TCoord> p) const { return getOffset(p.x, p.y, p.z); }
 
 		const Point<TCoord> getCoord(TOffset offset) const
 		{
 			Point<TCoord> res;
-			res.z = (int)(offset / (getSizeX() * getSizeY()));
-			res.y = (offset % (getSizeX() * getSizeY())) / getSizeX();
-			res.x = offset % getSizeX();
+			const TOffset sliceSize = TOffset(getSizeX()) * getSizeY();
+			res.z = TCoord(offset / sliceSize);
+			res.y = TCoord((offset % sliceSize) / getSizeX());
+			res.x = TCoord(offset % getSizeX());
 			return res;
 		}
 
@@ -19,6 +19,7 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 
 namespace LibTIM {
 
@@ -54,9 +55,9 @@ Image<T>::Image(const TSize *size)
 		this->spacing[i] = 1.0;
 	}
 	
-	this->dataSize=this->size[0]*this->size[1]*this->size[2];
+	this->dataSize=TOffset(this->size[0])*this->size[1]*this->size[2];
 	try {
-		this->data = new T [this->dataSize];
+		this->data = allocateBuffer(this->dataSize);
 		}
 	catch (std::exception &e)
 		{
@@ -78,9 +79,9 @@ Image<T>::Image(const TSize xSize, const TSize ySize, const TSize zSize)
 		this->spacing[i] = 1.0;
 	}
 	
-	this->dataSize=this->size[0]*this->size[1]*this->size[2];
+	this->dataSize=TOffset(this->size[0])*this->size[1]*this->size[2];
 	try {
-		this->data = new T [this->dataSize];
+		this->data = allocateBuffer(this->dataSize);
 		}
 	catch (std::exception &e)
 		{
@@ -96,10 +97,10 @@ Image<T>::Image(const TSize *size, const TSpacing *spacing, const T *data)
 {
 	for (int i = 0; i < 3; i++) this->size[i] = size[i];
 	for (int i = 0; i < 3; i++) this->spacing[i] = spacing[i];
-	this->dataSize=this->size[0]*this->size[1]*this->size[2];
+	this->dataSize=TOffset(this->size[0])*this->size[1]*this->size[2];
 	
 	try {
-		this->data=new T [this->dataSize];
+		this->data=allocateBuffer(this->dataSize);
 		}
 	catch(std::exception & e)
   		{
@@ -107,7 +108,21 @@ Image<T>::Image(const TSize *size, const TSpacing *spacing, const T *data)
     	exit(-1);
   		}
 	
-	for(int i=0; i<this->dataSize; i++) this->data[i]=data[i];
+	std::copy(data, data + this->dataSize, this->data);
+}
+
+template <class T>
+Image<T> Image<T>::borrow(T *data, const TSize xSize, const TSize ySize, const TSize zSize)
+{
+	Image<T> im(0, 0, 0);
+	releaseBuffer(im.data, im.dataSize);
+	im.size[0] = xSize;
+	im.size[1] = ySize;
+	im.size[2] = zSize;
+	im.data = data;
+	im.dataSize = TOffset(xSize)*ySize*zSize;
+	im.borrowed = true;
+	return im;
 }
 
 //Copy ctor
@@ -117,9 +132,9 @@ Image<T>::Image(const Image<T> &im)
 	for (int i = 0; i < 3; i++) this->size[i] = im.size[i];
 	for (int i = 0; i < 3; i++) this->spacing[i] = im.spacing[i];
 	
-	dataSize=im.size[0]*im.size[1]*im.size[2];
+	dataSize=TOffset(im.size[0])*im.size[1]*im.size[2];
 	try {
-		this->data=new T [this->dataSize];
+		this->data=allocateBuffer(this->dataSize);
 		}
 	catch(std::exception & e)
   		{
@@ -127,8 +142,23 @@ Image<T>::Image(const Image<T> &im)
     	exit(-1);
   		}
 
-	for (int i=0; i<this->dataSize; i++)
-		data[i] = im.data[i];
+	std::copy(im.data, im.data + this->dataSize, this->data);
+}
+
+//Move ctor
+template <class T>
+Image<T>::Image(Image<T> &&im) noexcept
+{
+	for (int i = 0; i < 3; i++) this->size[i] = im.size[i];
+	for (int i = 0; i < 3; i++) this->spacing[i] = im.spacing[i];
+	this->data = im.data;
+	this->dataSize = im.dataSize;
+	this->borrowed = im.borrowed;
+
+	for (int i = 0; i < 3; i++) im.size[i] = 0;
+	im.data = 0;
+	im.dataSize = 0;
+	im.borrowed = false;
 }
 
 //Assignment operator
@@ -139,14 +169,8 @@ Image <T> & Image<T>::operator=(const Image <T> &im)
 		{
 		for (int i = 0; i < 3; i++) this->size[i] = im.size[i];
 		for (int i = 0; i < 3; i++) this->spacing[i] = im.spacing[i];
-		if(this->data != 0)
-			{
-			delete[] this->data;
-			this->data=0;
-			}
-		this->dataSize=im.size[0]*im.size[1]*im.size[2];
 		try {
-			this->data=new T [this->dataSize];
+			resizeBuffer(im.dataSize);
 			}
 		catch(std::exception & e)
   			{
@@ -154,8 +178,30 @@ Image <T> & Image<T>::operator=(const Image <T> &im)
     		exit(-1);
   			}
 
-		for (int i=0; i<this->dataSize; i++)
-			this->data[i] = im.data[i];
+		std::copy(im.data, im.data + this->dataSize, this->data);
+		}
+	return *this;
+}
+
+//Move assignment operator
+template <class T>
+Image <T> & Image<T>::operator=(Image <T> &&im) noexcept
+{
+	if(this != &im)
+		{
+		if (!borrowed)
+			releaseBuffer(this->data, this->dataSize);
+
+		for (int i = 0; i < 3; i++) this->size[i] = im.size[i];
+		for (int i = 0; i < 3; i++) this->spacing[i] = im.spacing[i];
+		this->data = im.data;
+		this->dataSize = im.dataSize;
+		this->borrowed = im.borrowed;
+
+		for (int i = 0; i < 3; i++) im.size[i] = 0;
+		im.data = 0;
+		im.dataSize = 0;
+		im.borrowed = false;
 		}
 	return *this;
 }
@@ -175,9 +221,9 @@ Image<T>::Image( const Image<T2> &im)
 	this->spacing[1]=im.getSpacingY();
 	this->spacing[2]=im.getSpacingZ();
 	
-	this->dataSize=this->size[0]*this->size[1]*this->size[2];
+	this->dataSize=TOffset(this->size[0])*this->size[1]*this->size[2];
 	try {
-		this->data=new T [this->dataSize];
+		this->data=allocateBuffer(this->dataSize);
 		}
 	catch(std::exception & e)
   		{
@@ -310,17 +356,17 @@ void Image<VoxelType>::copy(Image<VoxelType> &im,
 		                     int x2, int y2, int z2,
 			                 int px, int py, int pz)
 {
-#pragma omp parallel for collapse(3)
-	for (int x = 0; x <= x2-x1; x++)
+	//One contiguous segment per row of the copied box
+	const TCoord rows = y2 - y1 + 1;
+	const TCoord length = x2 - x1 + 1;
+	assert(isPosValid(px, py, pz) && isPosValid(px + x2 - x1, py + y2 - y1, pz + z2 - z1));
+	forEachRow(rows * (z2 - z1 + 1), [&](TCoord row)
 	{
-		for (int y = 0; y <= y2-y1; y++)
-		{
-			for (int z = 0; z <= z2-z1; z++)
-			{				
-				this->operator()(px + x, py + y, pz + z)=im(x + x1, y + y1, z + z1);
-			}
-		}
-	}
+		const TCoord y = row % rows;
+		const TCoord z = row / rows;
+		const VoxelType* source = im.row(y1 + y, z1 + z) + x1;
+		std::copy(source, source + length, this->row(py + y, pz + z) + px);
+	});
 }
 
 template <class VoxelType> 
@@ -23,6 +23,8 @@
 #include <sstream>
 #include <stdlib.h>
 
+#include "ImageMapping.h"
+
 namespace LibTIM {
     
     inline std::string  GImageIO_NextLine(std::ifstream &file)
@@ -63,46 +65,49 @@ namespace LibTIM {
         str_stream>> colormax;
     }
     
-    template <>
-    inline int Image<U8>::load(const char*filename, Image <U8> &im)
+    ///Binary pgm (U8) / ppm (RGB) loader : the file is mapped in memory and its pixels copied in parallel
+    template <class T>
+    inline int GImageIO_LoadMapped(const char *filename, Image <T> &im)
     {
-        std::ifstream file(filename,std::ios_base::in  | std::ios_base::binary);
-        if(!file)
-        {
-            throw std::runtime_error("Image file I/O error\n");
-        }
-        std::string format;
-        unsigned int width,height,colormax;
+        MappedFile file(filename);
+        PNMHeader header;
         
-        GImageIO_ReadPPMHeader(file,format,width,height,colormax);
-        
-        if(format!="P5" || colormax >=256)
+        if(!readPNMHeader(file.data(),file.size(),header) || header.format!=PNMFormat<T>::name() || header.colormax>=256)
         {
             std::cerr<< "Error: either type mismatch image type or image is in ASCII .ppm format" << std::endl;
-            std::cerr << "format = " << format << std::endl;
-            std::cerr << "colormax = " << colormax << std::endl;
-            file.close();
+            std::cerr << "format = " << header.format << std::endl;
+            std::cerr << "colormax = " << header.colormax << std::endl;
             return 0;
         }
-        else {
-            if(im.data!=0) delete[] im.data;
-            
-            im.size[0] = width;
-            im.size[1] = height;
-            im.size[2] = 1;
-            im.dataSize=width*height*1;
-            
-            for (int i = 0; i < 3; i++)
-            {
-                im.spacing[i] = 1.0;
-            }
-            im.data = new U8 [im.dataSize];
-            file.read(reinterpret_cast<char *> (im.data),im.dataSize);
+        
+        const uint64_t bufSize=uint64_t(header.width)*header.height*sizeof(T);
+        if(header.dataOffset+bufSize>file.size())
+        {
+            std::cerr<< "Error: " << filename << " is truncated" << std::endl;
+            return 0;
         }
-        file.close();
+        
+        im.setSize(header.width,header.height,1);
+        im.setSpacing(1.0,1.0,1.0);
+        parallelCopy(im.getData(),file.data()+header.dataOffset,bufSize);
         return 1;
     }
     
+    ///Binary pgm (U8) / ppm (RGB) writer : the file is created at its final size, mapped, and filled in parallel
+    template <class T>
+    inline int GImageIO_SaveMapped(const char *filename, const Image <T> &im)
+    {
+        MappedImageWriter<T> file(filename,im.getSizeX(),im.getSizeY());
+        file.write(&im(0),0,TOffset(im.getSizeX())*im.getSizeY());
+        return 1;
+    }
+    
+    template <>
+    inline int Image<U8>::load(const char*filename, Image <U8> &im)
+    {
+        return GImageIO_LoadMapped(filename, im);
+    }
+    
     template <>
     inline int Image<U16>::load(const char*filename, Image <U16> &im)
     {
@@ -123,7 +128,8 @@ namespace LibTIM {
             return 0;
         }
         else {
-            if(im.data!=(U16*)(0)) delete[] im.data;
+            releaseBuffer(im.data, im.dataSize);
+            im.data = 0;
             
             im.size[0] = width;
             im.size[1] = height;
@@ -133,7 +139,7 @@ namespace LibTIM {
             {
                 im.spacing[i] = 1.0;
             }
-            im.data = new U16 [im.dataSize];
+            im.data = allocateBuffer(im.dataSize);
             file.read(reinterpret_cast<char *> (im.data),im.dataSize);
         }
         file.close();
@@ -143,38 +149,7 @@ namespace LibTIM {
     template <>
     inline int Image<RGB>::load(const char*filename, Image <RGB> &im)
     {
-        std::ifstream file(filename,std::ios_base::in  | std::ios_base::binary);
-        if(!file)
-        {
-            throw std::runtime_error("Image file I/O error\n");
-        }
-        std::string format;
-        unsigned int width,height,colormax;
-        
-        GImageIO_ReadPPMHeader(file,format,width,height,colormax);
-        
-        if(format!="P6" || colormax>=256)
-        {
-            std::cerr<< "Error: either type mismatch image type or image is in ASCII .ppm format\n";
-            file.close();
-            return 0;
-        }
-        else {
-            if(im.data!=(RGB*)(0)) delete[] im.data;
-            
-            im.size[0] = width;
-            im.size[1] = height;
-            im.size[2] = 1;
-            im.dataSize=width*height;
-            for (int i = 0; i < 3; i++)
-            {
-                im.spacing[i] = 1.0;
-            }
-            im.data = new RGB [im.dataSize];
-            file.read(reinterpret_cast<char *> (im.data),im.dataSize*3);
-        }
-        file.close();
-        return 1;
+        return GImageIO_LoadMapped(filename, im);
     }
     
     
@@ -182,30 +157,7 @@ namespace LibTIM {
     ///Pgm writer
     template <>
     inline int Image <U8>::save( const char *filename) {
-        std::ofstream file(filename,std::ios_base::trunc  | std::ios_base::binary);
-        if(!file)
-        {
-            throw std::runtime_error("Image file I/O error\n");
-        }
-        
-        std::string str;
-        std::string format;
-        
-        int width=getSizeX();
-        int height=getSizeY();
-        
-        int buf_size = width*height;
-                
-        file << "P5\n#CREATOR: GImage \n" << width << " " << height << "\n" << "255" ;
-        file << "\n";
-        
-        file.write(reinterpret_cast<char *> (this->data),buf_size);
-        
-        file << "\n";
-        
-        file.close();
-        
-        return 1;
+        return GImageIO_SaveMapped(filename, *this);
     }
     
     ///Pgm writer
@@ -240,40 +192,7 @@ namespace LibTIM {
     
     template <>
     inline int Image <RGB>::save( const char *filename) {
-        std::ofstream file(filename,std::ios_base::trunc  | std::ios_base::binary);
-        if(!file)
-        {
-            throw std::runtime_error("Image file I/O error\n");
-        }
-        
-        std::string str;
-        std::string format;
-        
-        int width=getSizeX();
-        int height=getSizeY();
-        
-        int buf_size = width*height*3;
-        
-        file << "P6\n#CREATOR: GImage \n" << width << " " << height << "\n" << "255\n" ;
-        
-        U8 *buf=new U8[width*height*3];
-        
-        for(int i=0; i<width*height; i++)
-        {
-            buf[i*3]=(*this)(i)[0];
-            buf[i*3+1]=(*this)(i)[1];
-            buf[i*3+2]=(*this)(i)[2];
-        }
-        
-        file.write(reinterpret_cast<char *> (buf),buf_size);
-        
-        file << "\n";
-        
-        file.close();
-        
-        delete[] buf;
-        
-        return 1;
+        return GImageIO_SaveMapped(filename, *this);
     }
     
 }
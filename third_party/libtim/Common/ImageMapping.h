@@ -0,0 +1,326 @@
+/*
+ * This file is part of libTIM.
+ *
+ * Copyright (©) 2005-2013  Benoit Naegel
+ * Copyright (©) 2013 Theo de Carpentier
+ *
+ * libTIM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libTIM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/gpl>.
+ */
+
+#ifndef ImageMapping_h
+#define ImageMapping_h
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Types.h"
+
+namespace LibTIM
+{
+	/** \defgroup ImageMapping Memory-mapped image files
+		\ingroup DataStructures
+	**/
+
+	/*@{*/
+
+	///A whole file mapped in memory
+	/** Either an existing file mapped read-only, or a file created at a given size and mapped read-write.
+	**/
+	class MappedFile
+	{
+	public:
+		MappedFile() { }
+
+		///Map an existing file (read-only)
+		explicit MappedFile(const char* filename) { open(filename, 0, false); }
+
+		///Create (or truncate) a file of size bytes and map it read-write
+		MappedFile(const char* filename, uint64_t size) { open(filename, size, true); }
+
+		~MappedFile() { close(); }
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+
+		MappedFile& operator=(MappedFile&& other) noexcept
+		{
+			if (this != &other)
+			{
+				close();
+				std::swap(m_data, other.m_data);
+				std::swap(m_size, other.m_size);
+#if defined(_WIN32)
+				std::swap(m_file, other.m_file);
+				std::swap(m_mapping, other.m_mapping);
+#endif
+			}
+			return *this;
+		}
+
+		const unsigned char* data() const { return m_data; }
+		unsigned char* data() { return m_data; }
+		uint64_t size() const { return m_size; }
+
+		///Unmap the file (written pages are flushed by the system)
+		void close()
+		{
+#if defined(_WIN32)
+			if (m_data != 0) UnmapViewOfFile(m_data);
+			if (m_mapping != 0) CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+			m_mapping = 0;
+			m_file = INVALID_HANDLE_VALUE;
+#else
+			if (m_data != 0) munmap(m_data, m_size);
+#endif
+			m_data = 0;
+			m_size = 0;
+		}
+
+	private:
+		void open(const char* filename, uint64_t size, bool writable)
+		{
+#if defined(_WIN32)
+			m_file = CreateFileA(filename, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+			                     writable ? 0 : FILE_SHARE_READ, 0, writable ? CREATE_ALWAYS : OPEN_EXISTING,
+			                     FILE_ATTRIBUTE_NORMAL, 0);
+			if (m_file == INVALID_HANDLE_VALUE)
+				throw std::runtime_error(std::string("MappedFile : could not open ") + filename);
+			if (!writable)
+			{
+				LARGE_INTEGER fileSize;
+				GetFileSizeEx(m_file, &fileSize);
+				size = uint64_t(fileSize.QuadPart);
+			}
+			m_size = size;
+			if (size == 0) return;
+			m_mapping = CreateFileMappingA(m_file, 0, writable ? PAGE_READWRITE : PAGE_READONLY, DWORD(size >> 32),
+			                               DWORD(size & 0xFFFFFFFF), 0);
+			if (m_mapping != 0)
+				m_data = static_cast<unsigned char*>(MapViewOfFile(m_mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+				                                                   0, 0, 0));
+			if (m_data == 0)
+			{
+				close();
+				throw std::runtime_error(std::string("MappedFile : could not map ") + filename);
+			}
+#else
+			const int fd = writable ? ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644) : ::open(filename, O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error(std::string("MappedFile : could not open ") + filename);
+			if (writable)
+			{
+				if (ftruncate(fd, off_t(size)) != 0)
+				{
+					::close(fd);
+					throw std::runtime_error(std::string("MappedFile : could not allocate ") + filename);
+				}
+			}
+			else
+			{
+				struct stat status;
+				fstat(fd, &status);
+				size = uint64_t(status.st_size);
+			}
+			if (size != 0)
+			{
+				void* data = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+				if (data == MAP_FAILED)
+				{
+					::close(fd);
+					throw std::runtime_error(std::string("MappedFile : could not map ") + filename);
+				}
+				m_data = static_cast<unsigned char*>(data);
+				m_size = size;
+			}
+			//The mapping stays valid once the descriptor is closed
+			::close(fd);
+#endif
+		}
+
+		unsigned char* m_data = 0;
+		uint64_t m_size = 0;
+#if defined(_WIN32)
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = 0;
+#endif
+	};
+
+	///Copy bytes from src to dst, large copies are split between threads
+	inline void parallelCopy(void* dst, const void* src, uint64_t bytes)
+	{
+		const int64_t chunk = 1 << 20;
+		const int64_t chunks = int64_t((bytes + chunk - 1) / chunk);
+#pragma omp parallel for if (chunks > 1)
+		for (int64_t i = 0; i < chunks; i++)
+		{
+			const uint64_t begin = uint64_t(i * chunk);
+			memcpy(static_cast<char*>(dst) + begin, static_cast<const char*>(src) + begin,
+			       std::min<uint64_t>(chunk, bytes - begin));
+		}
+	}
+
+	///Header of a binary pgm / ppm file
+	struct PNMHeader
+	{
+		std::string format;
+		unsigned int width = 0;
+		unsigned int height = 0;
+		unsigned int colormax = 0;
+		///Offset of the first pixel in the file
+		uint64_t dataOffset = 0;
+	};
+
+	///Parse a pnm header from memory (same rules as GImageIO_ReadPPMHeader : '#' comments run to the end of the line,
+	///the pixels start one character after the last field)
+	inline bool readPNMHeader(const unsigned char* data, uint64_t size, PNMHeader& header)
+	{
+		uint64_t pos = 0;
+		const auto isSpace = [](unsigned char c)
+		{
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+		};
+		const auto nextToken = [&](std::string& token)
+		{
+			for (;;)
+			{
+				while (pos < size && isSpace(data[pos])) pos++;
+				if (pos < size && data[pos] == '#')
+				{
+					while (pos < size && data[pos] != '\n') pos++;
+					continue;
+				}
+				break;
+			}
+			token.clear();
+			while (pos < size && !isSpace(data[pos])) token += char(data[pos++]);
+			//For the separator after the ASCII string ('\n' or ' ')
+			if (pos < size) pos++;
+			return !token.empty();
+		};
+
+		std::string width, height, colormax;
+		if (!nextToken(header.format) || !nextToken(width) || !nextToken(height) || !nextToken(colormax))
+			return false;
+		header.width = unsigned(strtoul(width.c_str(), 0, 10));
+		header.height = unsigned(strtoul(height.c_str(), 0, 10));
+		header.colormax = unsigned(strtoul(colormax.c_str(), 0, 10));
+		header.dataOffset = pos;
+		return true;
+	}
+
+	///Binary pnm format storing pixels of type T
+	template <class T> struct PNMFormat;
+	template <> struct PNMFormat<U8> { static const char* name() { return "P5"; } };
+	template <> struct PNMFormat<RGB> { static const char* name() { return "P6"; } };
+
+	///Read-only view on the pixels of a binary pgm (U8) or ppm (RGB) file, without any copy
+	/** \verbatim
+		MappedImage<RGB> im("myFile.ppm");
+		RGB pixel = im(x, y);
+		\endverbatim
+	**/
+	template <class T>
+	class MappedImage
+	{
+	public:
+		explicit MappedImage(const char* filename) : m_file(filename)
+		{
+			PNMHeader header;
+			if (!readPNMHeader(m_file.data(), m_file.size(), header) || header.format != PNMFormat<T>::name() ||
+				header.colormax >= 256)
+				throw std::runtime_error(std::string("MappedImage : ") + filename + " is not a binary " +
+				                         PNMFormat<T>::name() + " file with 8 bits samples");
+			if (header.dataOffset + uint64_t(header.width) * header.height * sizeof(T) > m_file.size())
+				throw std::runtime_error(std::string("MappedImage : ") + filename + " is truncated");
+			m_size[0] = TSize(header.width);
+			m_size[1] = TSize(header.height);
+			m_size[2] = 1;
+			m_data = reinterpret_cast<const T*>(m_file.data() + header.dataOffset);
+		}
+
+		const TSize* getSize() const { return m_size; }
+		TSize getSizeX() const { return m_size[0]; }
+		TSize getSizeY() const { return m_size[1]; }
+		TSize getSizeZ() const { return m_size[2]; }
+		TOffset getBufSize() const { return TOffset(m_size[0]) * m_size[1]; }
+
+		const T* getData() const { return m_data; }
+		const T& operator()(TOffset offset) const { return m_data[offset]; }
+		const T& operator()(TCoord x, TCoord y) const { return m_data[x + TOffset(y) * m_size[0]]; }
+
+	private:
+		MappedFile m_file;
+		const T* m_data;
+		TSize m_size[3];
+	};
+
+	///Binary pgm (U8) or ppm (RGB) file created at its final size, pixels are written in place
+	/** The layout is the one of Image<T>::save. Pixels can be filled in any order (rows of a band, several threads...),
+		the file is complete when the writer is destroyed.
+	**/
+	template <class T>
+	class MappedImageWriter
+	{
+	public:
+		MappedImageWriter(const char* filename, TSize width, TSize height)
+		{
+			const std::string header = std::string(PNMFormat<T>::name()) + "\n#CREATOR: GImage \n" +
+				std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+			const uint64_t dataSize = uint64_t(width) * height * sizeof(T);
+			m_file = MappedFile(filename, header.size() + dataSize + 1);
+			memcpy(m_file.data(), header.data(), header.size());
+			m_file.data()[header.size() + dataSize] = '\n';
+			m_data = reinterpret_cast<T*>(m_file.data() + header.size());
+			m_width = width;
+		}
+
+		T* getData() { return m_data; }
+		T* getRow(TCoord y) { return m_data + TOffset(y) * m_width; }
+
+		///Copy count pixels at offset, in parallel
+		void write(const T* pixels, TOffset offset, TOffset count)
+		{
+			parallelCopy(m_data + offset, pixels, uint64_t(count) * sizeof(T));
+		}
+
+	private:
+		MappedFile m_file;
+		T* m_data;
+		TSize m_width;
+	};
+
+	/*@}*/
+}
+
+#endif
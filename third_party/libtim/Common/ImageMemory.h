@@ -0,0 +1,269 @@
+/*
+ * This file is part of libTIM.
+ *
+ * Copyright (©) 2005-2013  Benoit Naegel
+ * Copyright (©) 2013 Theo de Carpentier
+ *
+ * libTIM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libTIM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/gpl>.
+ */
+
+#ifndef ImageMemory_h
+#define ImageMemory_h
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace LibTIM
+{
+	/** \defgroup ImageMemory Image buffers allocation
+		\ingroup DataStructures
+	**/
+
+	/*@{*/
+
+	///Image buffers allocation counters
+	struct ImageMemoryStats
+	{
+		///Buffers obtained from the system allocator
+		uint64_t allocations = 0;
+		uint64_t allocatedBytes = 0;
+		///Allocations of at least ImageMemory::largeAllocation bytes
+		uint64_t largeAllocations = 0;
+		///Buffers served by an ImageBufferPool instead of the system allocator
+		uint64_t reuses = 0;
+		uint64_t reusedBytes = 0;
+		///Buffers freed by an ImageBufferPool to stay under its capacity
+		uint64_t evictions = 0;
+		uint64_t evictedBytes = 0;
+	};
+
+	class ImageBufferPool;
+
+	///Allocator of every Image<T> buffer
+	/** Buffers come from the system allocator, or from the active ImageBufferPool when there is one.
+		Every call is counted, see stats().
+	**/
+	class ImageMemory
+	{
+	public:
+		static const uint64_t largeAllocation = 1 << 20;
+
+		static void* acquire(uint64_t bytes);
+		static void release(void* buffer, uint64_t bytes);
+
+		///Counters since the start of the program (or the last resetStats())
+		static ImageMemoryStats stats()
+		{
+			ImageMemoryStats result;
+			result.allocations = counters().allocations;
+			result.allocatedBytes = counters().allocatedBytes;
+			result.largeAllocations = counters().largeAllocations;
+			result.reuses = counters().reuses;
+			result.reusedBytes = counters().reusedBytes;
+			result.evictions = counters().evictions;
+			result.evictedBytes = counters().evictedBytes;
+			return result;
+		}
+
+		static void resetStats()
+		{
+			counters().allocations = 0;
+			counters().allocatedBytes = 0;
+			counters().largeAllocations = 0;
+			counters().reuses = 0;
+			counters().reusedBytes = 0;
+			counters().evictions = 0;
+			counters().evictedBytes = 0;
+		}
+
+	private:
+		friend class ImageBufferPool;
+
+		struct Counters
+		{
+			std::atomic<uint64_t> allocations{0};
+			std::atomic<uint64_t> allocatedBytes{0};
+			std::atomic<uint64_t> largeAllocations{0};
+			std::atomic<uint64_t> reuses{0};
+			std::atomic<uint64_t> reusedBytes{0};
+			std::atomic<uint64_t> evictions{0};
+			std::atomic<uint64_t> evictedBytes{0};
+		};
+
+		static Counters& counters()
+		{
+			static Counters instance;
+			return instance;
+		}
+
+		static std::mutex& poolMutex()
+		{
+			static std::mutex instance;
+			return instance;
+		}
+
+		static ImageBufferPool*& activePool()
+		{
+			static ImageBufferPool* instance = nullptr;
+			return instance;
+		}
+	};
+
+	///Recycles image buffers of identical byte size
+	/** While an ImageBufferPool is alive, released image buffers are kept instead of being freed,
+		and the next image of the same byte size takes one of them back. Processing several
+		images of the same size inside one pool therefore stops allocating after the first one.
+		The pool holds at most capacity bytes: the buffers of the sizes least recently released or
+		reused are freed first to make room, and a buffer larger than the capacity is never kept.
+		The pool is shared by every thread (OpenMP workers, loader and saver threads release and
+		reuse the same buffers). Pools nest: the innermost one is used, and they must be destroyed
+		in the reverse order of their construction. Cached buffers are freed with the pool.
+		\verbatim
+		ImageBufferPool pool;
+		for (...) process(image); // same-sized intermediates are recycled
+		\endverbatim
+	**/
+	class ImageBufferPool
+	{
+	public:
+		static const uint64_t defaultCapacity = uint64_t(1) << 30;
+
+		explicit ImageBufferPool(uint64_t _capacity = defaultCapacity) : capacity(_capacity)
+		{
+			std::lock_guard<std::mutex> lock(ImageMemory::poolMutex());
+			previous = ImageMemory::activePool();
+			ImageMemory::activePool() = this;
+		}
+
+		~ImageBufferPool()
+		{
+			std::lock_guard<std::mutex> lock(ImageMemory::poolMutex());
+			assert(ImageMemory::activePool() == this && "ImageBufferPool destroyed out of order");
+			ImageMemory::activePool() = previous;
+			for (auto& bucket : buffers)
+				for (void* buffer : bucket.second.buffers)
+					::operator delete(buffer);
+		}
+
+		ImageBufferPool(const ImageBufferPool&) = delete;
+		ImageBufferPool& operator=(const ImageBufferPool&) = delete;
+
+		///Bytes currently held by the pool
+		uint64_t cachedBytes() const
+		{
+			std::lock_guard<std::mutex> lock(ImageMemory::poolMutex());
+			return cached;
+		}
+
+	private:
+		friend class ImageMemory;
+
+		struct Bucket
+		{
+			std::vector<void*> buffers;
+			///Value of clock when a buffer of this size was last released or reused
+			uint64_t lastUse = 0;
+		};
+
+		///Keep buffer (called with the pool mutex held), or free it when it does not fit
+		void keep(void* buffer, uint64_t bytes)
+		{
+			if (bytes > capacity)
+			{
+				::operator delete(buffer);
+				return;
+			}
+			while (cached + bytes > capacity)
+			{
+				std::map<uint64_t, Bucket>::iterator oldest = buffers.end();
+				for (std::map<uint64_t, Bucket>::iterator bucket = buffers.begin(); bucket != buffers.end(); ++bucket)
+					if (!bucket->second.buffers.empty() && (oldest == buffers.end() ||
+						bucket->second.lastUse < oldest->second.lastUse))
+						oldest = bucket;
+				::operator delete(oldest->second.buffers.back());
+				oldest->second.buffers.pop_back();
+				cached -= oldest->first;
+				ImageMemory::counters().evictions++;
+				ImageMemory::counters().evictedBytes += oldest->first;
+			}
+			Bucket& bucket = buffers[bytes];
+			bucket.buffers.push_back(buffer);
+			bucket.lastUse = ++clock;
+			cached += bytes;
+		}
+
+		///Cached buffer of bytes bytes, null if none (called with the pool mutex held)
+		void* take(uint64_t bytes)
+		{
+			std::map<uint64_t, Bucket>::iterator bucket = buffers.find(bytes);
+			if (bucket == buffers.end() || bucket->second.buffers.empty())
+				return 0;
+			void* buffer = bucket->second.buffers.back();
+			bucket->second.buffers.pop_back();
+			bucket->second.lastUse = ++clock;
+			cached -= bytes;
+			return buffer;
+		}
+
+		ImageBufferPool* previous;
+		uint64_t capacity;
+		uint64_t cached = 0;
+		uint64_t clock = 0;
+		std::map<uint64_t, Bucket> buffers;
+	};
+
+	inline void* ImageMemory::acquire(uint64_t bytes)
+	{
+		{
+			std::lock_guard<std::mutex> lock(poolMutex());
+			if (ImageBufferPool* pool = activePool())
+				if (void* buffer = pool->take(bytes))
+				{
+					counters().reuses++;
+					counters().reusedBytes += bytes;
+					return buffer;
+				}
+		}
+
+		counters().allocations++;
+		counters().allocatedBytes += bytes;
+		if (bytes >= largeAllocation)
+			counters().largeAllocations++;
+		return ::operator new(bytes);
+	}
+
+	inline void ImageMemory::release(void* buffer, uint64_t bytes)
+	{
+		if (buffer == 0)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(poolMutex());
+			if (ImageBufferPool* pool = activePool())
+			{
+				pool->keep(buffer, bytes);
+				return;
+			}
+		}
+		::operator delete(buffer);
+	}
+
+	/*@}*/
+}
+
+#endif
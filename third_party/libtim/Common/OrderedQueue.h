@@ -22,12 +22,18 @@
 #define OrderedQueue_h
 
 #include <utility>
+#include <cstdint>
+#include <limits>
 #include <functional>
 #include <queue>
 #include <vector>
 #include <set>
 #include <map>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 
 namespace LibTIM {
 /// Ordered Queue 
@@ -106,6 +112,114 @@ class OrderedQueueDouble
 };
 
 
+/// Hierarchical queue (bucket array)
+/** Same contract as OrderedQueue (lowest order first, FIFO inside one order), but
+  with one contiguous FIFO per grey level of TLevel and a moving "current level" cursor.
+  It is meant for small integer level types: U8 uses 256 buckets, U16 65536 buckets.
+  A bitmap of non-empty buckets lets the cursor skip runs of empty levels, which keeps
+  the wide (U16) variant cheap.
+  Emptied buckets keep their capacity, so after warm-up put/get perform no allocation.
+ **/
+template<class T, class TLevel>
+class HierarchicalQueue
+{
+	static const int nbLevels = int(std::numeric_limits<TLevel>::max()) + 1;
+	static const int nbWords = (nbLevels + 63) / 64;
+
+	struct Bucket
+	{
+		std::vector<T> values;
+		size_t head = 0;
+	};
+
+	public:
+	  /// Creates an empty hierarchical queue
+		HierarchicalQueue() : m_buckets(nbLevels), m_used(nbWords, 0), m_current(nbLevels), m_count(0) { }
+		~HierarchicalQueue() { }
+
+		/// add an element in HQ with specified order (must be in [0, max(TLevel)])
+		void put(int order, T _val)
+		{
+			m_buckets[order].values.push_back(_val);
+			m_used[order >> 6] |= uint64_t(1) << (order & 63);
+			if (order < m_current) m_current = order;
+			m_count++;
+		}
+
+		/// get an element in HQ (the first one inserted with the lowest order)
+		T get()
+		{
+			if (m_current >= nbLevels || !(m_used[m_current >> 6] & (uint64_t(1) << (m_current & 63))))
+				m_current = nextUsedLevel(m_current);
+
+			Bucket &b = m_buckets[m_current];
+			T val = b.values[b.head++];
+			if (b.head == b.values.size())
+			{
+				b.values.clear();
+				b.head = 0;
+				m_used[m_current >> 6] &= ~(uint64_t(1) << (m_current & 63));
+			}
+			m_count--;
+			return val;
+		}
+
+		/// bool if HQ is empty
+		bool empty() { return m_count == 0; }
+
+		/// Number of elements in HQ
+		size_t size() const { return m_count; }
+
+	private:
+		/// First non-empty level after 'from' (HQ must not be empty)
+		int nextUsedLevel(int from) const
+		{
+			int word = from >= nbLevels ? 0 : from >> 6;
+			uint64_t bits = from >= nbLevels ? m_used[0] : m_used[word] & (~uint64_t(0) << (from & 63));
+			while (bits == 0)
+				bits = m_used[++word];
+			return (word << 6) + lowestBit(bits);
+		}
+
+		static int lowestBit(uint64_t bits)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward64(&index, bits);
+			return int(index);
+#else
+			return __builtin_ctzll(bits);
+#endif
+		}
+
+		std::vector<Bucket> m_buckets;
+		std::vector<uint64_t> m_used;
+		int m_current;
+		size_t m_count;
+};
+
+/// Queue used by watershed algorithms for a given image type
+/** Defaults to the generic map-based OrderedQueue; small unsigned
+  integer types use a bucket-array HierarchicalQueue instead.
+ **/
+template<class T, class TImage>
+struct FloodingQueue
+{
+	typedef OrderedQueue<T> type;
+};
+
+template<class T>
+struct FloodingQueue<T, unsigned char>
+{
+	typedef HierarchicalQueue<T, unsigned char> type;
+};
+
+template<class T>
+struct FloodingQueue<T, unsigned short>
+{
+	typedef HierarchicalQueue<T, unsigned short> type;
+};
+
 template<class T>
 class Queue
 {
@@ -0,0 +1,127 @@
+/*
+ * This file is part of libTIM.
+ *
+ * Copyright (©) 2005-2013  Benoit Naegel
+ * Copyright (©) 2013 Theo de Carpentier
+ *
+ * libTIM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libTIM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/gpl>.
+ */
+
+#ifndef Tiles_h
+#define Tiles_h
+
+#include <algorithm>
+
+#include "Types.h"
+
+namespace LibTIM
+{
+	/** \defgroup Tiles Cache-blocked traversal
+		\ingroup DataStructures
+		Image<T> stores x fastest : per-pixel kernels walk rows of tiles, through the row pointers of Image<T>::row(),
+		instead of striding through memory a full row at every pixel.
+	**/
+
+	/*@{*/
+
+	///Rectangle [x0, x1[ x [y0, y1[ of an image
+	struct TileRange
+	{
+		TCoord x0;
+		TCoord y0;
+		TCoord x1;
+		TCoord y1;
+
+		TCoord width() const { return x1 - x0; }
+		TCoord height() const { return y1 - y0; }
+	};
+
+	///How tiles are handed to the threads
+	enum class TileSchedule
+	{
+		///Contiguous blocks of tiles per thread, for kernels of uniform cost
+		Static,
+		///One tile at a time, for kernels whose cost depends on the content
+		Dynamic
+	};
+
+	///Partition of a sizeX x sizeY image in tiles, numbered row of tiles by row of tiles
+	class TileGrid
+	{
+	public:
+		///Tiles of a stencil kernel with a small neighbourhood : its input rows stay in the L1 / L2 caches
+		static constexpr TCoord defaultTileSizeX = 1024;
+		static constexpr TCoord defaultTileSizeY = 32;
+
+		TileGrid(TCoord sizeX, TCoord sizeY, TCoord tileSizeX = defaultTileSizeX,
+		         TCoord tileSizeY = defaultTileSizeY)
+			: sizeX(std::max<TCoord>(sizeX, 0)), sizeY(std::max<TCoord>(sizeY, 0)),
+			  tileSizeX(std::max<TCoord>(tileSizeX, 1)), tileSizeY(std::max<TCoord>(tileSizeY, 1)),
+			  tilesX((this->sizeX + this->tileSizeX - 1) / this->tileSizeX),
+			  tilesY((this->sizeY + this->tileSizeY - 1) / this->tileSizeY)
+		{
+		}
+
+		TOffset count() const { return TOffset(tilesX) * tilesY; }
+
+		///Tile i, clipped to the image
+		TileRange operator[](TOffset i) const
+		{
+			const TCoord x0 = TCoord(i % tilesX) * tileSizeX;
+			const TCoord y0 = TCoord(i / tilesX) * tileSizeY;
+			return {x0, y0, std::min(x0 + tileSizeX, sizeX), std::min(y0 + tileSizeY, sizeY)};
+		}
+
+	private:
+		TCoord sizeX;
+		TCoord sizeY;
+		TCoord tileSizeX;
+		TCoord tileSizeY;
+		TCoord tilesX;
+		TCoord tilesY;
+	};
+
+	///Call kernel(const TileRange&) on every tile of grid, tiles in parallel
+	template <class Kernel>
+	void forEachTile(const TileGrid& grid, Kernel kernel, TileSchedule schedule = TileSchedule::Static)
+	{
+		const TOffset count = grid.count();
+		if (schedule == TileSchedule::Dynamic)
+		{
+#pragma omp parallel for schedule(dynamic)
+			for (TOffset i = 0; i < count; i++)
+				kernel(grid[i]);
+		}
+		else
+		{
+#pragma omp parallel for schedule(static)
+			for (TOffset i = 0; i < count; i++)
+				kernel(grid[i]);
+		}
+	}
+
+	///Call kernel(y) on every row of a sizeY rows image, rows in parallel : for point-wise kernels, whole rows are
+	///the tiles streaming best
+	template <class Kernel>
+	void forEachRow(TCoord sizeY, Kernel kernel)
+	{
+#pragma omp parallel for schedule(static)
+		for (TCoord y = 0; y < sizeY; y++)
+			kernel(y);
+	}
+
+	/*@}*/
+}
+
+#endif
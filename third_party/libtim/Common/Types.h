@@ -21,6 +21,7 @@
 #ifndef Types_h
 #define Types_h
 
+#include <cstddef>
 #include <initializer_list>
 
 namespace LibTIM 
@@ -58,8 +59,13 @@ struct	Table{
 //Type of RGB point
 typedef Table<U8,3> RGB;
 
-//Type of image size 
-typedef unsigned short TSize;
+//Type of image size
+//Signed 32 bits by default : coordinates arithmetic stays in int, as it did through the promotion of the
+//former unsigned short, without the 65535 pixels limit. Can be overridden by defining LIBTIM_SIZE_TYPE.
+#ifndef LIBTIM_SIZE_TYPE
+#define LIBTIM_SIZE_TYPE int
+#endif
+typedef LIBTIM_SIZE_TYPE TSize;
 
 //Type of point spacing
 typedef double TSpacing;
@@ -68,10 +74,14 @@ typedef double TSpacing;
 typedef int TCoord;
 
 //Type of label
-typedef unsigned long TLabel;
+//32 bits by default (unsigned long is 64 bits on LP64 systems). Can be overridden by defining LIBTIM_LABEL_TYPE.
+#ifndef LIBTIM_LABEL_TYPE
+#define LIBTIM_LABEL_TYPE unsigned int
+#endif
+typedef LIBTIM_LABEL_TYPE TLabel;
 
-//Type of offset
-typedef  long TOffset;
+//Type of offset (pointer-sized, so that images of more than 2^31 pixels can be addressed everywhere)
+typedef std::ptrdiff_t TOffset;
 
 const float FLOAT_EPSILON=0.0000000001f;
 }